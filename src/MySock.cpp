@@ -265,14 +265,16 @@ string MySock::GetTextData()
 
 
 /*************************************************************
- *     Method: GetHTTPData()                                 *
+ *     Function: parse_http                                  *
  *************************************************************
  *  Description:                                             *
- *     We connect to an HTTP server and We Want to Read and  *
- *  identify headers and contents. We use this function      *
+ *     Identifies headers and contents of an HTTP response.  *
+ *  It doesn't care about how we got it, so blocking and     *
+ *  non-blocking sockets can use it.                         *
  *                                                           *
  * Input:                                                    *
- *     Nothing                                               *
+ *     string txtData - The whole response                   *
+ *     int &error - NO_VALID_HEADERS if we can't parse it    *
  *                                                           *
  * Output:                                                   *
  *     HTTP_Request structure - Returns headers and data     *
@@ -281,73 +283,93 @@ string MySock::GetTextData()
  *  Date      Author      Modification                       *
  *                                                           *
  *************************************************************/ 
-HTTP_Request *MySock::GetHTTPData()
+HTTP_Request *parse_http(const string &txtData, int &error)
 {
-  string txtData;
   int i=0;			// Cuenta líneas
   string::size_type pos, pos2;
   HTTP_Request *http;
   string header;
-  string value;
   bool err, data;
   char buf[255], buf2[255];
   TKey_Value hdata;
 
+  data=false;
+  err=false;
+  pos=0;
+  http=new HTTP_Request;
+  while ((!data) && (!err))
+    {
+      pos2=txtData.find("\r\n",pos);      
+      if (pos2==string::npos)
+	err=true;
+      else if (pos2==pos)
+	data=true;
+      else
+	{
+	  header=txtData.substr(pos,pos2-pos);
+	  if (i==0)
+	    {
+	      http->statusstr=header;
+	      sscanf(header.data(),"%s %s", buf, buf2); // HTTP/1.0 200
+	      http->status=atoi(buf2);
+	    }
+	  else
+	    {
+	      hdata=extract_key_value(header);
+	      if (hdata.key=="Date:")
+		http->date=hdata.value;
+	      else if (hdata.key=="Server: ")
+		http->server=hdata.value;
+	      else if (hdata.key=="Last-Modified")
+		http->last_modified=hdata.value;
+	      else if (hdata.key=="Content-Type")
+		http->content_type=hdata.value;
+	      else if (hdata.key=="Content-Length")
+		http->content_length=hdata.value;
+	    }
+	  pos=pos2+2;
+	  i++;		
+	}
+    }
+  if (err)
+    {
+      error=NO_VALID_HEADERS;
+      delete http;
+      return NULL;
+    }
+
+  http->data=txtData.substr(pos2+2); // Skip \r\n
+  return http;
+}
+
+/*************************************************************
+ *     Method: GetHTTPData()                                 *
+ *************************************************************
+ *  Description:                                             *
+ *     We connect to an HTTP server and We Want to Read and  *
+ *  identify headers and contents. We use this function      *
+ *                                                           *
+ * Input:                                                    *
+ *     Nothing                                               *
+ *                                                           *
+ * Output:                                                   *
+ *     HTTP_Request structure - Returns headers and data     *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+HTTP_Request *MySock::GetHTTPData()
+{
+  string txtData;
+
   if (this->error==NO_ERROR)
     {
       txtData=this->GetTextData();
       // Close the socket, we will analyze data
       this->closeConnection();
 
-      data=false;
-      err=false;
-      pos=0;
-      http=new HTTP_Request;
-      while ((!data) && (!err))
- 	{
-	  pos2=txtData.find("\r\n",pos);      
-	  if (pos2==string::npos)
-	      err=true;
-	  else if (pos2==pos)
-	    data=true;
-	  else
-	  {
-	    header=txtData.substr(pos,pos2-pos);
-// 	    	      cout<<header<<"*"<<endl;
-	    if (i==0)
-	      {
-		http->statusstr=header;
-		sscanf(header.data(),"%s %s", buf, buf2); // HTTP/1.0 200
-		http->status=atoi(buf2);
-	      }
-	    else
-	      {
-		hdata=extract_key_value(header);
-		if (hdata.key=="Date:")
-		  http->date=hdata.value;
-		else if (hdata.key=="Server: ")
-		  http->server=hdata.value;
-		else if (hdata.key=="Last-Modified")
-		  http->last_modified=hdata.value;
-		else if (hdata.key=="Content-Type")
-		  http->content_type=hdata.value;
-		else if (hdata.key=="Content-Length")
-		  http->content_length=hdata.value;
-		}
-	    pos=pos2+2;
-	    i++;		
-	  }
-	  
-	}
-      if (err)
-	{
-	  this->error=NO_VALID_HEADERS;
-	  return NULL;
-	}
-      else
-	http->data=txtData.substr(pos2+2); // Skip \r\n
-      
-      return http;
+      return parse_http(txtData, this->error);
     }
   return NULL;
 }
@@ -1,3 +1,6 @@
+#ifndef _MYSOCK_H_
+#define _MYSOCK_H_
+
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
@@ -60,3 +63,6 @@ private:
 };
 
 TKey_Value extract_key_value(string str);
+HTTP_Request *parse_http(const string &txtData, int &error);
+
+#endif
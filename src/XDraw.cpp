@@ -31,15 +31,26 @@
  ********************************************************************************/ 
 
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
 #include <X11/xpm.h>
 #include <X11/extensions/shape.h>
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <iostream>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string>
+#include "config.h"
 #include "XDraw.h"
 #include "errors.h"
+#include "imgload.h"
 #include <cstring>
 
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+
 using namespace std;
 
  
@@ -47,50 +58,101 @@ using namespace std;
  *     Constructor XDraw                                     *
  *************************************************************
  *  Description:                                             *
- *      Load a background image into a Window shown in a     *
- *  Display                                                  *
+ *      Loads the theme backgrounds into an atlas and starts *
+ *  with one of them, for a Window shown in a Display. The   *
+ *  headless one has no Display and draws in memory.         *
  *                                                           *
  * Input:                                                    *
  *     Display* disp - Current display                       *
  *     Window   root - Root Window where to draw             *
- *     const char data* - XPM Image data                     *
+ *     vector<const char*> files - XPM file of every theme   *
+ *     unsigned int id - Background we start with            *
+ *     int scale - Times bigger they are drawn               *
  *                                                           *
  * Change History:                                           *
  *  Date      Author      Modification                       *
  *                                                           *
  *************************************************************/ 
-XDraw::XDraw(Display* disp, Window root, const char* data) 
-
+XDraw::XDraw(Display* disp, Window root, const vector<const char*> &files, unsigned int id, int scale)
 {
    xDisplay = disp;
    defaultWin = root;
-   
-   load_bkgrnd(data);
+   Image = None;
+   Mask = None;
+   maskX = 0;
+   ownMask = false;
+   shapeMask = None;
+   shapeX = 0;
+   this->scale = 1;
+   atlas = None;
+   atlasMask = None;
+   atlasPixels = NULL;
+   damaged = false;
+   compositing = false;
+   frame = NULL;
+   shm = false;
+   uploading = false;
+   shmCompletion = -1;
+   transition = TRANSITION_NONE;
+   transitionTime = 0;
+   transPending = false;
+   transRunning = false;
+   transFrom = NULL;
+   transTo = NULL;
+   partKind = PARTICLES_NONE;
+   partBase = NULL;
+   partPixel = 0;
+   partLate = 0;
+   Attributes.valuemask = 0;
+   Attributes.width = 0;
+   Attributes.height = 0;
+
+   copyGC = XCreateGC(xDisplay, root, 0, NULL);
+   loadAtlas(files, scale);
+   if (!hasBackground(id))
+     error_handler(ERR_XPMERROR,NULL);
+   useBackground(id);
 }
 
-/*************************************************************
- *     Method: load_bkgrnd()                                 *
- *************************************************************
- *  Description:                                             *
- *     Load Xpm data as a background image.                  *
- *                                                           *
- * Input:                                                    *
- *     const char* data - XPM image data                     *
- *                                                           *
- * Output:                                                   *
- *                                                           *
- * Change History:                                           *
- *  Date      Author      Modification                       *
- *                                                           *
- *************************************************************/ 
-void XDraw::load_bkgrnd(const char* data)
+XDraw::XDraw(const vector<const char*> &files, unsigned int id, int scale)
 {
-   int error;
-
+   xDisplay = NULL;
+   defaultWin = None;
+   Image = None;
+   Mask = None;
+   maskX = 0;
+   ownMask = false;
+   shapeMask = None;
+   shapeX = 0;
+   this->scale = 1;
+   atlas = None;
+   atlasMask = None;
+   atlasPixels = NULL;
+   damaged = false;
+   compositing = true;		// There is nothing else
+   frame = NULL;
+   shm = false;
+   uploading = false;
+   shmCompletion = -1;
+   transition = TRANSITION_NONE;
+   transitionTime = 0;
+   transPending = false;
+   transRunning = false;
+   transFrom = NULL;
+   transTo = NULL;
+   partKind = PARTICLES_NONE;
+   partBase = NULL;
+   partPixel = 0;
+   partLate = 0;
    Attributes.valuemask = 0;
-   error = XpmCreatePixmapFromBuffer(xDisplay, defaultWin, (char *) data, &Image, &Mask, &Attributes);
-   if (error!=XpmSuccess)
+   Attributes.width = 0;
+   Attributes.height = 0;
+   copyGC = NULL;
+
+   loadAtlas(files, scale);
+   if (!hasBackground(id))
      error_handler(ERR_XPMERROR,NULL);
+   useBackground(id);
 }
 
 /*************************************************************
@@ -105,7 +167,19 @@ void XDraw::load_bkgrnd(const char* data)
  *************************************************************/ 
 XDraw::~XDraw() 
 {
+  destroyFrame();
+  for (map<string, TGlyphs>::iterator g=glyphs.begin(); g!=glyphs.end(); ++g)
+    XDestroyImage(g->second.cells);
+  flushBackgrounds();
   xpmfree();
+  if (copyGC)
+    XFreeGC(xDisplay, copyGC);
+  for (map<unsigned long, GC>::iterator g=gcs.begin(); g!=gcs.end(); ++g)
+    XFreeGC(xDisplay, g->second);
+  for (map<string, XFontStruct*>::iterator f=fonts.begin(); f!=fonts.end(); ++f)
+    XFreeFont(xDisplay, f->second);
+  for (map<string, GlyphAtlas*>::iterator f=ftfonts.begin(); f!=ftfonts.end(); ++f)
+    delete f->second;
 }
 
 /*************************************************************
@@ -130,32 +204,481 @@ void XDraw::xpmfree()
       XFreePixmap(xDisplay, Image);
    }
 
-   if (Mask) {
+   if ((Mask) && (ownMask)) {
       XFreePixmap(xDisplay, Mask);
    }
+   Image = None;
+   Mask = None;
 }
 
 /*************************************************************
- *     Method: replace_background()                          *
+ *     Method: hasBackground, useBackground,                 *
+ *             flushBackgrounds                              *
  *************************************************************
  *  Description:                                             *
- *    Replaces background image data in the current window   *
+ *    Backgrounds we use often (themes) are parsed once and  *
+ *  kept in the X server with their mask. We never draw into *
+ *  them: useBackground() copies one into the image, so      *
+ *  switching costs a single XCopyArea instead of parsing    *
+ *  the XPM again.                                           *
+ *    flushBackgrounds() frees them all.                     *
  *                                                           *
  * Input:                                                    *
- *    const char* bkg_data - New XPM image to replace actual *
- *                          background data                  *
+ *    unsigned int id - Background number (theme)            *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+bool XDraw::hasBackground(unsigned int id)
+{
+  return (id<backgrounds.size()) && ((backgrounds[id].pristine!=None) || (backgrounds[id].pixels!=NULL));
+}
+
+void XDraw::setImage(int width, int height, Pixmap mask, int x)
+{
+  waitUpload();
+  if (((Image==None) && (frame==NULL)) ||
+      ((int)Attributes.width!=width) || ((int)Attributes.height!=height))
+    {				// Other size, we need a new image
+      if (Image)
+	XFreePixmap(xDisplay, Image);
+      if (xDisplay!=NULL)	// Headless, frame is the image
+	Image = XCreatePixmap(xDisplay, defaultWin, width, height,
+			      DefaultDepth(xDisplay, DefaultScreen(xDisplay)));
+      Attributes.width = width;
+      Attributes.height = height;
+      particles.reset(PARTICLES_NONE, width, height, scale); // Spread them again
+      if (compositing)
+	createFrame();
+    }
+  if ((Mask) && (ownMask))
+    XFreePixmap(xDisplay, Mask);
+  Mask = mask;
+  maskX = x;
+  ownMask = false;
+}
+
+void XDraw::useBackground(unsigned int id)
+{
+  TBackground &bkg = backgrounds.at(id);
+
+  setImage(bkg.width, bkg.height, bkg.mask, bkg.x);
+  if (compositing)
+    {
+      if (bkg.pixels==NULL)	// Only the first time
+	bkg.pixels = XGetImage(xDisplay, bkg.pristine, 0, 0, bkg.width, bkg.height, AllPlanes, ZPixmap);
+      frameCopy(bkg.pixels, bkg.x, bkg.width, bkg.height);
+    }
+  else
+    XCopyArea(xDisplay, bkg.pristine, Image, copyGC, bkg.x, 0, bkg.width, bkg.height, 0, 0);
+}
+
+/*************************************************************
+ *     Method: loadBackgroundFile                            *
+ *************************************************************
+ *  Description:                                             *
+ *    Parses a background from a file with our own loader.   *
+ *  On TrueColor visuals we build the pixels                 *
+ *  ourselves from the channel masks, so the server doesn't  *
+ *  have to allocate a color for each entry of the XPM, and  *
+ *  we keep the client-side copy the compositor needs. On    *
+ *  other visuals we let libXpm do it.                       *
+ *                                                           *
+ * Input:                                                    *
+ *    unsigned int id - Background number (theme)            *
+ *    const char* file - XPM, PNG or JPEG file               *
  *                                                           *
  * Output:                                                   *
- *    Nothing                                                *
+ *    bool - False if we couldn't load it                    *
  *                                                           *
  * Change History:                                           *
  *  Date      Author      Modification                       *
  *                                                           *
  *************************************************************/ 
-void XDraw::replace_background(const char* bkg_data)
+static unsigned long to_channel(unsigned int value, unsigned long mask)
+{
+  int shift = 0, bits = 0;
+
+  while ((mask) && !(mask & 1))
+    {
+      mask >>= 1;
+      shift++;
+    }
+  while (mask & 1)
+    {
+      mask >>= 1;
+      bits++;
+    }
+  if (bits<8)
+    value >>= 8-bits;
+  else
+    value <<= bits-8;
+  return (unsigned long)value << shift;
+}
+
+/* Pixel bits that aren't a channel are the alpha when the image has a depth
+   for it: only our frames without a display, X visuals here are 24 bit */
+static inline unsigned long alpha_mask(const XImage *img)
+{
+  return (img->depth==32)?(~(img->red_mask | img->green_mask | img->blue_mask) & 0xffffffff):0;
+}
+
+void XDraw::putXpm(const TXpmImage &xpm, XImage *dst, char *bits, int x)
 {
-  xpmfree();			// Free image and mask
-  load_bkgrnd(bkg_data);
+  unsigned long red[256], green[256], blue[256]; // 8 bit channel -> pixel bits
+  unsigned long alpha = alpha_mask(dst); // Headless images keep it
+  int bpl = (dst->width+7)/8;	// XBM rows, least significant bit first
+  unsigned int argb;
+
+  for (unsigned int c=0; c<256; c++)
+    {
+      red[c] = to_channel(c, dst->red_mask);
+      green[c] = to_channel(c, dst->green_mask);
+      blue[c] = to_channel(c, dst->blue_mask);
+    }
+  for (int j=0; j<xpm.height; j++)
+    for (int i=0; i<xpm.width; i++)
+      {
+	argb = xpm.pixels[j*xpm.width+i];
+	XPutPixel(dst, x+i, j, red[(argb>>16)&0xff] | green[(argb>>8)&0xff] | blue[argb&0xff] |
+		  (argb & alpha));
+	if (argb!=XPM_TRANSPARENT)
+	  bits[j*bpl+(x+i)/8] |= 1<<((x+i)%8);
+      }
+}
+
+/*************************************************************
+ *     Method: pixelFormat, putPixels                        *
+ *************************************************************
+ *  Description:                                             *
+ *    If our images have 32 bit pixels with each channel in  *
+ *  a byte, in the order of this machine, the images from    *
+ *  the cache are already like them. putPixels() copies one  *
+ *  into dst and sets its mask bits; x must be a multiple of *
+ *  8 so the bits start in a whole byte.                     *
+ *    Otherwise they come from the cache in 0xAARRGGBB, and  *
+ *  putXpm() converts them.                                  *
+ *                                                           *
+ * Input:                                                    *
+ *    TPixelFormat &fmt - Format for the cache               *
+ *    const TPixelImage &img - Image, in that format         *
+ *    XImage *dst, char *bits - Where it goes and its mask   *
+ *    int x - Column of dst                                  *
+ *                                                           *
+ * Output:                                                   *
+ *    bool - pixelFormat(): false if we need putXpm()        *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+bool XDraw::pixelFormat(TPixelFormat &fmt)
+{
+  const uint32_t one = 1;
+  int order = (*(const char*)&one)?LSBFirst:MSBFirst;
+  XImage *probe = createImage(1, 1);
+  bool direct = (probe) && (probe->bits_per_pixel==32) && (probe->byte_order==order) &&
+    (pixfmt_make(fmt, probe->red_mask, probe->green_mask, probe->blue_mask));
+
+  if (probe)
+    XDestroyImage(probe);
+  if (!direct)
+    pixfmt_make(fmt, 0xff0000, 0xff00, 0xff);
+  return direct;
+}
+
+void XDraw::putPixels(const TPixelImage &img, const TPixelFormat &fmt, XImage *dst, char *bits, int x)
+{
+  int bpl = (dst->width+7)/8;
+
+  for (int j=0; j<img.height; j++)
+    {
+      memcpy(dst->data+j*dst->bytes_per_line+x*4, img.pixels+j*img.width, img.width*4);
+      if (img.transparent)
+	pixfmt_mask(img.pixels+j*img.width, img.width, fmt, (unsigned char*)bits+j*bpl+x/8);
+      else
+	memset(bits+j*bpl+x/8, 0xff, (img.width+7)/8);
+    }
+}
+
+bool XDraw::loadBackgroundFile(unsigned int id, const char* file)
+{
+  int screen = DefaultScreen(xDisplay);
+  Visual *visual = DefaultVisual(xDisplay, screen);
+  int depth = DefaultDepth(xDisplay, screen);
+  TBackground bkg;
+  TBackground empty = {None, None, 0, 0, 0, NULL};
+  TXpmImage xpm;
+  XpmAttributes attr;
+  char *bits;
+
+  if (hasBackground(id))
+    return true;
+
+  if (visual->c_class!=TrueColor)
+    {
+      attr.valuemask = 0;
+      if (XpmReadFileToPixmap(xDisplay, defaultWin, (char *) file, &bkg.pristine, &bkg.mask, &attr)!=XpmSuccess)
+	return false;
+      bkg.width = attr.width;
+      bkg.height = attr.height;
+      bkg.pixels = NULL;
+      XpmFreeAttributes(&attr);
+    }
+  else
+    {
+      if ((!img_load(file, xpm)) || (!xpm_scale(xpm, scale)))
+	{
+	  xpm_free(xpm);
+	  return false;
+	}
+
+      bkg.x = 0;
+      bkg.width = xpm.width;
+      bkg.height = xpm.height;
+      bkg.pixels = XCreateImage(xDisplay, visual, depth, ZPixmap, 0, NULL,
+				xpm.width, xpm.height, 32, 0);
+      bkg.pixels->data = (char*)malloc(bkg.pixels->bytes_per_line*xpm.height);
+      bits = (char*)calloc(((xpm.width+7)/8)*xpm.height, 1);
+      putXpm(xpm, bkg.pixels, bits, 0);
+
+      bkg.pristine = XCreatePixmap(xDisplay, defaultWin, xpm.width, xpm.height, depth);
+      XPutImage(xDisplay, bkg.pristine, copyGC, bkg.pixels, 0, 0, 0, 0, xpm.width, xpm.height);
+      bkg.mask = (xpm.transparent)?XCreateBitmapFromData(xDisplay, defaultWin, bits, xpm.width, xpm.height):None;
+      free(bits);
+      xpm_free(xpm);
+    }
+
+  if (id>=backgrounds.size())
+    backgrounds.resize(id+1, empty);
+  backgrounds[id] = bkg;
+  return true;
+}
+
+/*************************************************************
+ *     Method: loadAtlas                                     *
+ *************************************************************
+ *  Description:                                             *
+ *    Loads every theme background at once, side by side in  *
+ *  a single pixmap (and a single mask), so switching themes *
+ *  is a copy of a piece of it: nothing is read or allocated *
+ *  after this. It replaces every background we had.         *
+ *    Not on TrueColor visuals we load them one by one.      *
+ *                                                           *
+ * Input:                                                    *
+ *    vector<const char*> files - XPM file of each id (theme)*
+ *                                NULL ones are skipped      *
+ *    int scale - They are made scale times bigger (HiDPI)   *
+ *                                                           *
+ * Output:                                                   *
+ *    unsigned int - How many backgrounds we have loaded     *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+unsigned int XDraw::loadAtlas(const vector<const char*> &files, int scale)
+{
+  Visual *visual = (xDisplay==NULL)?NULL:DefaultVisual(xDisplay, DefaultScreen(xDisplay));
+  vector<TPixelImage> imgs(files.size());
+  TPixelFormat fmt;
+  bool direct;
+  vector<int> xs(files.size(), -1); // Where each one goes
+  TBackground empty = {None, None, 0, 0, 0, NULL};
+  int width = 0, height = 0;
+  bool transparent = false;
+  unsigned int loaded = 0;
+  char *bits;
+
+  flushBackgrounds();
+  if ((scale>0) && (scale!=this->scale)) // Font files have to be rendered again
+    {
+      for (map<string, GlyphAtlas*>::iterator f=ftfonts.begin(); f!=ftfonts.end(); ++f)
+	delete f->second;
+      ftfonts.clear();
+      layouts.clear();
+      this->scale = scale;
+    }
+
+  if ((visual) && (visual->c_class!=TrueColor))
+    {
+      for (unsigned int k=0; k<files.size(); k++)
+	if ((files[k]!=NULL) && (loadBackgroundFile(k, files[k])))
+	  loaded++;
+      return loaded;
+    }
+
+  direct = pixelFormat(fmt);	// Or they are converted pixel by pixel
+  for (unsigned int k=0; k<files.size(); k++)
+    {
+      if (files[k]==NULL)
+	continue;
+      if (!imgcache_load(files[k], this->scale, fmt, imgs[k]))
+	{
+	  verbsth(VERB_WARNING, (string)"Can't load image: "+files[k]);
+	  continue;
+	}
+      xs[k] = width;
+      width += (imgs[k].width+7)/8*8; // Whole bytes of the mask
+      height = (imgs[k].height>height)?imgs[k].height:height;
+      transparent = transparent || imgs[k].transparent;
+    }
+  if (width==0)
+    return 0;
+
+  atlasPixels = createImage(width, height);
+  bits = (char*)calloc(((width+7)/8)*height, 1);
+  for (unsigned int k=0; k<files.size(); k++)
+    if (xs[k]>=0)
+      {
+	if (direct)
+	  putPixels(imgs[k], fmt, atlasPixels, bits, xs[k]);
+	else		// Still 0xAARRGGBB
+	  {
+	    TXpmImage xpm = {imgs[k].width, imgs[k].height, imgs[k].pixels, imgs[k].transparent};
+	    putXpm(xpm, atlasPixels, bits, xs[k]);
+	  }
+      }
+
+  if (xDisplay!=NULL)		// Headless, the alpha is in the pixels
+    {
+      atlas = XCreatePixmap(xDisplay, defaultWin, width, height, DefaultDepth(xDisplay, DefaultScreen(xDisplay)));
+      XPutImage(xDisplay, atlas, copyGC, atlasPixels, 0, 0, 0, 0, width, height);
+      atlasMask = (transparent)?XCreateBitmapFromData(xDisplay, defaultWin, bits, width, height):None;
+    }
+  free(bits);
+
+  if (files.size()>backgrounds.size())
+    backgrounds.resize(files.size(), empty);
+  for (unsigned int k=0; k<files.size(); k++)
+    {
+      if (xs[k]<0)
+	continue;
+      backgrounds[k].pristine = atlas;
+      backgrounds[k].mask = (imgs[k].transparent)?atlasMask:None;
+      backgrounds[k].x = xs[k];
+      backgrounds[k].width = imgs[k].width;
+      backgrounds[k].height = imgs[k].height;
+      backgrounds[k].pixels = atlasPixels;
+      imgcache_free(imgs[k]);
+      loaded++;
+    }
+  return loaded;
+}
+
+void XDraw::flushBackgrounds()
+{
+  for (unsigned int k=0; k<backgrounds.size(); k++)
+    {
+      if ((backgrounds[k].pristine==None) || (backgrounds[k].pristine==atlas))
+	continue;		// The atlas is freed once, below
+      if (Mask==backgrounds[k].mask) // Still in use, it's ours now
+	ownMask = true;
+      else if (backgrounds[k].mask)
+	XFreePixmap(xDisplay, backgrounds[k].mask);
+      XFreePixmap(xDisplay, backgrounds[k].pristine);
+      if (backgrounds[k].pixels)
+	XDestroyImage(backgrounds[k].pixels);
+    }
+  if (atlas!=None)
+    {
+      if ((Mask==atlasMask) && (Mask))
+	ownMask = true;
+      else if (atlasMask)
+	XFreePixmap(xDisplay, atlasMask);
+      XFreePixmap(xDisplay, atlas);
+      atlas = None;
+      atlasMask = None;
+    }
+  if (atlasPixels)
+    XDestroyImage(atlasPixels);
+  atlasPixels = NULL;
+  backgrounds.clear();
+  flushFrames();		// They use the masks
+  shapeMask = None;		// Its id may be reused
+}
+
+/*************************************************************
+ *     Method: saveFrame, useFrame, dropFrame, flushFrames   *
+ *************************************************************
+ *  Description:                                             *
+ *    Keeps a copy of the image we have drawn (background    *
+ *  and text) and its mask, so drawing it again is a single  *
+ *  copy. The caller decides what a slot is (a station) and  *
+ *  drops it when what it shows changes.                     *
+ *    The mask must come from a background.                  *
+ *                                                           *
+ * Input:                                                    *
+ *    unsigned int slot - Frame number                       *
+ *                                                           *
+ * Output:                                                   *
+ *    bool - useFrame() returns false if we don't have it    *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+void XDraw::saveFrame(unsigned int slot)
+{
+  TFrame empty = {None, NULL, None, 0, 0, 0};
+  TFrame f;
+
+  if ((ownMask) || ((Image==None) && (frame==NULL)))
+    return;
+
+  dropFrame(slot);
+  f.image = None;
+  f.pixels = NULL;
+  f.mask = Mask;
+  f.maskX = maskX;
+  f.width = Attributes.width;
+  f.height = Attributes.height;
+  if (compositing)
+    f.pixels = XSubImage(frame, 0, 0, f.width, f.height);
+  else
+    {
+      f.image = XCreatePixmap(xDisplay, defaultWin, f.width, f.height,
+			      DefaultDepth(xDisplay, DefaultScreen(xDisplay)));
+      XCopyArea(xDisplay, Image, f.image, copyGC, 0, 0, f.width, f.height, 0, 0);
+    }
+
+  if (slot>=frames.size())
+    frames.resize(slot+1, empty);
+  frames[slot] = f;
+}
+
+bool XDraw::useFrame(unsigned int slot)
+{
+  if ((slot>=frames.size()) || ((frames[slot].image==None) && (frames[slot].pixels==NULL)))
+    return false;
+
+  TFrame &f = frames[slot];
+  setImage(f.width, f.height, f.mask, f.maskX);
+  if (f.pixels)
+    frameCopy(f.pixels, 0, f.width, f.height);
+  else
+    XCopyArea(xDisplay, f.image, Image, copyGC, 0, 0, f.width, f.height, 0, 0);
+  return true;
+}
+
+void XDraw::dropFrame(unsigned int slot)
+{
+  if (slot>=frames.size())
+    return;
+  if (frames[slot].image)
+    XFreePixmap(xDisplay, frames[slot].image);
+  if (frames[slot].pixels)
+    XDestroyImage(frames[slot].pixels);
+  frames[slot].image = None;
+  frames[slot].pixels = NULL;
+}
+
+void XDraw::flushFrames()
+{
+  for (unsigned int k=0; k<frames.size(); k++)
+    dropFrame(k);
+  frames.clear();
 }
 
 /*************************************************************
@@ -187,10 +710,16 @@ void XDraw::setWindowPixmap()
 
 void XDraw::setwpxmap(Window win, bool shaped)	// SetWindowPixmap
 {
+   if (xDisplay==NULL)		// No window to show it in
+     return;
    XResizeWindow(xDisplay, win, Attributes.width, Attributes.height);
    XSetWindowBackgroundPixmap(xDisplay, win, Image);
-   if (shaped)
-     XShapeCombineMask(xDisplay, win, ShapeBounding, 0, 0, Mask, ShapeSet);
+   if ((shaped) && ((Mask!=shapeMask) || (maskX!=shapeX))) // Themes share it when they come from the cache
+     {				// Out of the window, the rest of the atlas is clipped
+       XShapeCombineMask(xDisplay, win, ShapeBounding, -maskX, 0, Mask, ShapeSet);
+       shapeMask = Mask;
+       shapeX = maskX;
+     }
    XClearWindow(xDisplay, win);
 }
 
@@ -226,7 +755,7 @@ void XDraw::setDefaultWindow(Window win)
  *     Function: Sync, doxsync                               *
  *************************************************************
  *  Description:                                             *
- *     XSync the Window                                      *
+ *     Shows the image in the Window and flushes requests.   *
  *                                                           *
  * Input:                                                    *
  *   Window win - The Window                                *
@@ -247,8 +776,114 @@ void XDraw::Sync()
 
 void XDraw::doxsync(Window win)
 {
-  XClearWindow(xDisplay, win);
-  XSync(xDisplay, win);
+  uint32_t rgb;
+
+  if (transRunning)		// Something new has been drawn, it wins
+    stopTransition();
+  stopParticles();
+  if ((compositing) && (partKind!=PARTICLES_NONE) && (frame->bits_per_pixel==32))
+    {				// What has been drawn is the base of every particle frame
+      waitUpload();
+      partBase = (char*)malloc(frame->bytes_per_line*frame->height);
+      memcpy(partBase, frame->data, frame->bytes_per_line*frame->height);
+      if (particles.kind()!=partKind)	// The same weather continues in the next station
+	particles.reset(partKind, Attributes.width, Attributes.height, scale);
+      rgb = particles.color();
+      partPixel = to_channel((rgb>>16)&0xff, frame->red_mask) |
+	to_channel((rgb>>8)&0xff, frame->green_mask) | to_channel(rgb&0xff, frame->blue_mask);
+      partPixel |= alpha_mask(frame); // Seen over transparent pixels too, headless
+      clock_gettime(CLOCK_MONOTONIC, &partLast);
+      partLate = 0;
+    }
+  if (transPending)		// Show the old frame, the new one comes in steps
+    {
+      transPending = false;
+      waitUpload();
+      transTo = (char*)malloc(frame->bytes_per_line*frame->height);
+      memcpy(transTo, frame->data, frame->bytes_per_line*frame->height);
+      memcpy(frame->data, transFrom, frame->bytes_per_line*frame->height);
+      transRunning = true;
+      clock_gettime(CLOCK_MONOTONIC, &transStart);
+    }
+  damaged = false;
+  present(win, 0, 0, Attributes.width, Attributes.height);
+}
+
+/*************************************************************
+ *     Method: damage, Flush                                 *
+ *************************************************************
+ *  Description:                                             *
+ *     Drawing methods add the area they change with         *
+ *  damage(). Flush() exposes only that rectangle, instead   *
+ *  of repainting the whole window like Sync(). It's what    *
+ *  we use to animate small things.                          *
+ *                                                           *
+ * Input:                                                    *
+ *   int x, int y, int w, int h - Changed area               *
+ *   Window win - The Window                                 *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+void XDraw::damage(int x, int y, int w, int h)
+{
+  if (!damaged)
+    {
+      dmgX1 = x;
+      dmgY1 = y;
+      dmgX2 = x+w;
+      dmgY2 = y+h;
+      damaged = true;
+      return;
+    }
+  if (x<dmgX1) dmgX1 = x;
+  if (y<dmgY1) dmgY1 = y;
+  if (x+w>dmgX2) dmgX2 = x+w;
+  if (y+h>dmgY2) dmgY2 = y+h;
+}
+
+void XDraw::Flush(Window win)
+{
+  if (damaged)
+    present(win, dmgX1, dmgY1, dmgX2-dmgX1, dmgY2-dmgY1);
+  damaged = false;
+}
+
+void XDraw::Flush()
+{
+  Flush(defaultWin);
+}
+
+/*************************************************************
+ *     Method: present                                       *
+ *************************************************************
+ *  Description:                                             *
+ *     Shows an area of what we have drawn in the Window:    *
+ *  uploads it from frame when compositing, and exposes it.  *
+ *  Every frame we show goes out through here. Without a     *
+ *  display (headless) frame is the result, it does nothing. *
+ *  An empty area only flushes the requests we have sent.    *
+ *                                                           *
+ * Input:                                                    *
+ *   Window win - The Window                                 *
+ *   int x, int y, int w, int h - Area to show               *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+void XDraw::present(Window win, int x, int y, int w, int h)
+{
+  if (xDisplay==NULL)
+    return;
+  if ((w>0) && (h>0))
+    {
+      if (compositing)
+	upload(x, y, w, h);
+      XClearArea(xDisplay, win, x, y, w, h, False);
+    }
+  XFlush(xDisplay);		// No need to wait for the server
 }
 
 /*************************************************************
@@ -268,54 +903,1000 @@ void XDraw::doxsync(Window win)
  *************************************************************/ 
 void XDraw::DrawRect(int x, int y, unsigned int w, unsigned int h, XDrawColor color)
 {
-   GC           gc;
+   if (compositing)
+     {
+       waitUpload();
+       frameFill(x, y, w, h, color.pixel);
+     }
+   else
+     XFillRectangle(xDisplay, Image, getGC(color), x,y,w,h);
+   damage(x, y, w, h);
+}
+
+/*************************************************************
+ *     Method: drawSparkline                                 *
+ *************************************************************
+ *  Description:                                             *
+ *    Draws a trend in a box: a line through the values of   *
+ *  the samples, interpolated between them, over a dotted    *
+ *  band with their ranges. The box fits the lowest and the  *
+ *  highest of them. It's a few hundred pixels at most, so   *
+ *  in the server they go in a single request.               *
+ *                                                           *
+ * Input:                                                    *
+ *   int x, int y - Upper left corner of the box             *
+ *   unsigned int w, unsigned int h - Width and Height       *
+ *   XDrawColor color - Color of the line and the band       *
+ *   const vector<XDrawSample> &samples - Oldest first       *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void XDraw::drawSparkline(int x, int y, unsigned int w, unsigned int h, XDrawColor color,
+			  const vector<XDrawSample> &samples)
+{
+   int n=samples.size(), lo, hi, k, top, bottom, line, prev=0, k1;
+   vector<XPoint> points;
+   XPoint p;
+   float t, v;
+
+   if ((n==0) || (w==0) || (h==0))
+     return;
+
+   lo=samples[0].low;
+   hi=samples[0].high;
+   for (k=0; k<n; k++)
+     {
+       if (samples[k].low<lo) lo=samples[k].low;
+       if (samples[k].high>hi) hi=samples[k].high;
+     }
+
+#define SPARK_Y(v) ((hi==lo)?y+(int)h/2:y+(int)h-1-(int)(((v)-lo)*((int)h-1)/(float)(hi-lo)+0.5f))
+
+   for (int i=0; i<(int)w; i++)
+     {
+       p.x=x+i;
+       k=i*n/(int)w;		// Sample under this column
+       top=SPARK_Y(samples[k].high);
+       bottom=SPARK_Y(samples[k].low);
+       for (int j=top+1; j<bottom; j++)
+	 if ((i+j)&1)		// Dotted, so the line is seen over it
+	   {
+	     p.y=j;
+	     points.push_back(p);
+	   }
+
+       t=(i+0.5f)*n/w-0.5f;	// Between the centers of two samples
+       if (t<0) t=0;
+       if (t>n-1) t=n-1;
+       k=(int)t;
+       k1=(k+1<n)?k+1:k;
+       v=samples[k].value+(samples[k1].value-samples[k].value)*(t-k);
+       line=SPARK_Y(v);
+       if (i==0)
+	 prev=line;
+       for (int j=(prev<line)?prev:line; j<=((prev<line)?line:prev); j++)
+	 {			// Joined to the last column
+	   p.y=j;
+	   points.push_back(p);
+	 }
+       prev=line;
+     }
+#undef SPARK_Y
+
+   if (compositing)
+     {
+       waitUpload();
+       for (unsigned int j=0; j<points.size(); j++)
+	 frameFill(points[j].x, points[j].y, 1, 1, color.pixel);
+     }
+   else
+     XDrawPoints(xDisplay, Image, getGC(color), &points[0], points.size(), CoordModeOrigin);
+   damage(x, y, w, h);
+}
+
+/*************************************************************
+ *     Method: getFont, getGC                                *
+ *************************************************************
+ *  Description:                                             *
+ *    Fonts and GCs are created the first time we use them   *
+ *  and kept until the object is destroyed. Loading a font   *
+ *  is a round trip to the server, so we don't want to do it *
+ *  on every redraw.                                         *
+ *                                                           *
+ * Input:                                                    *
+ *   const char* font - Font name                            *
+ *   XDrawColor color - Foreground color of the GC           *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+XFontStruct* XDraw::getFont(const char* font)
+{
+   map<string, XFontStruct*>::iterator cached=fonts.find(font);
+   XFontStruct* fontStruct;
+
+   if (cached!=fonts.end())
+     return cached->second;
+
+   if ((fontStruct = XLoadQueryFont(xDisplay, font)) == 0)
+     error_handler(ERR_BADFONT, (char*)font);
+   fonts[font]=fontStruct;
+   return fontStruct;
+}
+
+GC XDraw::getGC(XDrawColor color)
+{
+   unsigned long pixel=color.pixel;
+   map<unsigned long, GC>::iterator cached=gcs.find(pixel);
    XGCValues    gcv;
+   GC           gc;
 
-   gcv.foreground=setColor(color);
+   if (cached!=gcs.end())
+     return cached->second;
+
+   gcv.foreground=pixel;
    gc = XCreateGC(xDisplay, Image, GCForeground, &gcv);
+   gcs[pixel]=gc;
+   return gc;
+}
+
+/*************************************************************
+ *     Method: setCompositing                                *
+ *************************************************************
+ *  Description:                                             *
+ *     When we are compositing, everything is drawn into     *
+ *  frame, an XImage in our memory, and it is uploaded to    *
+ *  the image once per frame with XShmPutImage (or with      *
+ *  XPutImage if there is no MIT-SHM, e.g. remote displays). *
+ *  We only know how to draw in TrueColor visuals, if the    *
+ *  display has other one we keep drawing in the server.     *
+ *                                                           *
+ * Input:                                                    *
+ *   bool enable - Start or stop compositing                 *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - True if we are compositing now                   *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+bool XDraw::setCompositing(bool enable)
+{
+  Visual *visual;
+
+  if ((enable==compositing) || (xDisplay==NULL)) // Headless, we always are
+    return compositing;
+  visual = DefaultVisual(xDisplay, DefaultScreen(xDisplay));
+  flushFrames();		// Saved for the other way of drawing
+
+  if (!enable)
+    {
+      waitUpload();
+      destroyFrame();
+      compositing = false;
+      return false;
+    }
+
+  if ((visual->c_class!=TrueColor) || (DefaultDepth(xDisplay, DefaultScreen(xDisplay))<24))
+    {
+      verbsth(VERB_NOTICE, "Not a TrueColor display, drawing in the server");
+      return false;
+    }
+  compositing = createFrame();
+  return compositing;
+}
+
+/*************************************************************
+ *     Method: createFrame, destroyFrame                     *
+ *************************************************************
+ *  Description:                                             *
+ *     Creates frame with the size of the image, in shared   *
+ *  memory if we can, and fills it with the image. It is the *
+ *  only time we read the image back from the server.        *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - False if we couldn't create it                   *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+static bool shm_failed;
+
+static int shm_error_handler(Display * /* disp */, XErrorEvent * /* ev */)
+{
+  shm_failed = true;
+  return 0;
+}
+
+XImage* XDraw::createImage(int width, int height)
+{
+  XImage *img;
+
+  if (xDisplay!=NULL)
+    {
+      img = XCreateImage(xDisplay, DefaultVisual(xDisplay, DefaultScreen(xDisplay)),
+			 DefaultDepth(xDisplay, DefaultScreen(xDisplay)), ZPixmap, 0, NULL,
+			 width, height, 32, 0);
+      if (img)
+	img->data = (char*)calloc(img->bytes_per_line*height, 1);
+      return img;
+    }
+
+  // XInitImage() fills the pixel functions, it doesn't need a display
+  img = (XImage*)calloc(1, sizeof(XImage));
+  img->width = width;
+  img->height = height;
+  img->format = ZPixmap;
+  img->byte_order = LSBFirst;
+  img->bitmap_unit = 32;
+  img->bitmap_bit_order = LSBFirst;
+  img->bitmap_pad = 32;
+  img->depth = 32;
+  img->bits_per_pixel = 32;
+  img->bytes_per_line = width*4;
+  img->red_mask = 0xff0000;
+  img->green_mask = 0xff00;
+  img->blue_mask = 0xff;
+  img->data = (char*)calloc(img->bytes_per_line*height, 1);
+  if (!XInitImage(img))
+    {
+      free(img->data);
+      free(img);
+      return NULL;
+    }
+  return img;
+}
+
+bool XDraw::createFrame()
+{
+  int screen, depth;
+  Visual *visual;
+  int (*old_handler)(Display *, XErrorEvent *);
+
+  destroyFrame();
 
-   XFillRectangle(xDisplay, Image, gc, x,y,w,h);
+  if (xDisplay==NULL)		// Memory only, nobody reads it but us
+    {
+      frame = createImage(Attributes.width, Attributes.height);
+      return (frame!=NULL);
+    }
+
+  screen = DefaultScreen(xDisplay);
+  visual = DefaultVisual(xDisplay, screen);
+  depth = DefaultDepth(xDisplay, screen);
+  if (XShmQueryExtension(xDisplay))
+    {
+      frame = XShmCreateImage(xDisplay, visual, depth, ZPixmap, NULL, &shminfo,
+			      Attributes.width, Attributes.height);
+      if (frame)
+	{
+	  shminfo.shmid = shmget(IPC_PRIVATE, frame->bytes_per_line*frame->height, IPC_CREAT | 0600);
+	  shminfo.shmaddr = (shminfo.shmid<0)?(char*)-1:(char*)shmat(shminfo.shmid, NULL, 0);
+	  shm = (shminfo.shmaddr!=(char*)-1);
+	  if (shm)
+	    {
+	      frame->data = shminfo.shmaddr;
+	      shminfo.readOnly = False;
+	      shm_failed = false;	// The server may not see our memory
+	      old_handler = XSetErrorHandler(shm_error_handler);
+	      XShmAttach(xDisplay, &shminfo);
+	      XSync(xDisplay, False);
+	      XSetErrorHandler(old_handler);
+	      shm = !shm_failed;
+	      if (!shm)
+		shmdt(shminfo.shmaddr);
+	    }
+	  if (shminfo.shmid>=0)		// Freed when both of us detach it
+	    shmctl(shminfo.shmid, IPC_RMID, NULL);
+	  if (!shm)
+	    {
+	      frame->data = NULL;
+	      XDestroyImage(frame);
+	      frame = NULL;
+	    }
+	  else
+	    shmCompletion = XShmGetEventBase(xDisplay)+ShmCompletion;
+	}
+    }
+
+  if (frame==NULL)		// No MIT-SHM, we'll use XPutImage
+    {
+      frame = XCreateImage(xDisplay, visual, depth, ZPixmap, 0, NULL,
+			   Attributes.width, Attributes.height, 32, 0);
+      if (frame==NULL)
+	return false;
+      frame->data = (char*)malloc(frame->bytes_per_line*frame->height);
+      verbsth(VERB_NOTICE, "MIT-SHM not available, using XPutImage");
+    }
+
+  XGetSubImage(xDisplay, Image, 0, 0, Attributes.width, Attributes.height,
+	       AllPlanes, ZPixmap, frame, 0, 0);
+  return true;
+}
+
+void XDraw::destroyFrame()
+{
+  stopTransition();
+  stopParticles();
+  if (frame==NULL)
+    return;
+  waitUpload();
+  if (shm)
+    {
+      XShmDetach(xDisplay, &shminfo);
+      shmdt(shminfo.shmaddr);
+      frame->data = NULL;	// Not malloc'ed, XDestroyImage can't free it
+      shm = false;
+    }
+  XDestroyImage(frame);
+  frame = NULL;
 }
 
 /*************************************************************
- *     Function: setColor                                    *
+ *     Method: upload, waitUpload, handleEvent               *
  *************************************************************
  *  Description:                                             *
- *     Gets unsigned long value, from rgb data. It can be    *
- *   extracted from individual ints or from a XDrawColor     *
- *   structure                                               *
+ *     upload() copies an area of frame into the image. With *
+ *  MIT-SHM the server reads our memory later, so we must    *
+ *  not draw into frame until it tells us it has finished.   *
+ *  Drawing methods call waitUpload(), that only blocks if   *
+ *  the ShmCompletion event has not arrived yet. The main    *
+ *  loop must give us the events it gets with handleEvent(). *
  *                                                           *
  * Input:                                                    *
- *   int red, int gree, int blue (rgb data)                  *
- *   or XDrawColor color (rgb data within a XDrawColor       *
- *                        structure)                         *
+ *   int x, int y, int w, int h - Area to upload             *
+ *   XEvent *ev - Event received by the main loop            *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - True if the event was for us (handleEvent)       *
  *                                                           *
  * Change History:                                           *
  *  Date      Author      Modification                       *
  *                                                           *
  *************************************************************/ 
-unsigned long XDraw::setColor(XDrawColor color)
+void XDraw::upload(int x, int y, int w, int h)
 {
-	unsigned long ret_color;
-	int r, g, b;
-	r = (int)((256-color.r) * 255) & 0xff;
-	g = (int)((256-color.g) * 255) & 0xff;
-	b = (int)((256-color.b) * 255) & 0xff;
-	
-	ret_color = (r<<16)+(g<<8)+b;
-	return ret_color;
+  waitUpload();
+  if (shm)
+    {
+      XShmPutImage(xDisplay, Image, copyGC, frame, x, y, x, y, w, h, True);
+      uploading = true;
+    }
+  else
+    XPutImage(xDisplay, Image, copyGC, frame, x, y, x, y, w, h);
 }
 
-unsigned long XDraw::setColor(int red, int green, int blue)
+static Bool is_completion(Display * /* disp */, XEvent *ev, XPointer type)
 {
-	unsigned long ret_color;
-	int r, g, b;
-	r = (int)((256-red) * 255) & 0xff;
-	g = (int)((256-green) * 255) & 0xff;
-	b = (int)((256-blue) * 255) & 0xff;
-	
-	ret_color = (r<<16)+(g<<8)+b;
-	return ret_color;
+  return (ev->type==*(int*)type);
+}
+
+void XDraw::waitUpload()
+{
+  XEvent ev;
+
+  if (uploading)
+    XIfEvent(xDisplay, &ev, is_completion, (XPointer)&shmCompletion);
+  uploading = false;
+}
+
+bool XDraw::handleEvent(XEvent *ev)
+{
+  if ((shmCompletion<0) || (ev->type!=shmCompletion))
+    return false;		// Not ours
+  uploading = false;
+  return true;
+}
+
+/*************************************************************
+ *     Method: setTransition, startTransition,               *
+ *             stepTransition, transitioning, stopTransition *
+ *************************************************************
+ *  Description:                                             *
+ *     Going from a station to another one. startTransition()*
+ *  keeps a copy of the frame we are showing; the caller     *
+ *  draws the next one as always and, when it is synced, we  *
+ *  keep it too and show the old one again. Then, each call  *
+ *  to stepTransition() mixes both of them, depending on the *
+ *  time since the start, and uploads the result, until the  *
+ *  new one is shown.                                        *
+ *     Only when compositing, with 32 bit pixels.            *
+ *                                                           *
+ * Input:                                                    *
+ *    int type - TRANSITION_*                                *
+ *    int msecs - How long it lasts                          *
+ *                                                           *
+ * Output:                                                   *
+ *    bool - stepTransition(), transitioning(): true while   *
+ *           it lasts                                        *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+void XDraw::setTransition(int type, int msecs)
+{
+  transition = (msecs>0)?type:TRANSITION_NONE;
+  transitionTime = msecs;
+}
+
+void XDraw::startTransition()
+{
+  size_t size;
+
+  stopTransition();
+  if ((!compositing) || (transition==TRANSITION_NONE) || (frame->bits_per_pixel!=32))
+    return;
+  waitUpload();
+  size = frame->bytes_per_line*frame->height;
+  transFrom = (char*)malloc(size);
+  memcpy(transFrom, frame->data, size);
+  transPending = true;
+}
+
+bool XDraw::stepTransition()
+{
+  struct timespec now;
+  long elapsed;
+  unsigned int t;
+
+  if (!transRunning)
+    return false;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = (now.tv_sec-transStart.tv_sec)*1000+(now.tv_nsec-transStart.tv_nsec)/1000000;
+  waitUpload();
+  if (elapsed>=transitionTime)
+    memcpy(frame->data, transTo, frame->bytes_per_line*frame->height);
+  else
+    {
+      t = elapsed*TRANSITION_STEPS/transitionTime;
+      if (transition==TRANSITION_SLIDE)
+	slide32(transFrom, transTo, frame->data, frame->width, frame->height, frame->bytes_per_line,
+		frame->width*t/TRANSITION_STEPS);
+      else			// Rows may be padded, fade them all
+	crossfade32((uint32_t*)transFrom, (uint32_t*)transTo, (uint32_t*)frame->data,
+		    frame->bytes_per_line/4*frame->height, t);
+    }
+  present(defaultWin, 0, 0, Attributes.width, Attributes.height);
+  if (elapsed>=transitionTime)
+    stopTransition();
+  return transRunning;
+}
+
+bool XDraw::transitioning()
+{
+  return transRunning;
+}
+
+void XDraw::stopTransition()
+{
+  free(transFrom);
+  free(transTo);
+  transFrom = NULL;
+  transTo = NULL;
+  transPending = false;
+  transRunning = false;
+}
+
+/*************************************************************
+ *     Method: setParticles, stepParticles, falling,         *
+ *             stopParticles                                 *
+ *************************************************************
+ *  Description:                                             *
+ *     Rain, snow... over the tile. When a drawing is synced *
+ *  we keep a copy of it, and each particle frame starts     *
+ *  from there: no need to erase them. The simulation moves  *
+ *  in fixed steps of PARTICLE_STEP, as many as the time     *
+ *  since the last frame (at most PARTICLE_MAX_STEPS, after  *
+ *  a pause we go on from where they were). If a frame takes *
+ *  more than PARTICLE_BUDGET we use half of the particles.  *
+ *     The caller doesn't call stepParticles() while the     *
+ *  tile can't be seen or something else is animated, and    *
+ *  then we don't use the CPU at all.                        *
+ *     Only when compositing, with 32 bit pixels.            *
+ *                                                           *
+ * Input:                                                    *
+ *    int kind - PARTICLES_*                                 *
+ *                                                           *
+ * Output:                                                   *
+ *    bool - stepParticles(), falling(): false if there      *
+ *           aren't any                                      *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+void XDraw::setParticles(int kind)
+{
+  partKind = kind;
+}
+
+bool XDraw::stepParticles()
+{
+  struct timespec now, done;
+  long elapsed;
+  int steps;
+
+  if (partBase==NULL)
+    return false;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = (now.tv_sec-partLast.tv_sec)*1000000+(now.tv_nsec-partLast.tv_nsec)/1000;
+  partLast = now;
+  partLate += elapsed;
+  steps = partLate/(PARTICLE_STEP*1000);
+  if (steps==0)
+    return true;
+  if (steps>PARTICLE_MAX_STEPS)
+    {
+      steps = PARTICLE_MAX_STEPS;
+      partLate = 0;
+    }
+  else
+    partLate -= steps*PARTICLE_STEP*1000;
+
+  waitUpload();
+  memcpy(frame->data, partBase, frame->bytes_per_line*frame->height);
+  for (int k=0; k<steps; k++)
+    particles.step();
+  particles.render((uint32_t*)frame->data, frame->bytes_per_line/4, partPixel);
+  clock_gettime(CLOCK_MONOTONIC, &done);
+  if (((done.tv_sec-now.tv_sec)*1000000+(done.tv_nsec-now.tv_nsec)/1000>PARTICLE_BUDGET) &&
+      (particles.shrink()))
+    verbsth(VERB_NOTICE, "Particles over budget, using half of them");
+
+  present(defaultWin, 0, 0, Attributes.width, Attributes.height);
+  return true;
+}
+
+bool XDraw::falling()
+{
+  return (partBase!=NULL);
+}
+
+void XDraw::stopParticles()
+{
+  free(partBase);
+  partBase = NULL;
+}
+
+/*************************************************************
+ *     Method: setFallbackFont, savePNG                      *
+ *************************************************************
+ *  Description:                                             *
+ *     Headless, we have no display: backgrounds, text and   *
+ *  rectangles are drawn into frame, with 0xAARRGGBB pixels, *
+ *  and Sync() doesn't send it anywhere. Core fonts need the *
+ *  server, so text in them is drawn with the fallback font  *
+ *  file (or not drawn at all).                              *
+ *     savePNG() writes what we have drawn as RGBA, with the *
+ *  alpha of the themes when headless, opaque otherwise.     *
+ *                                                           *
+ * Input:                                                    *
+ *    const char* font - Font file, "/path/to/font.ttf:size" *
+ *    const char* file - PNG file                            *
+ *                                                           *
+ * Output:                                                   *
+ *    bool - savePNG(): false if we couldn't write it        *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+void XDraw::setFallbackFont(const char* font)
+{
+  fallbackFont = (font!=NULL)?font:"";
+  layouts.clear();		// Widths were measured with the old one
+}
+
+static unsigned char from_channel(unsigned long pixel, unsigned long mask)
+{
+  int bits = 0;
+
+  if (mask==0)
+    return 0;
+  while (!(mask & 1))
+    {
+      mask >>= 1;
+      pixel >>= 1;
+    }
+  while (mask & (1UL<<bits))
+    bits++;
+  pixel &= mask;
+  return (bits>=8)?(pixel>>(bits-8)):(pixel*255/mask);
+}
+
+bool XDraw::savePNG(const char* file)
+{
+#ifdef HAVE_LIBPNG
+  XImage * volatile img = frame;
+  FILE *out;
+  png_structp png;
+  png_infop info;
+  unsigned char *row;
+  unsigned long pixel;
+
+  if ((!compositing) && (Image!=None))	// It's in the server
+    img = XGetImage(xDisplay, Image, 0, 0, Attributes.width, Attributes.height, AllPlanes, ZPixmap);
+  if (img==NULL)
+    return false;
+  waitUpload();
+
+  out = fopen(file, "wb");
+  png = (out)?png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL):NULL;
+  info = (png)?png_create_info_struct(png):NULL;
+  row = (unsigned char*)malloc(img->width*4);
+  if ((info==NULL) || (setjmp(png_jmpbuf(png))))
+    {
+      verbsth(VERB_WARNING, (string)"Can't write PNG file: "+file);
+      if (png)
+	png_destroy_write_struct(&png, (info)?&info:NULL);
+      if (out)
+	fclose(out);
+      free(row);
+      if (img!=frame)
+	XDestroyImage(img);
+      return false;
+    }
+
+  png_init_io(png, out);
+  png_set_IHDR(png, info, img->width, img->height, 8, PNG_COLOR_TYPE_RGB_ALPHA,
+	       PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png, info);
+  for (int j=0; j<img->height; j++)
+    {
+      for (int i=0; i<img->width; i++)
+	{
+	  pixel = XGetPixel(img, i, j);
+	  row[i*4] = from_channel(pixel, img->red_mask);
+	  row[i*4+1] = from_channel(pixel, img->green_mask);
+	  row[i*4+2] = from_channel(pixel, img->blue_mask);
+	  row[i*4+3] = (alpha_mask(img))?(pixel>>24):0xff;
+	}
+      png_write_row(png, row);
+    }
+  png_write_end(png, info);
+
+  png_destroy_write_struct(&png, &info);
+  fclose(out);
+  free(row);
+  if (img!=frame)
+    XDestroyImage(img);
+  return true;
+#else
+  verbsth(VERB_WARNING, (string)"Built without libpng, can't write: "+file);
+  return false;
+#endif
+}
+
+/*************************************************************
+ *     Method: frameFill, frameCopy                          *
+ *************************************************************
+ *  Description:                                             *
+ *     Draw into frame. Rows of 32 bits per pixel (every     *
+ *  TrueColor display we have seen) are written directly,    *
+ *  other formats use XPutPixel.                             *
+ *                                                           *
+ * Input:                                                    *
+ *   int x, int y, int w, int h - Rectangle to fill          *
+ *   unsigned long pixel - Color                             *
+ *   XImage *src - Image with the same format as frame       *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+void XDraw::frameFill(int x, int y, int w, int h, unsigned long pixel)
+{
+  int x2 = x+w, y2 = y+h;
+
+  if (x<0) x = 0;
+  if (y<0) y = 0;
+  if (x2>frame->width) x2 = frame->width;
+  if (y2>frame->height) y2 = frame->height;
+
+  for (int j=y; j<y2; j++)
+    {
+      if (frame->bits_per_pixel==32)
+	{
+	  unsigned int *row = (unsigned int*)(frame->data+j*frame->bytes_per_line);
+	  for (int i=x; i<x2; i++)
+	    row[i] = pixel;
+	}
+      else
+	for (int i=x; i<x2; i++)
+	  XPutPixel(frame, i, j, pixel);
+    }
+}
+
+void XDraw::frameCopy(XImage *src, int sx, int w, int h)
+{
+  int rows = (h<frame->height)?h:frame->height;
+  int cols = (w<frame->width)?w:frame->width;
+
+  if ((src->bits_per_pixel!=frame->bits_per_pixel) || (src->byte_order!=frame->byte_order) ||
+      (src->bits_per_pixel%8))
+    {
+      for (int j=0; j<rows; j++)
+	for (int i=0; i<cols; i++)
+	  XPutPixel(frame, i, j, XGetPixel(src, sx+i, j));
+      return;
+    }
+  for (int j=0; j<rows; j++)
+    memcpy(frame->data+j*frame->bytes_per_line,
+	   src->data+j*src->bytes_per_line+sx*src->bits_per_pixel/8,
+	   cols*src->bits_per_pixel/8);
+}
+
+/*************************************************************
+ *     Method: getGlyphs, frameString                        *
+ *************************************************************
+ *  Description:                                             *
+ *     Core fonts are rendered in the server, so we draw     *
+ *  every character of a font once into a bitmap, one cell   *
+ *  per character, and read it back. Then frameString()      *
+ *  copies the pixels of each character into frame, moving   *
+ *  the same widths XTextWidth() gives.                      *
+ *                                                           *
+ * Input:                                                    *
+ *   const char* font - Font name                            *
+ *   int x, int y - Position of the baseline                 *
+ *   const char* str, int len - Text                         *
+ *   unsigned long pixel - Color                             *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+XDraw::TGlyphs* XDraw::getGlyphs(const char* font)
+{
+  map<string, TGlyphs>::iterator cached=glyphs.find(font);
+  XFontStruct* fontStruct;
+  TGlyphs g;
+  Pixmap bitmap;
+  GC gc;
+  char ch;
+
+  if (cached!=glyphs.end())
+    return &cached->second;
+
+  fontStruct = getFont(font);
+  g.origin = (fontStruct->min_bounds.lbearing<0)?-fontStruct->min_bounds.lbearing:0;
+  g.cellw = g.origin+fontStruct->max_bounds.rbearing;
+  g.cellh = fontStruct->ascent+fontStruct->descent;
+  if (g.cellw<1) g.cellw = 1;
+  if (g.cellh<1) g.cellh = 1;
+
+  bitmap = XCreatePixmap(xDisplay, defaultWin, g.cellw*224, g.cellh, 1);
+  gc = XCreateGC(xDisplay, bitmap, 0, NULL);
+  XSetForeground(xDisplay, gc, 0);
+  XFillRectangle(xDisplay, bitmap, gc, 0, 0, g.cellw*224, g.cellh);
+  XSetForeground(xDisplay, gc, 1);
+  XSetFont(xDisplay, gc, fontStruct->fid);
+  for (int c=32; c<256; c++)	// Latin-1, like the rest of dwgo
+    {
+      ch = (char)c;
+      XDrawString(xDisplay, bitmap, gc, (c-32)*g.cellw+g.origin, fontStruct->ascent, &ch, 1);
+    }
+  g.cells = XGetImage(xDisplay, bitmap, 0, 0, g.cellw*224, g.cellh, 1, ZPixmap);
+  XFreeGC(xDisplay, gc);
+  XFreePixmap(xDisplay, bitmap);
+  if (g.cells==NULL)
+    error_handler(ERR_BADFONT, (char*)font);
+
+  glyphs[font] = g;
+  return &glyphs[font];
+}
+
+void XDraw::frameString(int x, int y, const char* font, const char* str, int len, unsigned long pixel)
+{
+  XFontStruct* fontStruct = getFont(font);
+  TGlyphs* g = getGlyphs(font);
+  int top = y-fontStruct->ascent;
+  int c, px, py;
+
+  for (int k=0; k<len; k++)
+    {
+      c = (unsigned char)str[k];
+      if (c>=32)
+	for (int j=0; j<g->cellh; j++)
+	  {
+	    py = top+j;
+	    if ((py<0) || (py>=frame->height))
+	      continue;
+	    for (int i=0; i<g->cellw; i++)
+	      {
+		px = x-g->origin+i;
+		if ((px>=0) && (px<frame->width) && (XGetPixel(g->cells, (c-32)*g->cellw+i, j)))
+		  XPutPixel(frame, px, py, pixel);
+	      }
+	  }
+      x += XTextWidth(fontStruct, str+k, 1);
+    }
+}
+
+/*************************************************************
+ *     Method: getAtlas, textWidth, textAscent, textDescent, *
+ *             blendString                                   *
+ *************************************************************
+ *  Description:                                             *
+ *     Font files are rendered once by GlyphAtlas. Their     *
+ *  glyphs are blended into an image we have in our memory   *
+ *  (frame, or a piece of Image we have read), so the edges  *
+ *  are antialiased. The text* methods measure both kinds of *
+ *  fonts.                                                   *
+ *                                                           *
+ * Input:                                                    *
+ *   const char* font - Font name or file                    *
+ *   XImage *dst - Where we draw                             *
+ *   int ox, int oy - Where dst is in Image                  *
+ *   int x, int y - Position of the baseline, in Image       *
+ *   const char* str, int len - Text                         *
+ *   unsigned long pixel - Color                             *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+GlyphAtlas* XDraw::getAtlas(const char* font)
+{
+  map<string, GlyphAtlas*>::iterator cached;
+  GlyphAtlas* atlas;
+
+  if ((!GlyphAtlas::isFile(font)) && ((xDisplay!=NULL) || (fallbackFont.empty())))
+    return NULL;
+  if (!GlyphAtlas::isFile(font))	// No server to draw it
+    font = fallbackFont.data();
+  cached = ftfonts.find(font);
+  if (cached!=ftfonts.end())
+    return cached->second;
+
+  atlas = new GlyphAtlas();
+  if (!atlas->load(font, scale))
+    error_handler(ERR_BADFONT, (char*)font);
+  ftfonts[font] = atlas;
+  return atlas;
+}
+
+int XDraw::textWidth(const char* font, const char* str, int len)
+{
+  GlyphAtlas* atlas = getAtlas(font);
+
+  if (atlas)
+    return atlas->width(str, len);
+  return XTextWidth(getFont(font), str, len);
+}
+
+int XDraw::textAscent(const char* font)
+{
+  GlyphAtlas* atlas = getAtlas(font);
+
+  return (atlas)?atlas->ascent:getFont(font)->ascent;
+}
+
+int XDraw::textDescent(const char* font)
+{
+  GlyphAtlas* atlas = getAtlas(font);
+
+  return (atlas)?atlas->descent:getFont(font)->descent;
+}
+
+static unsigned long blend_channel(unsigned long dst, unsigned long src, unsigned long mask, int alpha)
+{
+  long long d = dst & mask, s = src & mask;
+
+  return (unsigned long)(d+(s-d)*alpha/255) & mask;
+}
+
+void XDraw::blendString(XImage *dst, int ox, int oy, int x, int y, GlyphAtlas *atlas,
+			const char* str, int len, unsigned long pixel)
+{
+  const TGlyph* g;
+  const unsigned char* cov;
+  unsigned long old;
+  int px, py;
+
+  for (int k=0; k<len; k++)
+    {
+      g = atlas->glyph((unsigned char)str[k]);
+      for (int j=0; j<g->height; j++)
+	{
+	  py = y-g->top+j-oy;
+	  if ((py<0) || (py>=dst->height))
+	    continue;
+	  cov = atlas->coverage(g, j);
+	  for (int i=0; i<g->width; i++)
+	    {
+	      px = x+g->left+i-ox;
+	      if ((cov[i]==0) || (px<0) || (px>=dst->width))
+		continue;
+	      if (cov[i]==255)
+		{
+		  XPutPixel(dst, px, py, pixel);
+		  continue;
+		}
+	      old = XGetPixel(dst, px, py);
+	      XPutPixel(dst, px, py,
+			blend_channel(old, pixel, dst->red_mask, cov[i]) |
+			blend_channel(old, pixel, dst->green_mask, cov[i]) |
+			blend_channel(old, pixel, dst->blue_mask, cov[i]) |
+			(old & ~(dst->red_mask | dst->green_mask | dst->blue_mask))); // Alpha, headless
+	    }
+	}
+      x += g->advance;
+    }
+}
+
+/*************************************************************
+ *     Method: layout                                        *
+ *************************************************************
+ *  Description:                                             *
+ *     What we draw for a text: if it's wider than maxX we   *
+ *  cut it and add "...". We add the width of each character *
+ *  once and look for the cut with a binary search over      *
+ *  those sums. The result is remembered, we draw the same   *
+ *  texts again and again.                                   *
+ *                                                           *
+ * Input:                                                    *
+ *    const char* font - Font to use                         *
+ *    const char* str - Text (it's not changed)              *
+ *    int maxX - Max. width in pixels                        *
+ *                                                           *
+ * Output:                                                   *
+ *    TLayout - Text to draw and its width                   *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+const XDraw::TLayout& XDraw::layout(const char* font, const char* str, int maxX)
+{
+  char width[16];
+  string key;
+  map<string, TLayout>::iterator cached;
+  vector<int> sums;		// sums[n] = width of the first n characters
+  TLayout lay;
+  int len = strlen(str);
+  int low, high, mid;
+
+  sprintf(width, "%d", maxX);
+  key = string(font)+"\n"+width+"\n"+str;
+  cached = layouts.find(key);
+  if (cached!=layouts.end())
+    return cached->second;
+
+  sums.resize(len+1, 0);
+  for (int k=0; k<len; k++)
+    sums[k+1] = sums[k]+textWidth(font, str+k, 1);
+
+  lay.text = str;
+  lay.width = sums[len];
+  if (lay.width>maxX)
+    {
+      maxX -= textWidth(font, "...", 3);
+      low = 0;			// Largest low with sums[low]<=maxX
+      high = len;
+      while (low<high)
+	{
+	  mid = (low+high+1)/2;
+	  if (sums[mid]<=maxX)
+	    low = mid;
+	  else
+	    high = mid-1;
+	}
+      lay.text = string(str, low)+"...";
+      lay.width = textWidth(font, lay.text.data(), lay.text.length());
+    }
+
+  if (layouts.size()>=LAYOUT_CACHE)
+    layouts.clear();
+  return layouts[key] = lay;
 }
 
 /*************************************************************
@@ -329,48 +1910,66 @@ unsigned long XDraw::setColor(int red, int green, int blue)
  *     (if x==CENTER_TEXT) it will be centered.              *
  *    int maxX - max. width in pixels of the text            *
  *    XDrawColor color - Color to render the text            *
- *    char* font - Font to use                               *
- *    char* str - Text to render                             *
+ *    const char* font - Font to use                         *
+ *    const char* str - Text to render, it's not changed     *
  *                                                           *
  * Change History:                                           *
  *  Date      Author      Modification                       *
  *                                                           *
  *************************************************************/ 
-void XDraw::drawString(int x, int y, int maxX, XDrawColor color, char* font, char* str)
+void XDraw::drawString(int x, int y, int maxX, XDrawColor color, const char* font, const char* str)
 {
-   XFontStruct* fontStruct;
-   GC           gc;
-   XGCValues    gcv;
-   if ((fontStruct = XLoadQueryFont(xDisplay, font)) == 0)
-     error_handler(ERR_BADFONT, font);
-   
+   GlyphAtlas* atlas=getAtlas(font);
 
-   gcv.foreground=setColor(color);
-   gc = XCreateGC(xDisplay, Image, GCForeground, &gcv);
+   if ((xDisplay==NULL) && (atlas==NULL)) // A core font and no fallback
+     return;
+
+   const TLayout& lay=layout(font, str, maxX);
+   const char* text=lay.text.data();
+   int textLength=lay.text.length();
+   XImage* box;
+   int top, bottom, left, right;
 
-   int strLength = strlen(str);
-   int strWidth = XTextWidth(fontStruct, str, strLength);
-   if (strWidth>maxX)
+   if (x==CENTER_TEXT)
+     x = (Attributes.width / 2) - (lay.width / 2);
+
+   if ((compositing) && (atlas))
+     {
+       waitUpload();
+       blendString(frame, 0, 0, x, y, atlas, text, textLength, color.pixel);
+     }
+   else if (compositing)
      {
-       maxX=maxX-XTextWidth(fontStruct, (char*)"...", 3);
-       strLength--;
-       while (strWidth>maxX)
+       waitUpload();
+       frameString(x, y, font, text, textLength, color.pixel);
+     }
+   else if (atlas)		// Read what's under the text, blend, put it back
+     {
+       left = (x>0)?x:0;
+       top = (y-atlas->ascent>0)?y-atlas->ascent:0;
+       right = x+lay.width;
+       bottom = y+atlas->descent;
+       if (right>(int)Attributes.width) right = Attributes.width;
+       if (bottom>(int)Attributes.height) bottom = Attributes.height;
+       if ((right>left) && (bottom>top))
 	 {
-	   strLength--;
-	   strWidth = XTextWidth(fontStruct, str, strLength);
+	   box = XGetImage(xDisplay, Image, left, top, right-left, bottom-top, AllPlanes, ZPixmap);
+	   if (box)
+	     {
+	       blendString(box, left, top, x, y, atlas, text, textLength, color.pixel);
+	       XPutImage(xDisplay, Image, copyGC, box, 0, 0, left, top, right-left, bottom-top);
+	       XDestroyImage(box);
+	     }
 	 }
-       str[strLength]='\0';	// Cut string
-       strcat(str,"...");	// Add ... at the end
-       strLength=strLength+3;
      }
-   if (x==CENTER_TEXT)
-     x = (Attributes.width / 2) - (strWidth / 2);
-
-   XSetFont(xDisplay, gc, fontStruct->fid);
-   XDrawString(xDisplay, Image, gc, x, y, str, strLength);
-
-   XFreeGC(xDisplay, gc);
-   XFreeFont(xDisplay, fontStruct);
+   else
+     {
+       XFontStruct* fontStruct=getFont(font);
+       GC gc=getGC(color);
+       XSetFont(xDisplay, gc, fontStruct->fid); // Xlib skips it if the GC has it already
+       XDrawString(xDisplay, Image, gc, x, y, text, textLength);
+     }
+   damage(x, y-textAscent(font), lay.width, textAscent(font)+textDescent(font));
 }
 
 /*************************************************************
@@ -396,20 +1995,75 @@ XDraw::XDrawColor setDrawColor(int r, int g, int b)
   color.r=r;
   color.b=b;
   color.g=g;
+  color.pixel=0;		// See allocDrawColor()
   return color;
 }
 
+/*************************************************************
+ *     Function: allocDrawColor()                            *
+ *************************************************************
+ *  Description:                                             *
+ *     Finds the pixel value of a color in the display. On   *
+ *  TrueColor visuals we build it from the channel masks,    *
+ *  otherwise we ask the server for a cell of the default    *
+ *  colormap. Do it once, when the config is loaded.         *
+ *                                                           *
+ * Input:                                                    *
+ *   Display* disp - Display to use                          *
+ *   XDrawColor &color - RGB data (0-255)                    *
+ *                                                           *
+ * Output:                                                   *
+ *   XDrawColor &color - With its pixel                      *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+void allocDrawColor(Display* disp, XDraw::XDrawColor &color)
+{
+  int screen;
+  Visual *visual;
+  XColor xcolor;
+
+  if (disp==NULL)		// Headless, 0xAARRGGBB
+    {
+      color.pixel = 0xff000000 | ((color.r&0xff)<<16) | ((color.g&0xff)<<8) | (color.b&0xff);
+      return;
+    }
+  screen = DefaultScreen(disp);
+  visual = DefaultVisual(disp, screen);
+  if (visual->c_class==TrueColor)
+    {
+      color.pixel = to_channel(color.r&0xff, visual->red_mask) |
+	to_channel(color.g&0xff, visual->green_mask) |
+	to_channel(color.b&0xff, visual->blue_mask);
+      return;
+    }
+
+  xcolor.red = (color.r&0xff)*257;
+  xcolor.green = (color.g&0xff)*257;
+  xcolor.blue = (color.b&0xff)*257;
+  xcolor.flags = DoRed | DoGreen | DoBlue;
+  if (XAllocColor(disp, DefaultColormap(disp, screen), &xcolor))
+    color.pixel = xcolor.pixel;
+  else
+    {
+      verbsth(VERB_WARNING, "Can't allocate a color, using black");
+      color.pixel = BlackPixel(disp, screen);
+    }
+}
+
 /*************************************************************
  *     Function: testfont                                    *
  *************************************************************
  *  Description:                                             *
  *     Can we use this font?                                 *
  *     Tests if it is installed on the system and it is      *
- *  usable.                                                  *
+ *  usable. Font files are rendered with FreeType.           *
  *                                                           *
  * Input:                                                    *
  *    char* font - Font to test                              *
- *    Display* disp - Display to use                         *
+ *    Display* disp - Display to use (NULL when headless)    *
  *                                                           *
  * Output:                                                   *
  *   True if we can use it, false if we can't                *
@@ -421,5 +2075,15 @@ XDraw::XDrawColor setDrawColor(int r, int g, int b)
 bool testfont(const char *font, Display *disp)
 {
   XFontStruct* fontstruct;
-  return ((fontstruct = XLoadQueryFont(disp, font)) != 0);
+  GlyphAtlas atlas;
+
+  if (GlyphAtlas::isFile(font))
+    return atlas.load(font, 1);
+  if (disp==NULL)		// Headless, we'll use the fallback font
+    return true;
+
+  if ((fontstruct = XLoadQueryFont(disp, font)) == 0)
+    return false;
+  XFreeFont(disp, fontstruct);
+  return true;
 }
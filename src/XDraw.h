@@ -25,9 +25,21 @@
 #define _XPM_H_
 
 #define CENTER_TEXT  -5
+#define LAYOUT_CACHE 256	// Texts we remember how to draw
 
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
 #include <X11/xpm.h>
+#include <X11/extensions/XShm.h>
+#include "xpmload.h"
+#include "imgcache.h"
+#include "glyphatlas.h"
+#include "transition.h"
+#include "particles.h"
+#include <time.h>
+#include <vector>
+#include <map>
+#include <string>
 
 class XDraw
 {
@@ -35,9 +47,17 @@ class XDraw
   typedef struct
   {
     int r,g,b;
+    unsigned long pixel;	// In the display, see allocDrawColor()
   } XDrawColor;
 
-  XDraw(Display* disp, Window root, const char* data);
+  typedef struct
+  {
+    int low, high;		// Range of the values it stands for
+    int value;			// The line goes through it
+  } XDrawSample;
+
+  XDraw(Display* disp, Window root, const std::vector<const char*> &files, unsigned int id, int scale); /* Themes in an atlas */
+  XDraw(const std::vector<const char*> &files, unsigned int id, int scale); /* Headless: no display, draws in memory */
   virtual ~XDraw();
   void setDefaultWindow(Window win);
   void setWindowPixmap(Window win);
@@ -46,29 +66,152 @@ class XDraw
   void setWindowPixmapShaped();	/* Default window */
   void Sync(Window win);
   void Sync();		        /* Default window */
+  void Flush(Window win);	/* Only what we have drawn since the last one */
+  void Flush();			/* Default window */
 
   void DrawRect(int x, int y, unsigned int w, unsigned int h, XDrawColor color);
+  void drawSparkline(int x, int y, unsigned int w, unsigned int h, XDrawColor color,
+		     const std::vector<XDrawSample> &samples); /* Scaled to fit the box */
+
+  void drawString(int x, int y, int maxX, XDrawColor color, const char* font, const char* str);
+
+  bool hasBackground(unsigned int id);
+  bool loadBackgroundFile(unsigned int id, const char* file); /* Parse it once */
+  unsigned int loadAtlas(const std::vector<const char*> &files, int scale); /* All of them in one pixmap, scale times bigger */
+  void useBackground(unsigned int id);	/* Fresh copy into the image */
+  void flushBackgrounds();		/* Themes may have changed */
+
+  void saveFrame(unsigned int slot);	/* Keep what we have drawn */
+  bool useFrame(unsigned int slot);	/* Put it back, if we have it */
+  void dropFrame(unsigned int slot);
+  void flushFrames();
 
-  void drawString(int x, int y, int maxX, XDrawColor color, char* font, char* str);
-  void replace_background(const char* bkg_data);
+  bool setCompositing(bool enable);	/* Draw in our memory, upload once per frame */
+  bool handleEvent(XEvent *ev);		/* Give us events we may be waiting for */
+
+  void setTransition(int type, int msecs);	/* TRANSITION_*, when compositing */
+  void startTransition();	/* Before drawing something else: keeps what we show now */
+  bool stepTransition();	/* Next frame of it. False when it has finished */
+  bool transitioning();
+
+  void setParticles(int kind);	/* PARTICLES_*, over what we Sync() next, when compositing */
+  bool stepParticles();		/* Next frame of them, if it's time */
+  bool falling();		/* Are there particles to animate? */
+
+  void setFallbackFont(const char* font); /* Font file for core fonts, when headless */
+  bool savePNG(const char* file);	/* What we have drawn. Alpha only when headless */
 
  private:
-  Display*      xDisplay;
+  typedef struct
+  {
+    Pixmap pristine;		// Never drawn into. May be the atlas
+    Pixmap mask;
+    int x;			// Where it starts in pristine, mask and pixels
+    int width, height;
+    XImage *pixels;		// Client-side copy, when compositing
+  } TBackground;
+
+  typedef struct
+  {
+    std::string text;		// Cut, with "..." if it didn't fit
+    int width;
+  } TLayout;
+
+  typedef struct
+  {
+    Pixmap image;		// Drawing in the server
+    XImage *pixels;		// Or in our memory, when compositing
+    Pixmap mask;		// Belongs to a background
+    int maskX;
+    int width, height;
+  } TFrame;
+
+  typedef struct
+  {
+    XImage *cells;		// 1 bit per pixel, one cell per character
+    int cellw, cellh;		// Cell size
+    int origin;			// X of the character origin in its cell
+  } TGlyphs;
+
+  Display*      xDisplay;	// NULL when headless: frame (0xAARRGGBB) is all we have
+  std::string   fallbackFont;
   Window        defaultWin;
   XpmAttributes Attributes;
   Pixmap        Image;
   Pixmap        Mask;
+  bool          ownMask;	// False if Mask belongs to a cached background
+  int           maskX;		// Where the window starts in Mask
+  Pixmap        shapeMask;	// Last mask applied to the window
+  int           shapeX;
+  GC            copyGC;
+  std::vector<TBackground> backgrounds; // Server-side cache, by id
+  int           scale;		// Of the backgrounds and font files
+  Pixmap        atlas;		// Backgrounds side by side
+  Pixmap        atlasMask;
+  XImage*       atlasPixels;
+  std::vector<TFrame> frames;	// Finished drawings, by slot (station)
+  std::map<std::string, XFontStruct*> fonts; // Loaded fonts, by name
+  std::map<unsigned long, GC> gcs;	     // GCs, by foreground pixel
+  bool          damaged;	// Something was drawn since the last flush
+  bool          compositing;	// We draw into frame, not into Image
+  XImage*       frame;		// Client-side copy of Image
+  XShmSegmentInfo shminfo;
+  bool          shm;		// frame is in shared memory
+  bool          uploading;	// The server may be reading frame now
+  int           shmCompletion;	// Event type telling us it finished
+  std::map<std::string, TGlyphs> glyphs; // Core fonts rendered once, by name
+  std::map<std::string, GlyphAtlas*> ftfonts; // Font files rendered once, by name
+  std::map<std::string, TLayout> layouts;     // By font, max. width and text
+  int           dmgX1, dmgY1, dmgX2, dmgY2; // Area to expose
+  int           transition;	// TRANSITION_*
+  int           transitionTime;	// Milliseconds
+  bool          transPending;	// Starts with the next Sync()
+  bool          transRunning;
+  char*         transFrom;	// Copies of frame->data
+  char*         transTo;
+  struct timespec transStart;
+  ParticleSystem particles;
+  int           partKind;	// What we have been asked for
+  char*         partBase;	// Copy of frame->data without them
+  unsigned long partPixel;
+  struct timespec partLast;	// Time of the last step
+  long          partLate;	// Microseconds not simulated yet
 
   void xpmfree();
   void setwpxmap(Window win, bool shaped);
-  void load_bkgrnd(const char* data);
+  void setImage(int width, int height, Pixmap mask, int x);
   void doxsync(Window win);
-  unsigned long setColor(XDrawColor color);
-  unsigned long setColor(int red, int green, int blue);
+  void damage(int x, int y, int w, int h);
+  XFontStruct* getFont(const char* font);
+  GC getGC(XDrawColor color);
+  GlyphAtlas* getAtlas(const char* font);	/* NULL for core fonts */
+  int textWidth(const char* font, const char* str, int len);
+  int textAscent(const char* font);
+  int textDescent(const char* font);
+  const TLayout& layout(const char* font, const char* str, int maxX);
+  void blendString(XImage *dst, int ox, int oy, int x, int y, GlyphAtlas *atlas,
+		   const char* str, int len, unsigned long pixel);
+
+  XImage* createImage(int width, int height);
+  bool createFrame();
+  void destroyFrame();
+  void stopTransition();
+  void stopParticles();
+  void waitUpload();
+  void upload(int x, int y, int w, int h);
+  void present(Window win, int x, int y, int w, int h); /* The only way out to the window */
+  void frameFill(int x, int y, int w, int h, unsigned long pixel);
+  void frameCopy(XImage *src, int sx, int w, int h);
+  void putXpm(const TXpmImage &xpm, XImage *dst, char *bits, int x);
+  bool pixelFormat(TPixelFormat &fmt);
+  void putPixels(const TPixelImage &img, const TPixelFormat &fmt, XImage *dst, char *bits, int x);
+  void frameString(int x, int y, const char* font, const char* str, int len, unsigned long pixel);
+  TGlyphs* getGlyphs(const char* font);
 };
 
 bool testfont(const char *font, Display *disp);	/* Can this font be used? */
 XDraw::XDrawColor setDrawColor(int r, int g, int b);
+void allocDrawColor(Display* disp, XDraw::XDrawColor &color); /* Fills color.pixel */
 
 /* Defined outside the class, it may be used before the image is defined */
 
@@ -50,11 +50,17 @@
 #include <sys/wait.h>
 #include <math.h>
 #include <time.h>
+#include <poll.h>
 #include <X11/XKBlib.h>
 
 #include "XDraw.h"
 #include "errors.h"
 #include "localtemp.h"
+#include "scheduler.h"
+#include "resultqueue.h"
+#include "fetcher.h"
+#include "obscache.h"
+#include "history.h"
 #include "dwgo.h"
 #include "strutils.cpp"
 #include "config.h"
@@ -64,11 +70,33 @@ using namespace std;
 typedef struct
 {
   vector <localtemp *> weathers;
-  bool loaded;
-  int refresh;			// When timer reaches refresh it reloads the information
-  int counter;			// Timer
+  vector <string> names;	// Shown names, our own copies. Only the main loop uses them
+  vector <TSnapshot> shown;	// What we draw of every station. Only the main loop uses them
+  unsigned int generation;	// Given by the scheduler
+  int refresh;			// Seconds between updates of every station
+  bool adaptive;		// Learn when stations issue reports
+  bool keep_history;		// Append them to the history
+  int readers;			// Threads using this list
+  bool retired;			// Replaced by a newer list
+} Wth_generation;
+
+typedef struct
+{
+  Wth_generation *current;	// Current station list
+  pthread_mutex_t lock;		// Protects current and readers
+  ResultQueue *results;		// Tells the main loop what we are fetching
+  Scheduler *sched;		// Tells the fetch thread when to work
+  ObsCache *obs;		// Last observations, shown until we fetch them again
+  HistoryStore *history;	// Every observation, for trends
+  pthread_t thread;		// Fetch thread
 } Wth_vector;
 
+typedef struct
+{
+  Wth_generation *list;		// Acquired until the download finishes
+  unsigned int station;		// Index in the list
+} T_StationFetch;
+
 typedef struct
 {
   char station[5];		// Metar ID [ 4 characters + \0
@@ -92,6 +120,7 @@ typedef struct
   T_Point stname;		// Where to put the station name
   T_Point sttemp;		// Where to put the temperature
   T_Point sttime;		// Where to put the temperature
+  T_Point sttrend;		// Where to put its sparkline: x, width, bottom
 } T_Theme;
 
 typedef struct
@@ -108,18 +137,148 @@ typedef struct
   T_WaitBox wbox;			// Wait box
 
   int update_int;		// Update interval
+  bool adaptive_poll;		// Poll when new reports are expected
+  bool compositor;		// Draw in our memory, one upload per frame
+  int transition;		// TRANSITION_* between stations
+  int transition_time;		// Milliseconds
+  int scale;			// Everything is drawn scale times bigger
+  bool particles;		// Animate the weather over its theme
+  int cache_max_age;		// Seconds an observation is kept for the next start
+  bool history;			// Keep every observation in ~/.dwgo/history
+  int trend_hours;		// Span of the sparkline, 0 hides it
+  int bg_budget;		// Stations out of the screen fetched per minute
   char deg_unit;		// Celsius or Fahrenheit
 } DwgoConf;
 
+/*************************************************************
+ *     Function: weathers_acquire, weathers_release,         *
+ *               weathers_free                               *
+ *************************************************************
+ *  Description:                                             *
+ *     The fetch thread must acquire the station list before *
+ *  using it, and release it after that. A list replaced by  *
+ *  a reload is freed when its last reader releases it.      *
+ *  Stations kept in the new list are not deleted.           *
+ *  weathers_free() must be called with the lock held.       *
+ *                                                           *
+ * Input:                                                    *
+ *   Wth_vector *weathers - Our weather vector               *
+ *   Wth_generation *list - Station list to release/free     *
+ *                                                           *
+ * Output:                                                   *
+ *   Wth_generation* - Current station list (acquire)        *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+Wth_generation *weathers_acquire(Wth_vector *weathers)
+{
+  Wth_generation *list;
+
+  pthread_mutex_lock(&weathers->lock);
+  list=weathers->current;
+  list->readers++;
+  pthread_mutex_unlock(&weathers->lock);
+  return list;
+}
+
+void weathers_free(Wth_generation *list)
+{
+  for (unsigned int k=0; k<list->weathers.size(); k++)
+    if (--list->weathers[k]->refs==0)
+      delete list->weathers[k];
+  delete list;
+}
+
+void weathers_release(Wth_vector *weathers, Wth_generation *list)
+{
+  pthread_mutex_lock(&weathers->lock);
+  list->readers--;
+  if ((list->retired) && (list->readers==0))
+    weathers_free(list);
+  pthread_mutex_unlock(&weathers->lock);
+}
+
+/*************************************************************
+ *     Function: weathers_snapshot                           *
+ *************************************************************
+ *  Description:                                             *
+ *     Copies what we draw of a station. Only the thread     *
+ *  writing the station, or the one that just created it,    *
+ *  may call it. The main loop only gets these copies.       *
+ *                                                           *
+ * Input:                                                    *
+ *   localtemp *station - Station to copy                    *
+ *                                                           *
+ * Output:                                                   *
+ *   TSnapshot &snap - Its copy                              *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void weathers_snapshot(localtemp *station, TSnapshot &snap)
+{
+  memset(&snap, 0, sizeof(snap));
+  strncpy(snap.metar, station->metar.data(), sizeof(snap.metar)-1);
+  snap.loaded=station->loaded;
+  snap.stale=station->stale;
+  snap.celsius=station->celsius;
+  snap.fahrenheit=station->fahrenheit;
+  snap.theme=station->theme;
+  snap.info_time=station->info_time;
+  snap.report_time=station->report_time;
+}
+
+/*************************************************************
+ *     Function: weathers_take                               *
+ *************************************************************
+ *  Description:                                             *
+ *     The main loop keeps the copy a result brings. Results *
+ *  from before a reload are kept by the stations of the     *
+ *  current list with the same id, when they are done.       *
+ *                                                           *
+ * Input:                                                    *
+ *   Wth_generation *list - Current station list             *
+ *   TResult &result - Result popped from the queue          *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - The result is from this list                     *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool weathers_take(Wth_generation *list, const TResult &result)
+{
+  if (result.generation==list->generation)
+    {
+      if (result.station<list->shown.size())
+	list->shown[result.station]=result.snap;
+      return true;
+    }
+
+  if (result.state==RESULT_DONE)
+    for (unsigned int k=0; k<list->shown.size(); k++)
+      if (strcmp(list->shown[k].metar, result.snap.metar)==0)
+	list->shown[k]=result.snap;
+  return false;
+}
+
 /*************************************************************
  *     Function: fetchWeatherInfo                            *
  *************************************************************
  *  Description:                                             *
- *      Fetch weather information from the server. It        *
- *  downloads a file for every location in our vector.       *
+ *      Starts downloading a file for every location due.    *
+ *  Every download keeps its station list acquired until     *
+ *  storeWeatherInfo gets it.                                *
  *                                                           *
  * Input:                                                    *
  *   Wth_vector *weathers - Our weather vector               *
+ *   Fetcher *fetcher - Downloads running                    *
+ *   vector<unsigned int> due - Stations to fetch            *
+ *   unsigned int gen - Generation of the station list       *
  *                                                           * 
  * Output:                                                   *
  *   Nothing                                                 * 
@@ -128,33 +287,111 @@ typedef struct
  *  Date      Author             Modification                *
  * 20101106 Gaspar Fernndez     Added error status          *
  *************************************************************/  
-void fetchWeatherInfo(Wth_vector *weathers)
+void fetchWeatherInfo(Wth_vector *weathers, Fetcher *fetcher, const vector<unsigned int> &due, unsigned int gen)
 {
   Wth_vector *wths= (Wth_vector *)weathers;
-  //  bool allok=true;
-  for (unsigned int k=0; k<wths->weathers.size(); k++) {
-    localtemp *current = wths->weathers.at(k);
-    wths->loaded=false; // This will make animated bar disappear when loaded
-    
-    if (!current->getInfo())
-      {
-	verbsth(VERB_WARNING, "Don't have access to the server... I'll try later");
-	break;
-      }
-    else if (current->error)
+  T_StationFetch *job;
+  localtemp *current;
+  TSnapshot snap;
+  time_t now=time(NULL);
+
+  for (unsigned int k=0; k<due.size(); k++) {
+    job=new T_StationFetch;
+    job->list=weathers_acquire(wths); // A reload won't free it while we download
+    job->station=due[k];
+    if ((job->list->generation!=gen) || (due[k]>=job->list->weathers.size()))
       {
-	verbsth(VERB_WARNING, "Got an error while retrieving information.");
-	break;
+	if (job->list->generation!=gen) // Reloaded meanwhile, move it to the new list
+	  wths->sched->schedule(gen, due[k], now);
+	weathers_release(wths, job->list);
+	delete job;
+	continue;
       }
+
+    current = job->list->weathers.at(due[k]);
+    if (!current->stale)	// Cached ones are shown meanwhile
+      current->loaded=false;
+    weathers_snapshot(current, snap);
+    wths->results->push(gen, due[k], RESULT_FETCHING, snap); // Animated bar while we fetch it
+    verbsth(VERB_ASTTO, "Open connection: ");
+    fetcher->start(current->getURL(), now+FETCH_DEADLINE, job);
   }
-  //  wths->loaded=allok;	// All loaded
+}
+
+/*************************************************************
+ *     Function: storeWeatherInfo                            *
+ *************************************************************
+ *  Description:                                             *
+ *      Parses a finished download and tells the scheduler   *
+ *  when to fetch the station again. If it failed we try     *
+ *  again later.                                             *
+ *                                                           *
+ * Input:                                                    *
+ *   Wth_vector *weathers - Our weather vector               *
+ *   TFetched &done - Finished download                      *
+ *                                                           * 
+ * Change History:                                           *
+ *  Date      Author             Modification                *
+ *                                                           *
+ *************************************************************/  
+void storeWeatherInfo(Wth_vector *weathers, TFetched &done)
+{
+  T_StationFetch *job=(T_StationFetch *)done.data;
+  localtemp *current=job->list->weathers.at(job->station);
+  unsigned int gen=job->list->generation;
+  time_t now=time(NULL);
+  time_t next;
+  THistoryRecord rec;
+  TSnapshot snap;
+
+  if (done.error!=FETCH_CANCELLED) // Cancelled when we exit
+    {
+      if (!current->parseInfo(done.http))
+	{
+	  verbsth(VERB_WARNING, "Don't have access to the server... I'll try later");
+	  next=now+DEFAULT_RETRY_INTERVAL;
+	}
+      else if (current->error)
+	{
+	  verbsth(VERB_WARNING, "Got an error while retrieving information.");
+	  next=now+DEFAULT_RETRY_INTERVAL;
+	}
+      else
+	{
+	  current->stale=false;
+	  weathers->obs->save(current);
+	  if ((job->list->keep_history) && (HistoryStore::record(current, rec)))
+	    weathers->history->append(current->metar.data(), rec); // Unless we had this report
+	  if (job->list->adaptive)
+	    next=current->next_poll(now, job->list->refresh);
+	  else
+	    next=now+job->list->refresh;
+	}
+      if (current->stale)	// Failed, but we still have the cached one
+	current->loaded=true;
+
+      weathers->sched->schedule(gen, job->station, next);
+      weathers->history->warm(current->metar.data()); // Only the first time, so it's drawn with its trend
+      weathers_snapshot(current, snap); // Nobody else reads the station
+      weathers->results->push(gen, job->station, RESULT_DONE, snap);
+    }
+
+  delete done.http;
+  weathers_release(weathers, job->list);
+  delete job;
 }
 
 /*************************************************************
  *     Function: getWeatherInfo                              *
  *************************************************************
  *  Description:                                             *
- *    Calls fetchWeatherInfo periodically                    *
+ *    Fetch thread. Starts downloads when the scheduler says *
+ *  some stations are due and runs all of them at once with  *
+ *  a Fetcher. Sleeps until a station is due or a socket is  *
+ *  ready.                                                   *
+ *    First it reads the trend tiers of the stations we have *
+ *  from the history, so the drawing thread never does, and  *
+ *  tells the main loop to draw them again with their trend. *
  *                                                           *
  * Input:                                                    *
  *   voir *weathers - Our weather vector. It's a void type   *
@@ -169,17 +406,45 @@ void fetchWeatherInfo(Wth_vector *weathers)
  *************************************************************/ 
 void *getWeatherInfo(void *weathers)
 {
-  while (1)			// Fetch periodically temperatures
+  Wth_vector *wths=(Wth_vector *)weathers;
+  Fetcher fetcher;
+  TFetched done;
+  vector<pollfd> fds;
+  vector<unsigned int> due;
+  unsigned int gen;
+  int res;
+  Wth_generation *list;
+  TSnapshot snap;
+
+  list=weathers_acquire(wths);
+  for (unsigned int k=0; k<list->weathers.size(); k++)
     {
-      if (((Wth_vector *)weathers)->counter>=((Wth_vector *)weathers)->refresh)
-	{
-	  ((Wth_vector *)weathers)->counter=0;
-	  fetchWeatherInfo((Wth_vector *)weathers);
-	}
-      sleep(1);
-      //      fetchWeatherInfo((Wth_vector *)weathers);
-      ((Wth_vector *)weathers)->counter++;
+      wths->history->warm(list->weathers[k]->metar.data());
+      weathers_snapshot(list->weathers[k], snap);
+      wths->results->push(list->generation, k, RESULT_DONE, snap);
     }
+  weathers_release(wths, list);
+
+  while (1)
+    {
+      fds.clear();
+      fetcher.pollfds(fds);
+      res=wths->sched->wait(due, gen, MAX_FETCHES-fetcher.active(), &fds, fetcher.timeout(time(NULL)));
+      if (res==SCHED_SHUTDOWN)
+	break;
+      if (res==SCHED_FETCH)
+	fetchWeatherInfo(wths, &fetcher, due, gen);
+      else
+	fetcher.process(fds, time(NULL));
+
+      while (fetcher.next(done))
+	storeWeatherInfo(wths, done);
+    }
+
+  fetcher.cancelAll();		// Release their station lists
+  while (fetcher.next(done))
+    storeWeatherInfo(wths, done);
+
   return NULL;
 }
 
@@ -252,6 +517,7 @@ XDraw::XDrawColor load_colors(string str)
 {
   XDraw::XDrawColor color;
   sscanf(str.data(),"%d %d %d", &color.r, &color.g, &color.b);
+  color.pixel=0;		// Set when the whole config is loaded
   return color;
 }
 
@@ -280,6 +546,32 @@ void load_wbcoords(string str, T_WaitBox *wbox)
   sscanf(str.data(),"%d %d %d %d", &wbox->x1, &wbox->y1, &wbox->x2, &wbox->y2);
 }
 
+/*************************************************************
+ *     Function: scale_coords                                *
+ *************************************************************
+ *  Description:                                             *
+ *     Themes are made for 64x64, text positions are moved   *
+ *  for bigger windows. CENTER_TEXT and -1 (not defined)     *
+ *  are kept.                                                *
+ *                                                           *
+ * Input:                                                    *
+ *  T_Point &coord - Text position loaded with load_coords   *
+ *  int scale - Size multiplier                              *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void scale_coords(T_Point &coord, int scale)
+{
+  if (coord.x>=0)
+    coord.x*=scale;
+  if (coord.y>=0)
+    coord.y*=scale;
+  if (coord.z>0)
+    coord.z*=scale;
+}
+
 bool existsfilepath(const char* path, const char* file, char pathfile[])
 {
   bzero(pathfile, 256);		// Erase last data
@@ -325,6 +617,16 @@ void load_config(const char *file, DwgoConf &config, Display *disp, const char *
   datadir  =(char*)malloc(strlen(DATADIR)+5);  strcpy(datadir, DATADIR);    strcat(datadir, (char*)"/dwgo");
   config.stations.clear();	// Clear station vector
   config.update_int=0;
+  config.adaptive_poll=true;
+  config.compositor=DEFAULT_COMPOSITOR;
+  config.transition=DEFAULT_TRANSITION;
+  config.transition_time=DEFAULT_TRANSITION_TIME;
+  config.scale=DEFAULT_SCALE;
+  config.particles=DEFAULT_PARTICLES;
+  config.cache_max_age=DEFAULT_CACHE_MAX_AGE;
+  config.history=DEFAULT_HISTORY;
+  config.trend_hours=DEFAULT_TREND_HOURS;
+  config.bg_budget=DEFAULT_BG_BUDGET;
   config.deg_unit=DEFAULT_DEG_UNIT;
   inFile.open(file) ;
 
@@ -413,6 +715,8 @@ void load_config(const char *file, DwgoConf &config, Display *disp, const char *
 			  config.metar_themes[aux].sttime=load_coords(b);
 			else if (c=="tmploc") // Where to put the temperature text
 			  config.metar_themes[aux].sttemp=load_coords(b);
+			else if (c=="trendloc") // Where to put the temperature sparkline
+			  config.metar_themes[aux].sttrend=load_coords(b);
 			else if (c=="textcolor") // Station name text color
 			  config.metar_themes[aux].text_color=load_colors(b);
 			else if (c=="timecolor") // Time text color
@@ -436,6 +740,33 @@ void load_config(const char *file, DwgoConf &config, Display *disp, const char *
 		  }
 		else if (a=="update_interval") // Weather will update each (update_interval) seconds
 		  config.update_int=atoi(b.data());
+		else if (a=="adaptive_poll") // Poll often when a new report is expected, rarely otherwise
+		  config.adaptive_poll=(atoi(b.data())!=0);
+		else if (a=="background_budget") // Max. fetches per minute of stations we are not looking at
+		  config.bg_budget=atoi(b.data());
+		else if (a=="compositor") // Compose frames in our memory and upload them at once
+		  config.compositor=(atoi(b.data())!=0);
+		else if (a=="transition") // How we go from a station to another one
+		  {
+		    if (b=="fade")
+		      config.transition=TRANSITION_FADE;
+		    else if (b=="slide")
+		      config.transition=TRANSITION_SLIDE;
+		    else
+		      config.transition=TRANSITION_NONE;
+		  }
+		else if (a=="transition_time")
+		  config.transition_time=atoi(b.data());
+		else if (a=="scale") // HiDPI, theme images and font files are scaled once when loaded
+		  config.scale=atoi(b.data());
+		else if (a=="particles") // Rain, snow, hail, fog and dust falling over their themes
+		  config.particles=(atoi(b.data())!=0);
+		else if (a=="cache_max_age") // Last observations older than this aren't shown when we start
+		  config.cache_max_age=atoi(b.data());
+		else if (a=="history") // Keep every observation, for trends
+		  config.history=(atoi(b.data())!=0);
+		else if (a=="trend_hours") // Sparkline of the temperature in the last hours
+		  config.trend_hours=atoi(b.data());
 		else if (a=="deg_unit") // (C)elsius or (F)ahrenheit
 		  config.deg_unit=b[0]; // Only first char
 
@@ -470,6 +801,42 @@ void load_config(const char *file, DwgoConf &config, Display *disp, const char *
       if (config.metar_themes[DEFAULT_THEME].temp_color.r==-1)
 	error_handler(ERR_BADDFECLR,NULL);      
 
+      // Pixel values of the colors, so we don't look for them when drawing
+      for (int j=0; j<TOTAL_THEMES; j++)
+	{
+	  if (config.metar_themes[j].text_color.r!=-1)
+	    allocDrawColor(disp, config.metar_themes[j].text_color);
+	  if (config.metar_themes[j].time_color.r!=-1)
+	    allocDrawColor(disp, config.metar_themes[j].time_color);
+	  if (config.metar_themes[j].temp_color.r!=-1)
+	    allocDrawColor(disp, config.metar_themes[j].temp_color);
+	}
+      allocDrawColor(disp, config.wbox.in_color);
+      allocDrawColor(disp, config.wbox.out_color);
+      allocDrawColor(disp, config.wbox.bar_color);
+
+      // HiDPI. Coordinates are given for 64x64, CENTER_TEXT and -1 are kept
+      if ((config.scale<1) || (config.scale>MAX_SCALE))
+	config.scale=DEFAULT_SCALE;
+      if ((config.scale>1) && (disp!=NULL) && (DefaultVisual(disp, DefaultScreen(disp))->c_class!=TrueColor))
+	{
+	  verbsth(VERB_WARNING, "scale needs a TrueColor visual, using 1");
+	  config.scale=1;
+	}
+      if (config.scale>1)
+	{
+	  for (int j=0; j<TOTAL_THEMES; j++)
+	    {
+	      scale_coords(config.metar_themes[j].stname, config.scale);
+	      scale_coords(config.metar_themes[j].sttemp, config.scale);
+	      scale_coords(config.metar_themes[j].sttime, config.scale);
+	      scale_coords(config.metar_themes[j].sttrend, config.scale);
+	    }
+	  config.wbox.x1*=config.scale;
+	  config.wbox.y1*=config.scale;
+	  config.wbox.x2*=config.scale;
+	  config.wbox.y2*=config.scale;
+	}
     }
     else
       error_handler(ERR_CFGNOTFOUND,NULL);
@@ -513,21 +880,111 @@ int time_diff ()
   return (local_s-gmt_s);
 }
 
+/*************************************************************
+ *     Function: theme_files                                 *
+ *************************************************************
+ *  Description:                                             *
+ *     XPM file of each theme, to load them in the atlas.    *
+ *  Themes without image (or missing files) are NULL.        *
+ *                                                           *
+ * Input:                                                    *
+ *    DwgoConf cfg - Configuration                           *
+ *                                                           *
+ * Output:                                                   *
+ *    vector<const char*> - One file per theme               *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+vector<const char*> theme_files(const DwgoConf &cfg)
+{
+  vector<const char*> files(TOTAL_THEMES, (const char*)NULL);
+
+  for (int j=0; j<TOTAL_THEMES; j++)
+    if ((cfg.metar_themes[j].img!=NULL) && (file_exists(cfg.metar_themes[j].img)))
+      files[j]=cfg.metar_themes[j].img;
+  return files;
+}
+
+/*************************************************************
+ *     Function: theme_particles                             *
+ *************************************************************
+ *  Description:                                             *
+ *     What falls over each theme, if anything.              *
+ *                                                           *
+ * Input:                                                    *
+ *    int theme - *_THEME                                    *
+ *                                                           *
+ * Output:                                                   *
+ *    int - PARTICLES_*                                      *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+int theme_particles(int theme)
+{
+  switch (theme)
+    {
+    case RAINY_THEME: return PARTICLES_RAIN;
+    case SNOWY_THEME: return PARTICLES_SNOW;
+    case HAIL_THEME:  return PARTICLES_HAIL;
+    case FOG_THEME:   return PARTICLES_FOG;
+    case DUST_THEME:  return PARTICLES_DUST;
+    default:          return PARTICLES_NONE;
+    }
+}
+
+/*************************************************************
+ *     Function: format_age                                  *
+ *************************************************************
+ *  Description:                                             *
+ *     How old an observation is, short enough for the time  *
+ *  of the report: "25m ago", "3h ago", "2d ago".            *
+ *                                                           *
+ * Input:                                                    *
+ *    char *buf, size_t len - Where to write it              *
+ *    time_t age - Seconds                                   *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+void format_age(char *buf, size_t len, time_t age)
+{
+  if (age<0)
+    age=0;
+  if (age<3600)
+    snprintf(buf, len, "%dm ago", (int)(age/60));
+  else if (age<48*3600)
+    snprintf(buf, len, "%dh ago", (int)(age/3600));
+  else
+    snprintf(buf, len, "%dd ago", (int)(age/86400));
+}
+
 /*************************************************************
  *     Function: displaytemp                                 *
  *************************************************************
  *  Description:                                             *
  *    Draws an image inside the dockapp and renders text     *
  *  with location name, temperature and time when the data   *
- *  was taken.                                               *
+ *  was taken (its age, if it comes from the cache).         *
+ *    Beside the temperature, if the theme says where, goes  *
+ *  a sparkline of the last trend_hours of it, read from the *
+ *  tiers the history keeps, not from every observation.     *
+ *    The finished drawing is kept for each station, until   *
+ *  the main loop drops it, so next time it's a single copy. *
  *                                                           *
  * Input:                                                    *
  *     XDraw *image - Image which will be drawn in the       *
  *                    dockapp.                               *
  *     DwgoConf cfg - Configuration                          *
- *     localtemp local_stt - Local Station information       *
+ *     TSnapshot &snap - What we show of the station         *
+ *     const string &name - Its name, from the station list  *
+ *     HistoryStore *history - Where its trend is            *
  *     int tm_diff  - Time difference (see time_diff() func.)*
- *     char *xpmthemes - XPM images to display               *
+ *     unsigned int station - Where it is in the list        *
  *                                                           *
  * Output:                                                   *
  *     Nothing                                                      *
@@ -536,32 +993,34 @@ int time_diff ()
  *  Date      Author      Modification                       *
  *                                                           *
  *************************************************************/ 
-void displaytemp(XDraw *image, const DwgoConf cfg, localtemp *local_stt, int tm_diff, char *xpm_themes[])
+void displaytemp(XDraw *image, const DwgoConf cfg, const TSnapshot &snap, const string &name, HistoryStore *history, int tm_diff, unsigned int station)
 {
    char tmp_disp[10];		// Aux to display temperature
    char *txt_font;
    char *tmp_font;
    char *tim_font;
-   int theme=local_stt->theme;
+   int theme=snap.theme;
    XDraw::XDrawColor txcolor, ticolor, tecolor;
-   T_Point sttemp, sttext, sttime;
+   T_Point sttemp, sttext, sttime, sttrend;
+   vector<TTrendPoint> trend;
+   vector<XDraw::XDrawSample> samples;
+   XDraw::XDrawSample sample;
    time_t time_taking;
    struct tm *moment;
 
-   // We load each xpm_themes image when it is needed.
-   if (xpm_themes[theme]==NULL)
+   image->setParticles((cfg.particles)?theme_particles(theme):PARTICLES_NONE);
+   if (image->useFrame(station)) // Nothing changed since we drew it
      {
-       if (file_exists(cfg.metar_themes[theme].img))
-	 {
-	   XpmReadFileToBuffer(cfg.metar_themes[theme].img, &xpm_themes[theme]);
-	   verbsth(VERB_NOTICE, (string)"Loading img. theme: "+cfg.metar_themes[theme].img);
-	 }
-       else
-	 {			// If xpm file doesn't exists we load the default theme
-	   local_stt->theme=DEFAULT_THEME;
-	   theme=DEFAULT_THEME;
-	 }
+       image->setWindowPixmapShaped();
+       image->Sync();
+       return;
+     }
 
+   // Theme images are all in the atlas since the config was loaded
+   if (!image->hasBackground(theme))
+     {				// If xpm file couldn't be loaded we use the default theme
+       theme=DEFAULT_THEME;
+       image->setParticles(PARTICLES_NONE);
      }
 
    // We do some checks and we change theme details to default details when we can't use them.
@@ -583,11 +1042,11 @@ void displaytemp(XDraw *image, const DwgoConf cfg, localtemp *local_stt, int tm_
 
    // (C)elsius of (F)ahrenheit
    if (cfg.deg_unit=='F')
-     sprintf(tmp_disp, "%d "DEG_SYMBOL"F", local_stt->fahrenheit);
+     sprintf(tmp_disp, "%d "DEG_SYMBOL"F", snap.fahrenheit);
    else
-     sprintf(tmp_disp, "%d "DEG_SYMBOL"C", local_stt->celsius);
+     sprintf(tmp_disp, "%d "DEG_SYMBOL"C", snap.celsius);
 
-   image->replace_background(xpm_themes[theme]); // Load the background image
+   image->useBackground(theme);	// Clean copy of the background image
    image->setWindowPixmapShaped();
 
    // If y position of the text is -1 in the current theme, it will be replaced with default theme position.
@@ -595,6 +1054,7 @@ void displaytemp(XDraw *image, const DwgoConf cfg, localtemp *local_stt, int tm_
    sttemp=(cfg.metar_themes[theme].sttemp.y>-1)?cfg.metar_themes[theme].sttemp:cfg.metar_themes[0].sttemp;
    sttext=(cfg.metar_themes[theme].stname.y==-1)?cfg.metar_themes[DEFAULT_THEME].stname:cfg.metar_themes[theme].stname;
    sttime=(cfg.metar_themes[theme].sttime.y==-1)?cfg.metar_themes[DEFAULT_THEME].sttime:cfg.metar_themes[theme].sttime;
+   sttrend=(cfg.metar_themes[theme].sttrend.y==-1)?cfg.metar_themes[DEFAULT_THEME].sttrend:cfg.metar_themes[theme].sttrend;
 
    // Test current theme color
    // If red value of the color is -1, the color will be replaced with the default.
@@ -603,17 +1063,37 @@ void displaytemp(XDraw *image, const DwgoConf cfg, localtemp *local_stt, int tm_
    tecolor=(cfg.metar_themes[theme].temp_color.r==-1)?cfg.metar_themes[DEFAULT_THEME].temp_color:cfg.metar_themes[theme].temp_color;
 
    // Draw strings
-   image->drawString(sttemp.x, sttemp.y, sttemp.z, tecolor, (char*)tmp_font, tmp_disp);
+   image->drawString(sttemp.x, sttemp.y, sttemp.z, tecolor, tmp_font, tmp_disp);
+   if ((sttrend.y>-1) && (cfg.trend_hours>0) && (snap.loaded) && (history!=NULL) &&
+       (history->trend(snap.metar, snap.report_time-cfg.trend_hours*3600+1,
+		       snap.report_time+1, 0, trend)>1))
+     {				// A few dozen points, from the tiers of the history
+       for (unsigned int k=0; k<trend.size(); k++)
+	 {
+	   sample.low=trend[k].min;
+	   sample.high=trend[k].max;
+	   sample.value=trend[k].mean;
+	   samples.push_back(sample);
+	 }
+       image->drawSparkline(sttrend.x, sttrend.y-DEFAULT_TREND_HEIGHT*cfg.scale, sttrend.z,
+			    DEFAULT_TREND_HEIGHT*cfg.scale, tecolor, samples);
+     }
    if (sttext.y>-1)
-     image->drawString(sttext.x, sttext.y, sttext.z, txcolor, (char*)txt_font, (char*)local_stt->location_name.data());
-   if ((sttime.y>-1) && (local_stt->loaded))
+     image->drawString(sttext.x, sttext.y, sttext.z, txcolor, txt_font, name.data());
+   if ((sttime.y>-1) && (snap.loaded) && (snap.stale))
+     {				// From the cache, we tell how old it is instead
+       format_age(tmp_disp, sizeof(tmp_disp), time(NULL)-snap.report_time);
+       image->drawString(sttime.x, sttime.y, sttime.z, ticolor, tim_font, tmp_disp);
+     }
+   else if ((sttime.y>-1) && (snap.loaded))
      {
-       time_taking=local_stt->info_time+tm_diff; // Translates to local time
+       time_taking=snap.info_time+tm_diff; // Translates to local time
        moment=localtime(&time_taking);
        sprintf(tmp_disp, "%.2d:%.2d", moment->tm_hour,moment->tm_min); // Makes it 00:00
-       image->drawString(sttime.x, sttime.y, sttime.z, ticolor, (char*)tim_font, (char*)tmp_disp);
+       image->drawString(sttime.x, sttime.y, sttime.z, ticolor, tim_font, tmp_disp);
      }
 
+     image->saveFrame(station);
      image->Sync();
 
 }
@@ -638,7 +1118,7 @@ void displaytemp(XDraw *image, const DwgoConf cfg, localtemp *local_stt, int tm_
 void config_defaults(DwgoConf *Dwgo_Configuration)
 {
    const T_Point def_sttemp = DEFAULT_STTEMP;
-   const XDraw::XDrawColor clnull = DEFAULT_STTEMP;
+   const XDraw::XDrawColor clnull = setDrawColor(-1,-1,-1);
 
    Dwgo_Configuration->wbox.x1=2;
    Dwgo_Configuration->wbox.x2=62;
@@ -656,6 +1136,7 @@ void config_defaults(DwgoConf *Dwgo_Configuration)
        Dwgo_Configuration->metar_themes[j].sttemp=def_sttemp;
        Dwgo_Configuration->metar_themes[j].stname=def_sttemp;
        Dwgo_Configuration->metar_themes[j].sttime=def_sttemp;
+       Dwgo_Configuration->metar_themes[j].sttrend=def_sttemp;
        Dwgo_Configuration->metar_themes[j].text_color=clnull;
        Dwgo_Configuration->metar_themes[j].temp_color=clnull;
        Dwgo_Configuration->metar_themes[j].time_color=clnull;
@@ -667,16 +1148,22 @@ void config_defaults(DwgoConf *Dwgo_Configuration)
  *     Function: weathers_create_list                        *
  *************************************************************
  *  Description:                                             *
- *     Fills the Wth_vector weathers vector with the         *
- *  stations loaded from the confiuration file. And flag     *
- *  the structure to update.                                 *
+ *     Builds a new station list with the stations loaded    *
+ *  from the confiuration file, and replaces the current one *
+ *  with it. Stations we already had are kept with all their *
+ *  data, so they don't need to be fetched again. The old    *
+ *  list is freed when nobody is using it.                   *
+ *    A fetch of the old list may still be writing a station *
+ *  we keep, so we don't change it: the names we show are    *
+ *  copies of the new list, only the observation and what we *
+ *  have learned of the station are carried forward.         *
  *                                                           *
  * Input:                                                    *
  *   Wth_vector *weathers -                                  *
  *   DwgoConf Dwgo_Configuration - Where to get the data from*
  *                                                           *
  * Output:                                                   *
- *   Wth_vector - We will fill in the weathers vector here.  *
+ *   Wth_vector - The new list will be here.                 *
  *                                                           *
  * Change History:                                           *
  *  Date      Author      Modification                       *
@@ -684,17 +1171,63 @@ void config_defaults(DwgoConf *Dwgo_Configuration)
  *************************************************************/ 
 void weathers_create_list(Wth_vector *weathers, DwgoConf Dwgo_Configuration)
 {
-   weathers->counter=Dwgo_Configuration.update_int; // Refresh now !!
-   weathers->refresh=Dwgo_Configuration.update_int; // Refresh now !!
+   Wth_generation *old=weathers->current;
+   Wth_generation *list=new Wth_generation;
+   vector<bool> taken((old!=NULL)?old->weathers.size():0, false);
+   vector<int> from;		// Index of every station in the old list
+   localtemp *station;
+   TSnapshot snap;
+   int found;
+
+   weathers->obs->setMaxAge(Dwgo_Configuration.cache_max_age);
+
+   list->refresh=Dwgo_Configuration.update_int; // Published with the list
+   list->adaptive=Dwgo_Configuration.adaptive_poll;
+   list->keep_history=Dwgo_Configuration.history;
+   list->readers=0;
+   list->retired=false;
+   for (unsigned int k=0; k<Dwgo_Configuration.stations.size(); k++)
+     {
+       found=-1;
+       for (unsigned int j=0; j<taken.size(); j++)
+	 if ((!taken[j]) && (old->weathers[j]->metar==Dwgo_Configuration.stations.at(k).station))
+	   {
+	     found=j;
+	     taken[j]=true;
+	     break;
+	   }
+       if (found>=0)		// We already have it, its name may have changed
+	 {
+	   station=old->weathers[found]; // The old list may be fetching it now, we don't touch it
+	   snap=old->shown[found];
+	 }
+       else
+	 {
+	   station=new localtemp((char*)Dwgo_Configuration.stations.at(k).station,
+				 (char*)Dwgo_Configuration.stations.at(k).name);
+	   weathers->obs->restore(station); // Shown while it's fetched
+	   weathers_snapshot(station, snap); // Nobody fetches it yet
+	 }
+       list->weathers.push_back(station);
+       list->names.push_back(Dwgo_Configuration.stations.at(k).name);
+       list->shown.push_back(snap);
+       from.push_back(found);
+     }
 
+   weathers->sched->setBudget(Dwgo_Configuration.bg_budget);
 
-   weathers->loaded=false;
-   weathers->weathers.clear();
-   
-   for (unsigned int k=0; k<Dwgo_Configuration.stations.size(); k++)
-     weathers->weathers.push_back(new localtemp((char*)Dwgo_Configuration.stations.at(k).station,
-						 (char*)Dwgo_Configuration.stations.at(k).name));
-   
+   pthread_mutex_lock(&weathers->lock);
+   for (unsigned int k=0; k<list->weathers.size(); k++)
+     list->weathers[k]->refs++;	// Kept ones are shared with retired lists
+   list->generation=weathers->sched->reset(from); // Refresh new ones now !!
+   weathers->current=list;
+   if (old!=NULL)
+     {
+       old->retired=true;
+       if (old->readers==0)
+	 weathers_free(old);
+     }
+   pthread_mutex_unlock(&weathers->lock);
 }
 
 /*************************************************************
@@ -709,6 +1242,7 @@ void weathers_create_list(Wth_vector *weathers, DwgoConf Dwgo_Configuration)
  *  Wth_vector - Where the weather info will be stored       *
  *  DwgoConf Dwgo_Configuration - Configuration loaded from  *
  *                                file                       *
+ *  bool fetch - False to only build the list (benchmarks)   *
  *                                                           *
  * Output:                                                   *
  *  Nothing                                                  *
@@ -717,20 +1251,24 @@ void weathers_create_list(Wth_vector *weathers, DwgoConf Dwgo_Configuration)
  *  Date      Author      Modification                       *
  *                                                           *
  *************************************************************/ 
-void weathers_loader(Wth_vector *weathers, DwgoConf Dwgo_Configuration)
+void weathers_loader(Wth_vector *weathers, DwgoConf Dwgo_Configuration, bool fetch)
 {
   Wth_vector *th_parm;
-  pthread_t *threads;
   pthread_attr_t pthread_custom_attr;
 
+  weathers->current=NULL;
+  pthread_mutex_init(&weathers->lock, NULL);
+  weathers->sched=new Scheduler();
+  weathers->results=new ResultQueue();
   weathers_create_list(weathers, Dwgo_Configuration);
+  if (!fetch)
+    return;
 
-   threads=(pthread_t *)malloc(1*sizeof(*threads));
    pthread_attr_init(&pthread_custom_attr);
    
    th_parm=weathers;
 
-   pthread_create(threads, &pthread_custom_attr, getWeatherInfo, (void *)(th_parm));
+   pthread_create(&weathers->thread, &pthread_custom_attr, getWeatherInfo, (void *)(th_parm));
 }
 
 /*************************************************************
@@ -818,6 +1356,89 @@ char *locateConfig(const char* homeuser)
     return NULL;
 }
 
+/*************************************************************
+ *     Function: headless                                    *
+ *************************************************************
+ *  Description:                                             *
+ *     Runs without X. With rounds>0 every station is drawn  *
+ *  that many times, from scratch and from its saved frame,  *
+ *  and we tell how long a displaytemp() takes. Otherwise we *
+ *  are a daemon: each station is drawn when it's fetched    *
+ *  and saved as dir/ICAO.png, for other dashboards.         *
+ *                                                           *
+ * Input:                                                    *
+ *    Wth_vector *weathers - Stations (fetching, if daemon)  *
+ *    DwgoConf &cfg - Configuration                          *
+ *    const char* dir - Where the PNG files go               *
+ *    int rounds - Benchmark rounds, 0 for the daemon        *
+ *    const char* font - Font file for core fonts, or NULL   *
+ *    int tm_diff - Time difference (see time_diff() func.)  *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+void headless(Wth_vector *weathers, DwgoConf &cfg, const char* dir, int rounds, const char* font, int tm_diff)
+{
+  XDraw *image = new XDraw(theme_files(cfg), DEFAULT_THEME, cfg.scale);
+  vector<TSnapshot> &list = weathers->current->shown;
+  struct timespec start, end;
+  double drawn = 0, cached = 0;
+  pollfd fds[1];
+  TResult result;
+  string file;
+
+  image->setFallbackFont(font);
+  if (font==NULL)
+    verbsth(VERB_WARNING, "Headless without -f, texts in core fonts won't be drawn");
+
+  if (rounds>0)
+    {
+      for (unsigned int k=0; k<list.size(); k++)
+	weathers->history->warm(list[k].metar); // Read once, not measured
+      for (int r=0; r<rounds; r++)
+	for (unsigned int k=0; k<list.size(); k++)
+	  {
+	    image->dropFrame(k);
+	    clock_gettime(CLOCK_MONOTONIC, &start);
+	    displaytemp(image, cfg, list.at(k), weathers->current->names.at(k), weathers->history, tm_diff, k);
+	    clock_gettime(CLOCK_MONOTONIC, &end);
+	    drawn += (end.tv_sec-start.tv_sec)*1e6+(end.tv_nsec-start.tv_nsec)/1e3;
+	    clock_gettime(CLOCK_MONOTONIC, &start);
+	    displaytemp(image, cfg, list.at(k), weathers->current->names.at(k), weathers->history, tm_diff, k);
+	    clock_gettime(CLOCK_MONOTONIC, &end);
+	    cached += (end.tv_sec-start.tv_sec)*1e6+(end.tv_nsec-start.tv_nsec)/1e3;
+	  }
+      rounds *= list.size();
+      if (rounds>0)
+	printf("displaytemp: %d frames, %.1f us drawn, %.1f us from the frame cache\n",
+	       rounds, drawn/rounds, cached/rounds);
+      delete image;
+      return;
+    }
+
+  fds[0].fd=weathers->results->fd();
+  fds[0].events=POLLIN;
+  while (true)
+    {
+      while (weathers->results->pop(result))
+	{
+	  if ((!weathers_take(weathers->current, result)) || (result.state!=RESULT_DONE))
+	    continue;
+	  image->dropFrame(result.station);
+	  displaytemp(image, cfg, list.at(result.station), weathers->current->names.at(result.station), weathers->history, tm_diff, result.station);
+	  file = (string)dir+"/"+list.at(result.station).metar+".png";
+	  if (image->savePNG(file.data()))
+	    verbsth(VERB_NOTICE, "Saved "+file);
+	}
+      if (poll(fds, 1, -1)<0 && errno!=EINTR)
+	break;
+      if (fds[0].revents & POLLIN)
+	weathers->results->drain();
+    }
+  delete image;
+}
+
 // Main application
 int main(int argc, char** argv) {
  
@@ -827,7 +1448,6 @@ int main(int argc, char** argv) {
    Window    mRoot;
    Window    mAppWin;
    Window    mIconWin;
-   char*     xpm_themes[TOTAL_THEMES]; // Where to load XPMs
    bool      bar=false;		       // Toggle the bar beacuse you like it
    XClassHint classHint;
    XSizeHints sizeHints;
@@ -835,6 +1455,8 @@ int main(int argc, char** argv) {
    Atom       deleteWindow;
    XDraw*       image;
    XEvent     report;
+   TResult    result;		// Sent by the fetch thread
+   pollfd     fds[2];		// X connection and result queue
    KeySym     ksym;
    DwgoConf   Dwgo_Configuration; // Main configuration
    int eventmask;
@@ -849,36 +1471,74 @@ int main(int argc, char** argv) {
    bool direc=true;		// Direction of the waitbar animation
 
    int punter=0;		// Location being displayed actually
+   bool running=true;		// False when the window is closed
+   bool redraw=false;		// Data on screen is outdated
+   bool animating;		// Waitbar is moving
+   bool boxed=false;		// Waitbar box is already drawn
+   bool visible=true;		// Some of the tile can be seen
+   bool falling;		// Particles are moving
+   int last_anim=0;		// Where we drew the bar last time
 
    int tm_diff=0;		// Time differente
-   timespec tmp={0,30000000L};	// Sleep time between X updates
+
+   const char *snapdir=NULL;	// Headless, PNG files go here (-o)
+   int rounds=0;		// Headless benchmark (-b)
+   const char *fallback=NULL;	// Headless, font file for core fonts (-f)
+   int opt;
+
+   while ((opt=getopt(argc, argv, "o:b:f:"))!=-1)
+     switch (opt)
+       {
+       case 'o': snapdir=optarg; break;
+       case 'b': rounds=atoi(optarg); break;
+       case 'f': fallback=optarg; break;
+       default:
+	 cerr<<"Usage: "<<argv[0]<<" [-o dir | -b rounds] [-f font.ttf:size]\n";
+	 exit(1);
+       }
 
    user_homedir= getHomeDir();
    home_dir=(char*)malloc(strlen(user_homedir));
    strcpy(home_dir, user_homedir);
+   imgcache_dir(((string)home_dir+IMGCACHE_DIR).data()); // Before any theme is loaded
+   weathers.obs=new ObsCache(((string)home_dir+OBSCACHE_FILE).data());
+   weathers.history=new HistoryStore(((string)home_dir+HISTORY_DIR).data());
 
    config_path=locateConfig(user_homedir);
    if (config_path==NULL)
      error_handler(ERR_NOCFGFILE, NULL);
 
+   if ((snapdir) || (rounds>0))	// No X at all
+     {
+       config_defaults(&Dwgo_Configuration);
+       load_config(config_path, Dwgo_Configuration, NULL, home_dir);
+       tm_diff=time_diff();
+       weathers_loader(&weathers, Dwgo_Configuration, rounds==0);
+       headless(&weathers, Dwgo_Configuration, snapdir, rounds, fallback, tm_diff);
+       if (rounds==0)
+	 {
+	   weathers.sched->shutdown();
+	   pthread_join(weathers.thread, NULL);
+	 }
+       return 0;
+     }
+
    if ((disp = XOpenDisplay(NULL)) == NULL)
      error_handler(ERR_NODISPLAY, NULL);
    
    config_defaults(&Dwgo_Configuration);
-   for (int j=0;j<TOTAL_THEMES;j++)
-     xpm_themes[j]=NULL;	// Point all xpms to NULL
 
    load_config(config_path, Dwgo_Configuration, disp, home_dir);
 
    tm_diff=time_diff();
-   weathers_loader(&weathers, Dwgo_Configuration);
+   weathers_loader(&weathers, Dwgo_Configuration, true);
 
  
    // Get root window
    mRoot = RootWindow(disp, DefaultScreen(disp));
    // Create windows
-   mAppWin = XCreateSimpleWindow(disp, mRoot, 1, 1, 64, 64, 0, 0, 0);
-   mIconWin = XCreateSimpleWindow(disp, mAppWin, 0, 0, 64, 64, 0, 0, 0);
+   mAppWin = XCreateSimpleWindow(disp, mRoot, 1, 1, 64*Dwgo_Configuration.scale, 64*Dwgo_Configuration.scale, 0, 0, 0);
+   mIconWin = XCreateSimpleWindow(disp, mAppWin, 0, 0, 64*Dwgo_Configuration.scale, 64*Dwgo_Configuration.scale, 0, 0, 0);
 
    // Set classhint
    classHint.res_name =  (char*) "DWGO";
@@ -913,10 +1573,11 @@ int main(int argc, char** argv) {
    XSetCommand(disp, mAppWin, argv, argc); // X Params.
 //    // Set background image
 
-   XpmReadFileToBuffer(Dwgo_Configuration.metar_themes[DEFAULT_THEME].img, &xpm_themes[DEFAULT_THEME]);
-   image = new XDraw(disp, mRoot, xpm_themes[DEFAULT_THEME]);
+   image = new XDraw(disp, mRoot, theme_files(Dwgo_Configuration), DEFAULT_THEME, Dwgo_Configuration.scale);
    image->setDefaultWindow(mIconWin);
     image->setWindowPixmapShaped(mIconWin);
+    image->setCompositing(Dwgo_Configuration.compositor);
+    image->setTransition(Dwgo_Configuration.transition, Dwgo_Configuration.transition_time);
 
    XMapWindow(disp, mIconWin);
    XMapWindow(disp, mAppWin);
@@ -924,15 +1585,25 @@ int main(int argc, char** argv) {
 
    eventmask= ButtonPressMask | //ButtonReleaseMask | 
               FocusChangeMask | LeaveWindowMask | KeyPressMask |
-              EnterWindowMask;
+              EnterWindowMask | VisibilityChangeMask | StructureNotifyMask;
    XSelectInput(disp, mIconWin, eventmask );  
 
-   while (1)			// Main loop!!
+   fds[0].fd=ConnectionNumber(disp);
+   fds[0].events=POLLIN;
+   fds[1].fd=weathers.results->fd();
+   fds[1].events=POLLIN;
+
+   while (running)		// Main loop!!
      {
-       if (XCheckMaskEvent(disp, eventmask, &report))
+       while ((running) && (XPending(disp)))
 	 {
+	   XNextEvent(disp, &report);
 	   switch (report.type)
 	     {
+	     case ClientMessage:
+	       if ((Atom)report.xclient.data.l[0]==deleteWindow)
+		 running=false;	// Window closed
+	       break;
 	     case KeyPress:
 	       ksym = XLookupKeysym(&(report.xkey), report.xkey.state);
 
@@ -942,38 +1613,46 @@ int main(int argc, char** argv) {
 // 		   exit(0);
 // 		   break;
 		 case XK_F5:
-		   if (weathers.counter>3)		// Min. time between refreshes
-		     weathers.counter=weathers.refresh; // Refresh weathers
-		   else
+		   if (!weathers.sched->refresh(MIN_REFRESH_INTERVAL)) // Refresh weathers
 		     verbsth(VERB_WARNING,"You just have updated temperatures!!! Wait a little bit!");
 		   break;
 		 case XK_F6:	// Reload conf. file, Useful form theme creation and conf. checks
 		   punter=0;
-		   weathers.counter=0; // Make sure it won't update during reload
 		   config_defaults(&Dwgo_Configuration);
-		   for (int j=0;j<TOTAL_THEMES;j++)
-		     xpm_themes[j]=NULL;	// Point all xpms to NULL
-		   
 		   load_config(".dwgo", Dwgo_Configuration, disp, home_dir);
+		   XResizeWindow(disp, mAppWin, 64*Dwgo_Configuration.scale, 64*Dwgo_Configuration.scale);
+		   XResizeWindow(disp, mIconWin, 64*Dwgo_Configuration.scale, 64*Dwgo_Configuration.scale);
+		   image->loadAtlas(theme_files(Dwgo_Configuration), Dwgo_Configuration.scale); // Theme images may have changed
+		   image->setCompositing(Dwgo_Configuration.compositor);
+		   image->setTransition(Dwgo_Configuration.transition, Dwgo_Configuration.transition_time);
 		   weathers_create_list(&weathers, Dwgo_Configuration);
+		   weathers.sched->focus(punter);
+		   redraw=true;
 		   break;
 		 case XK_Down:
 		 case XK_Left:
 		   punter--;
 		   if (punter==-1)
-		     punter=weathers.weathers.size()-1;
-		   displaytemp(image, Dwgo_Configuration, weathers.weathers.at(punter), tm_diff, xpm_themes);
+		     punter=weathers.current->weathers.size()-1;
+		   weathers.sched->focus(punter); // Fetch it first if it is old
+		   image->startTransition();
+		   displaytemp(image, Dwgo_Configuration, weathers.current->shown.at(punter), weathers.current->names.at(punter), weathers.history, tm_diff, punter);
+		   boxed=false;
 		   break;
 		 case XK_Up:
 		 case XK_Right:
 		   punter++;
-		   if ((unsigned)punter==weathers.weathers.size())
+		   if ((unsigned)punter==weathers.current->weathers.size())
 		     punter=0;
-		   displaytemp(image, Dwgo_Configuration, weathers.weathers.at(punter), tm_diff, xpm_themes);
+		   weathers.sched->focus(punter);
+		   image->startTransition();
+		   displaytemp(image, Dwgo_Configuration, weathers.current->shown.at(punter), weathers.current->names.at(punter), weathers.history, tm_diff, punter);
+		   boxed=false;
 		   break;
 		 case XK_b:
 		   bar=!bar;
-		   displaytemp(image, Dwgo_Configuration, weathers.weathers.at(punter), tm_diff, xpm_themes);
+		   displaytemp(image, Dwgo_Configuration, weathers.current->shown.at(punter), weathers.current->names.at(punter), weathers.history, tm_diff, punter);
+		   boxed=false;
 
 		 default: break;
 
@@ -983,49 +1662,111 @@ int main(int argc, char** argv) {
 	       switch (report.xbutton.button) {	       
 	       case Button1:
 		 punter++;
-		 if ((unsigned)punter==weathers.weathers.size())
+		 if ((unsigned)punter==weathers.current->weathers.size())
 		   punter=0;
-		 displaytemp(image, Dwgo_Configuration, weathers.weathers.at(punter), tm_diff, xpm_themes);
+		 weathers.sched->focus(punter);
+		 image->startTransition();
+		 displaytemp(image, Dwgo_Configuration, weathers.current->shown.at(punter), weathers.current->names.at(punter), weathers.history, tm_diff, punter);
+		 boxed=false;
 		 break;
 	       case Button3:
 		 verbsth(VERB_ASTTO,"Right click");
 		 break;
 	       }
 	       break;
+	     case VisibilityNotify: // Nothing to animate if it can't be seen
+	       visible=(report.xvisibility.state!=VisibilityFullyObscured);
+	       break;
+	     case MapNotify:
+	       visible=true;
+	       break;
+	     case UnmapNotify:
+	       visible=false;
+	       break;
 	     case EnterNotify: 
 	     case LeaveNotify: 
 	       XSetInputFocus(disp, mIconWin, RevertToParent, CurrentTime);
 	       verbsth(VERB_ASTTO, " Focus Change");
 	       break; 
 	     default:
-	       verbsth(VERB_ASTTO, "Another Event");
+	       if (!image->handleEvent(&report)) // Uploads finished
+		 verbsth(VERB_ASTTO, "Another Event");
 	     }
 	 }
-       else
+       if (!running)
+	 break;
+
+       while (weathers.results->pop(result))
 	 {
+	   if (!weathers_take(weathers.current, result))
+	     {
+	       image->flushFrames(); // From before a reload, it may be one we kept
+	       redraw=true;
+	     }
+	   else
+	     {
+	       image->dropFrame(result.station); // Its drawing is old now
+	       if ((result.station==(unsigned)punter) && (result.state==RESULT_DONE))
+		 redraw=true;	// What we are looking at has changed
+	     }
+	 }
+
+       if (image->transitioning())
+	 {
+	   image->stepTransition();
+	   boxed=false;		// The waitbar comes after it
+	 }
 
-	   if ((!weathers.weathers.at(punter)->loaded) || (bar))
+       animating=((!weathers.current->shown.at(punter).loaded) || (bar));
+       if ((animating) && (!image->transitioning()))
+	 {
+	   if (!boxed)		// The whole box, only after a redraw
 	     {
 	       image->DrawRect(Dwgo_Configuration.wbox.x1,Dwgo_Configuration.wbox.y1,Dwgo_Configuration.wbox.x2,Dwgo_Configuration.wbox.y2, Dwgo_Configuration.wbox.out_color);
 	       image->DrawRect(Dwgo_Configuration.wbox.x1+1,Dwgo_Configuration.wbox.y1+1,Dwgo_Configuration.wbox.x2-2,Dwgo_Configuration.wbox.y2-2, Dwgo_Configuration.wbox.in_color);
-	       image->DrawRect(Dwgo_Configuration.wbox.x1+1+anim,Dwgo_Configuration.wbox.y1+1,6,Dwgo_Configuration.wbox.y2-2, Dwgo_Configuration.wbox.bar_color);
-	       if (direc)
-		 anim++;
-	       else
-		 anim--;
-	       if ((anim==Dwgo_Configuration.wbox.x2-8) || (anim==0)) // Dwgo_Configuration.wbox.x2 -2 -6 (bar width)
-		 direc=!direc;
-	       image->Sync();
-	     }
-	   else if (!weathers.loaded)
-	     {
-	       weathers.loaded=true;
-	       displaytemp(image, Dwgo_Configuration, weathers.weathers.at(punter), tm_diff,  xpm_themes);
+	       boxed=true;
 	     }
-	   
-	   
+	   else			// Erase the bar where it was
+	     image->DrawRect(Dwgo_Configuration.wbox.x1+1+last_anim,Dwgo_Configuration.wbox.y1+1,6,Dwgo_Configuration.wbox.y2-2, Dwgo_Configuration.wbox.in_color);
+	   image->DrawRect(Dwgo_Configuration.wbox.x1+1+anim,Dwgo_Configuration.wbox.y1+1,6,Dwgo_Configuration.wbox.y2-2, Dwgo_Configuration.wbox.bar_color);
+	   last_anim=anim;
+	   if (direc)
+	     anim++;
+	   else
+	     anim--;
+	   if ((anim==Dwgo_Configuration.wbox.x2-8) || (anim==0)) // Dwgo_Configuration.wbox.x2 -2 -6 (bar width)
+	     direc=!direc;
+	   image->Flush();	// Just the area we have changed
 	 }
-       nanosleep(&tmp, NULL);
+       else if ((!animating) && (redraw))
+	 {
+	   redraw=false;
+	   displaytemp(image, Dwgo_Configuration, weathers.current->shown.at(punter), weathers.current->names.at(punter), weathers.history, tm_diff, punter);
+	   boxed=false;
+	 }
+
+       // Particles wait for the rest, and stop when the tile is hidden
+       falling=((visible) && (!animating) && (!image->transitioning()) && (image->falling()));
+       if (falling)
+	 image->stepParticles();
+
+       if (XPending(disp))	// Drawing may have queued some events
+	 continue;
+
+       // Sleep until X or the fetch thread have something for us. Only the
+       // waitbar, the transitions and the particles need a timeout.
+       if (poll(fds, 2, (image->transitioning())?TRANSITION_FRAME:(animating)?WAITBAR_FRAME:
+		(falling)?PARTICLE_STEP:-1)<0 && errno!=EINTR)
+	 break;
+       if (fds[1].revents & POLLIN)
+	 weathers.results->drain();
      }
+
+   weathers.sched->shutdown();	// Wait for the fetch thread to finish
+   pthread_join(weathers.thread, NULL);
+   delete weathers.results;
+   delete weathers.obs;
+   delete weathers.history;
    delete image;		  
+   XCloseDisplay(disp);
 }
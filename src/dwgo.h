@@ -17,6 +17,26 @@
 #define PARTS_THEME 10		// Other particles
 
 #define DEFAULT_UPDATE_INTERVAL 900 // 900 seconds=15 minutes
+#define DEFAULT_RETRY_INTERVAL  60  // When the server fails, try again in a minute
+#define MIN_REFRESH_INTERVAL    3   // Min. seconds between manual refreshes
+#define POLL_BURST_INTERVAL     60  // Poll each minute while we wait for a report
+#define POLL_WINDOW             600 // For 10 minutes after the report is expected
+#define POLL_IDLE_FACTOR        4   // Poll each update_interval*4 seconds otherwise
+#define DEFAULT_BG_BUDGET       20  // Stations out of the screen fetched per minute
+#define MAX_FETCHES             8   // Stations downloaded at once
+#define FETCH_DEADLINE          30  // Seconds to download a station
+#define DEFAULT_COMPOSITOR      true // Compose frames in our memory
+#define WAITBAR_FRAME           30  // Milliseconds between waitbar frames
+#define DEFAULT_TRANSITION      TRANSITION_FADE // When we change the station
+#define DEFAULT_TRANSITION_TIME 250 // Milliseconds
+#define TRANSITION_FRAME        16  // Milliseconds between transition frames
+#define DEFAULT_SCALE           1   // Size multiplier for HiDPI screens
+#define DEFAULT_PARTICLES       false // Rain, snow... over the weather themes
+#define DEFAULT_CACHE_MAX_AGE   21600 // Cached observations older than 6 hours aren't shown
+#define DEFAULT_HISTORY         true // Keep every observation
+#define DEFAULT_TREND_HOURS     24  // Sparkline of the temperature beside it
+#define DEFAULT_TREND_HEIGHT    12  // Pixels of the sparkline, for 64x64
+#define MAX_SCALE               4
 #define DEFAULT_DEG_UNIT        'C' // Celsius by default
 #define DEFAULT_MAX_WIDTH       64  // If default width is undefined, take 64
 
@@ -60,6 +60,12 @@ void error_handler (int err_code, char *add_string)
 	case ERR_NOCFGFILE:
 	  cout<<"Configuration file not found.";
 	  break;
+	case ERR_SCHEDULER:
+	  cout<<"Couldn't create scheduler timers.";
+	  break;
+	case ERR_RESULTQUEUE:
+	  cout<<"Couldn't create the result queue.";
+	  break;
 
 	default:
 	  cout<<"Unknown error!!! :S";
@@ -12,6 +12,8 @@
 #define ERR_BADDFICLR  1008     // Bad default tIme color
 #define ERR_BADDFECLR  1009     // Bad default tEmp color
 #define ERR_NOCFGFILE  1010	// Can't locate configuration file
+#define ERR_SCHEDULER  1011	// Can't create scheduler timers
+#define ERR_RESULTQUEUE 1012	// Can't create the result queue eventfd
 
 #define VERB_NONE      0	// No verbose
 #define VERB_CRITICAL  100	// Just critical complains
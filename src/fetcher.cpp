@@ -0,0 +1,611 @@
+ /********************************************************************************
+ *  File: fetcher.cpp								*
+ *  Author: Gaspar Fernández (helyo@totaki.com) 				*
+ *										*
+ *  Copyright (C) 2008   Gaspar Fernández					*
+ *										*
+ *  This program is free software: you can redistribute it and/or modify	*
+ *  it under the terms of the GNU General Public License as published by	*
+ *  the Free Software Foundation, either version 3 of the License, or 		*
+ *  (at your option) any later version.  	      	  	   		*
+ *										*
+ *  This program is distributed in the hope that it will be useful,		*
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of		*
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the		*
+ *  GNU General Public License for more details.				*
+ *										*
+ *  You should have received a copy of the GNU General Public License		*
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.	*
+ *									        *
+ ********************************************************************************
+ *   Description:
+ *     Non-blocking HTTP client. Every request is a small state machine
+ *   (connect, send, receive) driven by poll(), so a single thread can
+ *   download lots of stations at once. Every request has a deadline and
+ *   can be cancelled. When it finishes, the response is parsed with
+ *   parse_http() and returned by next().
+ *     All the stations are in the same server, so we resolve it once and
+ *   keep the address for a while. getaddrinfo() blocks, so it runs in a
+ *   small resolver thread that wakes the reactor when it has the answer.
+ *
+ *   Change History:
+ *    Date       Author     Modification
+ *
+ ********************************************************************************/
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netdb.h>
+#include "fetcher.h"
+#include "errors.h"
+
+using namespace std;
+
+/*************************************************************
+ *     Constructor Fetcher                                   *
+ *************************************************************
+ *  Description:                                             *
+ *     Nothing running at the beginning. The resolver thread *
+ *  is detached: it may be inside getaddrinfo() when we are  *
+ *  destroyed, so it frees what we share when it sees quit.  *
+ *  Without it, host names are resolved here, blocking.      *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+Fetcher::Fetcher()
+{
+  pthread_t thread;
+
+  last_id=0;
+  resolver=new TResolver;
+  pthread_mutex_init(&resolver->lock, NULL);
+  pthread_cond_init(&resolver->wake, NULL);
+  resolver->quit=false;
+  resolver->event_fd=eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if ((resolver->event_fd<0) || (pthread_create(&thread, NULL, resolverThread, resolver)!=0))
+    {
+      verbsth(VERB_WARNING, "Can't create the resolver thread, host names will block downloads");
+      if (resolver->event_fd>=0)
+	close(resolver->event_fd);
+      pthread_cond_destroy(&resolver->wake);
+      pthread_mutex_destroy(&resolver->lock);
+      delete resolver;
+      resolver=NULL;
+      return;
+    }
+  pthread_detach(thread);
+}
+
+Fetcher::~Fetcher()
+{
+  TFetched done;
+
+  cancelAll();
+  while (next(done))
+    delete done.http;
+
+  if (resolver!=NULL)
+    {
+      pthread_mutex_lock(&resolver->lock);
+      resolver->quit=true;	// It frees it, maybe after a lookup
+      pthread_cond_signal(&resolver->wake);
+      pthread_mutex_unlock(&resolver->lock);
+    }
+}
+
+/*************************************************************
+ *     Method: resolverThread                                *
+ *************************************************************
+ *  Description:                                             *
+ *     Resolves the names asked one by one, and writes the   *
+ *  eventfd for every answer, so the reactor polls it.       *
+ *                                                           *
+ * Input:                                                    *
+ *   void *arg - Its TResolver                               *
+ *                                                           *
+ * Output:                                                   *
+ *   NULL                                                    *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void *Fetcher::resolverThread(void *arg)
+{
+  TResolver *res=(TResolver *)arg;
+  TResolved answer;
+  uint64_t one=1;
+
+  pthread_mutex_lock(&res->lock);
+  while (!res->quit)
+    {
+      if (res->asked.empty())
+	{
+	  pthread_cond_wait(&res->wake, &res->lock);
+	  continue;
+	}
+      answer.name=res->asked.front();
+      res->asked.erase(res->asked.begin());
+      pthread_mutex_unlock(&res->lock);
+      answer.ok=lookup(answer.name, answer.addr); // This one blocks
+      pthread_mutex_lock(&res->lock);
+      res->answers.push_back(answer);
+      if (write(res->event_fd, &one, sizeof(one))!=sizeof(one))
+	verbsth(VERB_WARNING, "Can't wake the fetch thread");
+    }
+  pthread_mutex_unlock(&res->lock);
+
+  close(res->event_fd);
+  pthread_cond_destroy(&res->wake);
+  pthread_mutex_destroy(&res->lock);
+  delete res;
+  return NULL;
+}
+
+/*************************************************************
+ *     Method: lookup, resolve                               *
+ *************************************************************
+ *  Description:                                             *
+ *     lookup() asks the resolver, it blocks. resolve() gets *
+ *  the address of a host from the cache, if we have it.     *
+ *                                                           *
+ * Input:                                                    *
+ *   string host - Server name                               *
+ *   int port - Remote port                                  *
+ *   sockaddr_in &addr - Where to store the address          *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - False if we couldn't resolve it                  *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool Fetcher::lookup(const string &host, struct sockaddr_in &addr)
+{
+  struct addrinfo hints, *res;
+
+  bzero(&hints, sizeof(hints));
+  hints.ai_family=AF_INET;
+  hints.ai_socktype=SOCK_STREAM;
+  if ((getaddrinfo(host.data(), NULL, &hints, &res)!=0) || (res==NULL))
+    return false;
+
+  memcpy(&addr, res->ai_addr, sizeof(addr));
+  freeaddrinfo(res);
+  return true;
+}
+
+bool Fetcher::resolve(const string &host, int port, struct sockaddr_in &addr)
+{
+  map<string, TAddress>::iterator cached=addresses.find(host);
+
+  if ((cached==addresses.end()) || (cached->second.expires<=time(NULL)))
+    return false;
+
+  addr=cached->second.addr;
+  addr.sin_port=htons(port);
+  return true;
+}
+
+/*************************************************************
+ *     Method: answers                                       *
+ *************************************************************
+ *  Description:                                             *
+ *     Takes what the resolver thread has found, keeps it in *
+ *  the cache and connects the requests waiting for it.      *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void Fetcher::answers()
+{
+  vector<TResolved> found;
+  struct sockaddr_in addr;
+  uint64_t tmp;
+  TAddress entry;
+
+  pthread_mutex_lock(&resolver->lock);
+  if (read(resolver->event_fd, &tmp, sizeof(tmp))<0 && (errno!=EAGAIN))
+    verbsth(VERB_WARNING, "Can't read the resolver event");
+  found.swap(resolver->answers);
+  pthread_mutex_unlock(&resolver->lock);
+
+  for (unsigned int a=0; a<found.size(); a++)
+    {
+      if (found[a].ok)
+	{
+	  entry.addr=found[a].addr;
+	  entry.expires=time(NULL)+RESOLVE_TTL;
+	  addresses[found[a].name]=entry;
+	}
+      for (unsigned int k=requests.size(); k-->0; ) // finish() moves the last one here
+	if ((requests[k].state==FETCH_RESOLVE) && (requests[k].name==found[a].name))
+	  {
+	    if (!found[a].ok)
+	      finish(k, CANT_RESOLVE_HOST, NULL);
+	    else
+	      {
+		addr=found[a].addr;
+		addr.sin_port=htons(requests[k].port);
+		connectTo(k, addr);
+	      }
+	  }
+    }
+}
+
+/*************************************************************
+ *     Method: start                                         *
+ *************************************************************
+ *  Description:                                             *
+ *     Begins a GET request. Only http:// URIs are allowed,  *
+ *  like MySock. Errors we find now are returned by next()   *
+ *  as any other one.                                        *
+ *                                                           *
+ * Input:                                                    *
+ *   string uri - What to download                           *
+ *   time_t deadline - Give up at this time                  *
+ *   void *data - Returned with the result                   *
+ *                                                           *
+ * Output:                                                   *
+ *   int - Request id, to cancel it                          *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+int Fetcher::start(const string &uri, time_t deadline, void *data)
+{
+  TRequest req;
+  struct sockaddr_in addr;
+  TAddress entry;
+  string::size_type pos=uri.find("//", 0);
+  string::size_type pos2;
+  string params;
+
+  req.id=++last_id;
+  req.state=FETCH_CONNECT;
+  req.sock=-1;
+  req.deadline=deadline;
+  req.sent=0;
+  req.port=80;
+  req.data=data;
+  requests.push_back(req);
+
+  if ((pos==string::npos) || (uri.substr(0, pos)!="http:"))
+    {
+      finish(requests.size()-1, NO_VALID_PROTOCOL, NULL);
+      return req.id;
+    }
+
+  pos2=uri.find("/", pos+2);
+  if (pos2==string::npos)
+    pos2=uri.length();
+  params=uri.substr(pos2);
+  if (params.empty())
+    params="/";
+
+  TRequest &r=requests.back();
+  r.host=uri.substr(pos+2, pos2-pos-2);
+  r.request="GET "+params+" HTTP/1.0"+CRLF+
+    "Host: "+r.host+CRLF+
+    CRLF;
+
+  r.port=80;
+  pos=r.host.find(':');
+  if (pos!=string::npos)	// host:port
+    r.port=atoi(r.host.substr(pos+1).data());
+  r.name=r.host.substr(0, pos);
+
+  if (resolve(r.name, r.port, addr))
+    connectTo(requests.size()-1, addr);
+  else if (resolver==NULL)	// No resolver thread, we block here
+    {
+      if (!lookup(r.name, entry.addr))
+	{
+	  finish(requests.size()-1, CANT_RESOLVE_HOST, NULL);
+	  return req.id;
+	}
+      entry.expires=time(NULL)+RESOLVE_TTL;
+      addresses[r.name]=entry;
+      resolve(r.name, r.port, addr);
+      connectTo(requests.size()-1, addr);
+    }
+  else
+    {
+      r.state=FETCH_RESOLVE;
+      for (unsigned int k=0; k<requests.size()-1; k++)
+	if ((requests[k].state==FETCH_RESOLVE) && (requests[k].name==r.name))
+	  return req.id;	// Already asked
+      pthread_mutex_lock(&resolver->lock);
+      resolver->asked.push_back(r.name);
+      pthread_cond_signal(&resolver->wake);
+      pthread_mutex_unlock(&resolver->lock);
+    }
+  return req.id;
+}
+
+/*************************************************************
+ *     Method: connectTo                                     *
+ *************************************************************
+ *  Description:                                             *
+ *     Starts connecting a request, once we have its address *
+ *                                                           *
+ * Input:                                                    *
+ *   unsigned int k - Index of the request                   *
+ *   sockaddr_in addr - Where to connect                     *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void Fetcher::connectTo(unsigned int k, struct sockaddr_in addr)
+{
+  TRequest &r=requests[k];
+
+  r.state=FETCH_CONNECT;
+  r.sock=socket(AF_INET, SOCK_STREAM, 0);
+  if (r.sock<0)
+    {
+      finish(k, CANT_CREATE_SOCKET, NULL);
+      return;
+    }
+  fcntl(r.sock, F_SETFL, fcntl(r.sock, F_GETFL) | O_NONBLOCK);
+  fcntl(r.sock, F_SETFD, FD_CLOEXEC);
+
+  if ((connect(r.sock, (struct sockaddr *)&addr, sizeof(addr))<0) && (errno!=EINPROGRESS))
+    {
+      addresses.erase(r.name); // It may have moved
+      finish(k, CANT_CONNECT, NULL);
+    }
+}
+
+/*************************************************************
+ *     Method: finish                                        *
+ *************************************************************
+ *  Description:                                             *
+ *     Closes the request and keeps its result for next()    *
+ *                                                           *
+ * Input:                                                    *
+ *   unsigned int k - Index of the request                   *
+ *   int error - Its final status                            *
+ *   HTTP_Request *http - Parsed response, or NULL           *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void Fetcher::finish(unsigned int k, int error, HTTP_Request *http)
+{
+  TFetched done;
+
+  if (requests[k].sock>=0)
+    close(requests[k].sock);
+
+  done.data=requests[k].data;
+  done.http=http;
+  done.error=error;
+  finished.push_back(done);
+
+  requests[k]=requests.back();	// Order doesn't matter
+  requests.pop_back();
+}
+
+/*************************************************************
+ *     Method: step                                          *
+ *************************************************************
+ *  Description:                                             *
+ *     Moves a request forward when its socket is ready.     *
+ *                                                           *
+ * Input:                                                    *
+ *   unsigned int k - Index of the request                   *
+ *   short revents - What poll() told us about the socket    *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void Fetcher::step(unsigned int k, short revents)
+{
+  TRequest &r=requests[k];
+  char buffer[4096];
+  int err=0;
+  socklen_t len=sizeof(err);
+  ssize_t n;
+  HTTP_Request *http;
+
+  if (r.state==FETCH_CONNECT)
+    {
+      if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+	return;
+      if ((getsockopt(r.sock, SOL_SOCKET, SO_ERROR, &err, &len)<0) || (err!=0))
+	{
+	  addresses.erase(r.name);
+	  finish(k, CANT_CONNECT, NULL);
+	  return;
+	}
+      r.state=FETCH_SEND;
+    }
+
+  if (r.state==FETCH_SEND)
+    {
+      if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+	return;
+      n=send(r.sock, r.request.data()+r.sent, r.request.length()-r.sent, MSG_NOSIGNAL);
+      if (n<0)
+	{
+	  if ((errno!=EAGAIN) && (errno!=EINTR))
+	    finish(k, CANT_SEND_DATA, NULL);
+	  return;
+	}
+      r.sent+=n;
+      if (r.sent<r.request.length())
+	return;
+      r.state=FETCH_RECV;
+      return;			// Wait for the answer
+    }
+
+  if (!(revents & (POLLIN | POLLERR | POLLHUP)))
+    return;
+  while ((n=read(r.sock, buffer, sizeof(buffer)))>0)
+    r.received.append(buffer, n);
+  if (n==0)			// HTTP/1.0, the server closes when it's done
+    {
+      err=NO_ERROR;
+      http=parse_http(r.received, err);
+      finish(k, err, http);
+    }
+  else if ((errno!=EAGAIN) && (errno!=EINTR))
+    finish(k, CANT_READ_DATA, NULL);
+}
+
+/*************************************************************
+ *     Method: pollfds, timeout                              *
+ *************************************************************
+ *  Description:                                             *
+ *     pollfds() appends the sockets we are waiting for, and *
+ *  the resolver eventfd. timeout() tells how long poll()    *
+ *  can wait before a deadline expires (-1 if nothing is     *
+ *  running).                                                *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void Fetcher::pollfds(vector<pollfd> &fds)
+{
+  pollfd fd;
+
+  if (resolver!=NULL)
+    {
+      fd.fd=resolver->event_fd;
+      fd.events=POLLIN;
+      fd.revents=0;
+      fds.push_back(fd);
+    }
+  for (unsigned int k=0; k<requests.size(); k++)
+    {
+      if (requests[k].state==FETCH_RESOLVE)
+	continue;
+      fd.fd=requests[k].sock;
+      fd.events=(requests[k].state==FETCH_RECV)?POLLIN:POLLOUT;
+      fd.revents=0;
+      fds.push_back(fd);
+    }
+}
+
+int Fetcher::timeout(time_t now)
+{
+  time_t first=0;
+
+  if (!finished.empty())
+    return 0;			// Someone is waiting for them
+  for (unsigned int k=0; k<requests.size(); k++)
+    if ((first==0) || (requests[k].deadline<first))
+      first=requests[k].deadline;
+
+  if (first==0)
+    return -1;
+  return (first<=now)?0:(first-now)*1000;
+}
+
+/*************************************************************
+ *     Method: process                                       *
+ *************************************************************
+ *  Description:                                             *
+ *     Runs every request whose socket is ready, and expires *
+ *  the ones past their deadline.                            *
+ *                                                           *
+ * Input:                                                    *
+ *   vector<pollfd> fds - Result of poll(). It may contain   *
+ *  other descriptors, we only look at ours.                 *
+ *   time_t now - Current time                               *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void Fetcher::process(const vector<pollfd> &fds, time_t now)
+{
+  map<int, short> ready;
+
+  for (unsigned int k=0; k<fds.size(); k++)
+    if (fds[k].revents)
+      ready[fds[k].fd]=fds[k].revents;
+
+  for (unsigned int k=requests.size(); k-->0; ) // finish() moves the last one here
+    {
+      if ((requests[k].sock>=0) && (ready.count(requests[k].sock)))
+	step(k, ready[requests[k].sock]);
+      if ((k<requests.size()) && (requests[k].deadline<=now))
+	finish(k, FETCH_TIMEOUT, NULL);
+    }
+
+  if ((resolver!=NULL) && (ready.count(resolver->event_fd)))
+    answers();			// Their sockets are polled next time
+}
+
+/*************************************************************
+ *     Method: cancel, cancelAll                             *
+ *************************************************************
+ *  Description:                                             *
+ *     Stops requests. next() returns them with              *
+ *  FETCH_CANCELLED, so their data can be freed.             *
+ *                                                           *
+ * Input:                                                    *
+ *   int id - Request given by start()                       *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void Fetcher::cancel(int id)
+{
+  for (unsigned int k=0; k<requests.size(); k++)
+    if (requests[k].id==id)
+      {
+	finish(k, FETCH_CANCELLED, NULL);
+	return;
+      }
+}
+
+void Fetcher::cancelAll()
+{
+  while (!requests.empty())
+    finish(requests.size()-1, FETCH_CANCELLED, NULL);
+}
+
+/*************************************************************
+ *     Method: active, next                                  *
+ *************************************************************
+ *  Description:                                             *
+ *     active() is how many requests are running. next()     *
+ *  returns finished requests one by one.                    *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+unsigned int Fetcher::active()
+{
+  return requests.size();
+}
+
+bool Fetcher::next(TFetched &done)
+{
+  if (finished.empty())
+    return false;
+
+  done=finished.front();
+  finished.erase(finished.begin());
+  return true;
+}
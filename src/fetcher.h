@@ -0,0 +1,101 @@
+#ifndef _FETCHER_H_
+#define _FETCHER_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "MySock.h"
+
+#define FETCH_RESOLVE  0	// Waiting for the resolver thread
+#define FETCH_CONNECT  1	// Waiting for connect() to finish
+#define FETCH_SEND     2	// Sending the request
+#define FETCH_RECV     3	// Reading the response until the server closes
+
+#define FETCH_TIMEOUT   60	// Error: deadline expired (MySock.h has the rest)
+#define FETCH_CANCELLED 65	// Error: cancelled
+
+#define RESOLVE_TTL     600	// Seconds we trust a resolved address
+
+typedef struct
+{
+  void *data;			// Given to start()
+  HTTP_Request *http;		// NULL on error. The caller must delete it
+  int error;			// NO_ERROR, CANT_*, FETCH_TIMEOUT...
+} TFetched;
+
+/* Runs many HTTP requests at once on a single thread */
+class Fetcher
+{
+ public:
+  Fetcher();
+  virtual ~Fetcher();
+
+  int start(const std::string &uri, time_t deadline, void *data);
+  void cancel(int id);
+  void cancelAll();
+  unsigned int active();
+  void pollfds(std::vector<pollfd> &fds); /* What we are waiting for */
+  int timeout(time_t now);		  /* Milliseconds until the first deadline */
+  void process(const std::vector<pollfd> &fds, time_t now);
+  bool next(TFetched &done);		  /* Finished requests */
+
+ private:
+  typedef struct
+  {
+    int id;
+    int state;			// FETCH_*
+    int sock;
+    time_t deadline;
+    std::string host;		// As given in the URI (host:port)
+    std::string name;		// Host name to resolve
+    int port;
+    std::string request;	// What we send
+    size_t sent;		// Bytes of request sent
+    std::string received;	// What we have read so far
+    void *data;
+  } TRequest;
+
+  typedef struct
+  {
+    struct sockaddr_in addr;
+    time_t expires;
+  } TAddress;
+
+  typedef struct
+  {
+    std::string name;
+    bool ok;			// False if it couldn't be resolved
+    struct sockaddr_in addr;
+  } TResolved;
+
+  /* Shared with the resolver thread, which frees it when we are gone */
+  typedef struct
+  {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    std::vector<std::string> asked;	// Names to resolve
+    std::vector<TResolved> answers;	// Until process() takes them
+    int event_fd;			// Tells the reactor there are answers
+    bool quit;				// The Fetcher is gone
+  } TResolver;
+
+  std::vector<TRequest> requests; // Running ones
+  std::vector<TFetched> finished; // Until next() returns them
+  std::map<std::string, TAddress> addresses; // Resolve cache
+  TResolver *resolver;		// NULL if its thread couldn't be created
+  int last_id;
+
+  static void *resolverThread(void *arg);
+  static bool lookup(const std::string &host, struct sockaddr_in &addr);
+  bool resolve(const std::string &host, int port, struct sockaddr_in &addr);
+  void answers();
+  void connectTo(unsigned int k, struct sockaddr_in addr);
+  void finish(unsigned int k, int error, HTTP_Request *http);
+  void step(unsigned int k, short revents);
+};
+
+#endif
@@ -0,0 +1,219 @@
+ /********************************************************************************
+ *  File: glyphatlas.cpp							*
+ *  Author: Gaspar Fernández (helyo@totaki.com) 				*
+ *										*
+ *  Copyright (C) 2008   Gaspar Fernández					*
+ *										*
+ *  This program is free software: you can redistribute it and/or modify	*
+ *  it under the terms of the GNU General Public License as published by	*
+ *  the Free Software Foundation, either version 3 of the License, or 		*
+ *  (at your option) any later version.  	      	  	   		*
+ *										*
+ *  This program is distributed in the hope that it will be useful,		*
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of		*
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the		*
+ *  GNU General Public License for more details.				*
+ *										*
+ *  You should have received a copy of the GNU General Public License		*
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.	*
+ *									        *
+ ********************************************************************************
+ *   Description:
+ *     Antialiased text. A scalable font file is rendered once with FreeType,
+ *   every Latin-1 character side by side in an 8 bit coverage bitmap, and
+ *   XDraw blends the glyphs from there into its image. No X requests.
+ *     Fonts are given as "/path/to/font.ttf:size" (size in pixels), core X
+ *   fonts start with "-" and are still drawn by the server.
+ *     Without FreeType load() always fails, and those fonts are replaced
+ *   with the default one when the config is loaded.
+ *
+ *   Change History:
+ *    Date       Author     Modification
+ *
+ ********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include "config.h"
+#include "glyphatlas.h"
+#include "errors.h"
+
+#ifdef HAVE_LIBFREETYPE
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#endif
+
+using namespace std;
+
+/*************************************************************
+ *     Constructor / Destructor GlyphAtlas                   *
+ *************************************************************
+ *  Description:                                             *
+ *     Empty atlas, load() fills it.                         *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+GlyphAtlas::GlyphAtlas()
+{
+  pixels = NULL;
+  pitch = 0;
+  rows = 0;
+  ascent = 0;
+  descent = 0;
+  memset(glyphs, 0, sizeof(glyphs));
+}
+
+GlyphAtlas::~GlyphAtlas()
+{
+  free(pixels);
+}
+
+/*************************************************************
+ *     Method: isFile                                        *
+ *************************************************************
+ *  Description:                                             *
+ *     Font files are absolute paths, core fonts (XLFD)      *
+ *  start with "-".                                          *
+ *                                                           *
+ * Input:                                                    *
+ *    const char* font - Font name                           *
+ *                                                           *
+ * Output:                                                   *
+ *    bool - True if we have to load it                      *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool GlyphAtlas::isFile(const char* font)
+{
+  return (font!=NULL) && (font[0]=='/');
+}
+
+/*************************************************************
+ *     Method: load                                          *
+ *************************************************************
+ *  Description:                                             *
+ *     Renders every character of the font into the atlas.   *
+ *                                                           *
+ * Input:                                                    *
+ *    const char* font - "/path/to/font.ttf:size"            *
+ *    int scale - Size multiplier (HiDPI)                    *
+ *                                                           *
+ * Output:                                                   *
+ *    bool - False if we can't use it                        *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool GlyphAtlas::load(const char* font, int scale)
+{
+#ifdef HAVE_LIBFREETYPE
+  FT_Library library;
+  FT_Face face;
+  FT_GlyphSlot slot;
+  string file = font;
+  string::size_type colon = file.rfind(':');
+  int size = GLYPH_SIZE, x;
+
+  if ((colon!=string::npos) && (atoi(file.substr(colon+1).data())>0))
+    {
+      size = atoi(file.substr(colon+1).data());
+      file = file.substr(0, colon);
+    }
+  size *= (scale>0)?scale:1;
+
+  if (FT_Init_FreeType(&library))
+    return false;
+  if (FT_New_Face(library, file.data(), 0, &face))
+    {
+      FT_Done_FreeType(library);
+      return false;
+    }
+  if (FT_Set_Pixel_Sizes(face, 0, size))
+    {
+      FT_Done_Face(face);
+      FT_Done_FreeType(library);
+      return false;
+    }
+  slot = face->glyph;
+  ascent = face->size->metrics.ascender>>6;
+  descent = -(face->size->metrics.descender>>6);
+
+  // First we measure, then we render them side by side
+  pitch = 0;
+  rows = 0;
+  for (int c=GLYPH_FIRST; c<=GLYPH_LAST; c++)
+    {
+      if (FT_Load_Char(face, c, FT_LOAD_RENDER | FT_LOAD_TARGET_LIGHT))
+	continue;
+      glyphs[c].width = slot->bitmap.width;
+      glyphs[c].height = slot->bitmap.rows;
+      glyphs[c].left = slot->bitmap_left;
+      glyphs[c].top = slot->bitmap_top;
+      glyphs[c].advance = slot->advance.x>>6;
+      glyphs[c].x = pitch;
+      pitch += glyphs[c].width;
+      if (glyphs[c].height>rows)
+	rows = glyphs[c].height;
+    }
+  if (pitch<1) pitch = 1;
+  if (rows<1) rows = 1;
+
+  free(pixels);
+  pixels = (unsigned char*)calloc(pitch*rows, 1);
+  for (int c=GLYPH_FIRST; c<=GLYPH_LAST; c++)
+    {
+      if ((glyphs[c].width==0) || (FT_Load_Char(face, c, FT_LOAD_RENDER | FT_LOAD_TARGET_LIGHT)))
+	continue;
+      x = glyphs[c].x;
+      for (int j=0; j<glyphs[c].height; j++)
+	memcpy(pixels+j*pitch+x, slot->bitmap.buffer+j*slot->bitmap.pitch, glyphs[c].width);
+    }
+
+  FT_Done_Face(face);
+  FT_Done_FreeType(library);
+  return true;
+#else
+  verbsth(VERB_WARNING, (string)"Built without FreeType, can't use: "+font);
+  return false;
+#endif
+}
+
+/*************************************************************
+ *     Method: width, glyph, coverage                        *
+ *************************************************************
+ *  Description:                                             *
+ *     Width of a text, a character and its pixels.          *
+ *                                                           *
+ * Input:                                                    *
+ *    const char* str, int len - Text                        *
+ *    unsigned char c - Character                            *
+ *    const TGlyph* g, int row - A row of a glyph            *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+int GlyphAtlas::width(const char* str, int len)
+{
+  int w = 0;
+
+  for (int k=0; k<len; k++)
+    w += glyphs[(unsigned char)str[k]].advance;
+  return w;
+}
+
+const TGlyph* GlyphAtlas::glyph(unsigned char c)
+{
+  return &glyphs[c];
+}
+
+const unsigned char* GlyphAtlas::coverage(const TGlyph* g, int row)
+{
+  return pixels+row*pitch+g->x;
+}
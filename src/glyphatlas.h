@@ -0,0 +1,38 @@
+#ifndef _GLYPHATLAS_H_
+#define _GLYPHATLAS_H_
+
+#define GLYPH_FIRST      32	// Latin-1, like the rest of dwgo
+#define GLYPH_LAST       255
+#define GLYPH_SIZE       10	// Pixels, when the font doesn't say it
+
+typedef struct
+{
+  int x;			// Where it is in the atlas
+  int width, height;
+  int left, top;		// From the pen position to the bitmap
+  int advance;			// Pen movement
+} TGlyph;
+
+/* A scalable font ("/path/font.ttf:size") rendered once with FreeType.
+   Doesn't need an X display */
+class GlyphAtlas
+{
+ public:
+  GlyphAtlas();
+  virtual ~GlyphAtlas();
+
+  static bool isFile(const char* font);	/* Is this font for us? */
+  bool load(const char* font, int scale);	/* scale multiplies the size */
+
+  int ascent, descent;
+  int width(const char* str, int len);
+  const TGlyph* glyph(unsigned char c);
+  const unsigned char* coverage(const TGlyph* g, int row); /* 0-255 for each pixel */
+
+ private:
+  TGlyph glyphs[GLYPH_LAST+1];
+  unsigned char *pixels;	// All glyphs side by side
+  int pitch, rows;
+};
+
+#endif
@@ -0,0 +1,794 @@
+ /********************************************************************************
+ *  File: histcodec.cpp							*
+ *  Author: Gaspar Fernández (helyo@totaki.com) 				*
+ *										*
+ *  Copyright (C) 2008   Gaspar Fernández					*
+ *										*
+ *  This program is free software: you can redistribute it and/or modify	*
+ *  it under the terms of the GNU General Public License as published by	*
+ *  the Free Software Foundation, either version 3 of the License, or 		*
+ *  (at your option) any later version.  	      	  	   		*
+ *										*
+ *  This program is distributed in the hope that it will be useful,		*
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of		*
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the		*
+ *  GNU General Public License for more details.				*
+ *										*
+ *  You should have received a copy of the GNU General Public License		*
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.	*
+ *									        *
+ ********************************************************************************
+ *   Description:
+ *     Compressed history segments, in the spirit of Gorilla (Facebook's time
+ *   series store). Records are stored by column in blocks of HGZ_BLOCK, and
+ *   each value as its difference with the previous one or with the first
+ *   one of the block (a noisy wind direction is better so), zigzag coded.
+ *   Times are differences with the usual interval of the block, 0 when
+ *   reports come every half an hour. Every column is divided first by the
+ *   greatest common divisor of its values in the segment (temperatures are
+ *   stored in tenths but they come in degrees, times are whole minutes).
+ *     Each column of a block takes the smallest of three codes: all of its
+ *   values with the same bits, the fewest that fit them, so decoding is a
+ *   plain loop and a column that doesn't change takes none; a Rice code,
+ *   for small values with a few large ones (escaped after HGZ_ESCAPE ones,
+ *   like a wind direction going round); or the runs of zeros between the
+ *   rest of the values, both Rice coded, for what seldom changes, as the
+ *   theme. A block is a stream of bits: its first values (from those of the
+ *   segment, so they take a few bits), the code of each column and then the
+ *   columns.
+ *     An index gives where each block starts and the time of its first
+ *   record, so a range is found with a binary search and read without
+ *   decoding all of it.
+ *
+ *   Change History:
+ *    Date       Author     Modification
+ *
+ ********************************************************************************/
+
+#include <string.h>
+#include <algorithm>
+#include "history.h"
+
+using namespace std;
+
+typedef struct
+{
+  char magic[8];		// HGZ_MAGIC
+  uint32_t count;		// Records
+  uint32_t blocks;
+  int64_t first, last;		// Times
+  int32_t scale[HGZ_COLUMNS];	// Columns are divided by this
+  int32_t base[HGZ_COLUMNS-1];	// The rest of the first record, scaled
+  uint32_t reserved;
+} THgzHeader;			// Then a THgzIndex for each block
+
+typedef struct
+{
+  uint32_t offset;		// From the header, 64 bit aligned. It ends where the next one starts
+  uint32_t start;		// Time of its first record, scaled, from the first one
+} THgzIndex;
+
+/* Blocks are bits, least significant first in 64 bit words: the usual
+   interval of the times, the first values from base, the code of each
+   column and their values. Then a word more, so the reader may always
+   read two */
+#define HGZ_FIXED        0	// Every value with width bits
+#define HGZ_RICE         1	// Rice code with k bits
+#define HGZ_RUNS         2	// Rice codes of the runs of zeros (k bits) and the rest of values less 1 (k2)
+
+typedef struct
+{
+  int width;			// Bits of the largest value. If it's 0 they are all 0 and there is no more
+  bool from_start;		// Values are from the first one of the block, not from the previous one
+  int type;			// HGZ_FIXED, HGZ_RICE or HGZ_RUNS
+  int k, k2;
+} THgzCode;
+
+typedef struct
+{
+  vector<uint64_t> words;
+  size_t bit;
+} THgzWriter;
+
+typedef struct
+{
+  const uint64_t *words;
+  size_t bit;
+  size_t limit;			// We don't read from here on, even if bit goes on
+} THgzReader;
+
+#define INDEX(h) ((const THgzIndex*)((const char*)(h)+sizeof(THgzHeader)))
+#define RUN_BITS (bits(HGZ_BLOCK-1)) // Of the longest run of zeros
+
+/*************************************************************
+ *     Function: column                                      *
+ *************************************************************
+ *  Description:                                             *
+ *     Fields of a record by number, 0 is the time.          *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+static inline int64_t column(const THistoryRecord &r, int c)
+{
+  switch (c)
+    {
+    case 0: return r.time;
+    case 1: return r.temp;
+    case 2: return r.dewpoint;
+    case 3: return r.pressure;
+    case 4: return r.humidity;
+    case 5: return r.wind_dir;
+    case 6: return r.wind_speed;
+    case 7: return r.theme;
+    default: return r.flags;
+    }
+}
+
+static inline uint64_t zigzag(int64_t v)
+{
+  return ((uint64_t)v<<1) ^ (uint64_t)(v>>63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+  return (int64_t)(v>>1) ^ -(int64_t)(v & 1);
+}
+
+static inline int bits(uint64_t v)
+{
+  return (v)?64-__builtin_clzll(v):0;
+}
+
+static int64_t gcd(int64_t a, int64_t b)
+{
+  int64_t t;
+
+  if (a<0) a = -a;
+  if (b<0) b = -b;
+  while (b)
+    {
+      t = a%b;
+      a = b;
+      b = t;
+    }
+  return a;
+}
+
+/* Least significant bits first. w must be zeroed */
+static inline void put_bits(uint64_t *w, size_t bit, uint64_t v, int width)
+{
+  if (width<64)
+    v &= ((uint64_t)1<<width)-1;
+  w[bit/64] |= v<<(bit%64);
+  if ((bit%64)+width>64)
+    w[bit/64+1] |= v>>(64-bit%64);
+}
+
+static inline uint64_t get_bits(const uint64_t *w, size_t bit, uint64_t mask)
+{
+  size_t i = bit/64;
+  int o = bit%64;
+  uint64_t lo = w[i]>>o, hi = (o)?w[i+1]<<(64-o):0; // We always have a word after
+
+  return (lo | hi) & mask;
+}
+
+/*************************************************************
+ *     Function: put, put_number, put_rice, get, get_number, *
+ *     get_rice                                              *
+ *************************************************************
+ *  Description:                                             *
+ *     Values in a block. Numbers are their bits (in 7 bits) *
+ *  and then the value. A Rice code with k bits is q=v>>k    *
+ *  ones, a zero and the k low bits, but from HGZ_ESCAPE     *
+ *  ones on the value follows with all its width.            *
+ *     Readers never read from the limit on: they give 0,    *
+ *  but they go on counting the bits.                        *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+static void put(THgzWriter &out, uint64_t v, int width)
+{
+  if (out.words.size()<(out.bit+width)/64+2)
+    out.words.resize((out.bit+width)/64+2, 0); // put_bits() may write the next one
+  put_bits(&out.words[0], out.bit, v, width);
+  out.bit += width;
+}
+
+static void put_number(THgzWriter &out, uint64_t v)
+{
+  put(out, bits(v), 7);
+  put(out, v, bits(v));
+}
+
+static void put_rice(THgzWriter &out, uint64_t v, int k, int width)
+{
+  uint64_t q = v>>k;
+
+  if (q<HGZ_ESCAPE)
+    {
+      put(out, ((uint64_t)1<<q)-1, q+1); // q ones and a zero
+      put(out, v, k);
+    }
+  else
+    {
+      put(out, ((uint64_t)1<<HGZ_ESCAPE)-1, HGZ_ESCAPE);
+      put(out, v, width);
+    }
+}
+
+static inline uint64_t get(THgzReader &in, int width)
+{
+  uint64_t v = 0;
+
+  if ((width>0) && (in.bit<in.limit))
+    v = get_bits(in.words, in.bit, (width==64)?~(uint64_t)0:((uint64_t)1<<width)-1);
+  in.bit += width;
+  return v;
+}
+
+static bool get_number(THgzReader &in, uint64_t &v)
+{
+  int width = get(in, 7);
+
+  if (width>64)
+    return false;
+  v = get(in, width);
+  return true;
+}
+
+static inline uint64_t get_rice(THgzReader &in, int k, int width)
+{
+  int q;
+
+  if (in.bit>=in.limit)
+    {
+      in.bit++;
+      return 0;
+    }
+  q = __builtin_ctzll(~get_bits(in.words, in.bit, ((uint64_t)1<<HGZ_ESCAPE)-1)); // 0 to HGZ_ESCAPE
+  if (q<HGZ_ESCAPE)
+    {
+      in.bit += q+1;
+      return ((uint64_t)q<<k) | get(in, k);
+    }
+  in.bit += HGZ_ESCAPE;
+  return get(in, width);
+}
+
+/*************************************************************
+ *     Function: rice_size, best_code                        *
+ *************************************************************
+ *  Description:                                             *
+ *     Bits of the values with the best Rice code, and the   *
+ *  smallest code of a column of a block (u[1] to u[m-1],    *
+ *  the first value is apart), with its own bits.            *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+static size_t rice_size(const uint64_t *u, unsigned int n, int width, int &k)
+{
+  size_t size, best = 0;
+
+  k = 0;
+  for (int j=0; (j<=width) && (j<64); j++)
+    {
+      size = 0;
+      for (unsigned int i=0; i<n; i++)
+	size += ((u[i]>>j)<HGZ_ESCAPE)?(u[i]>>j)+1+j:HGZ_ESCAPE+width;
+      if ((j==0) || (size<best))
+	{
+	  best = size;
+	  k = j;
+	}
+    }
+  return best;
+}
+
+static size_t best_code(const uint64_t *u, unsigned int m, THgzCode &code)
+{
+  uint64_t runs[HGZ_BLOCK], values[HGZ_BLOCK], any = 0;
+  unsigned int nruns = 0, nvalues = 0, run = 0;
+  size_t size, other;
+  int k, k2;
+
+  for (unsigned int i=1; i<m; i++)
+    any |= u[i];
+  code.width = bits(any);
+  code.type = HGZ_FIXED;
+  code.k = code.k2 = 0;
+  if (code.width==0)
+    return 7;
+  size = 10+(size_t)(m-1)*code.width;
+
+  other = 16+rice_size(u+1, m-1, code.width, k);
+  if (other<size)
+    {
+      size = other;
+      code.type = HGZ_RICE;
+      code.k = k;
+    }
+
+  for (unsigned int i=1; i<m; i++)
+    if (u[i]==0)
+      run++;
+    else
+      {
+	runs[nruns++] = run;
+	values[nvalues++] = u[i]-1;
+	run = 0;
+      }
+  runs[nruns++] = run;		// To the end, maybe 0
+  other = 22+rice_size(runs, nruns, RUN_BITS, k)+rice_size(values, nvalues, code.width, k2);
+  if (other<size)
+    {
+      size = other;
+      code.type = HGZ_RUNS;
+      code.k = k;
+      code.k2 = k2;
+    }
+  return size;
+}
+
+/*************************************************************
+ *     Function: pack, unpack, read_block                    *
+ *************************************************************
+ *  Description:                                             *
+ *     The values of a column of a block with their code,    *
+ *  and the beginning of a block: interval, first values and *
+ *  codes. read_block() is false if that's wrong.            *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+static void pack(THgzWriter &out, const uint64_t *u, unsigned int m, const THgzCode &code)
+{
+  uint64_t run = 0;
+
+  if (code.width==0)
+    return;
+  for (unsigned int i=1; i<m; i++)
+    if (code.type==HGZ_FIXED)
+      put(out, u[i], code.width);
+    else if (code.type==HGZ_RICE)
+      put_rice(out, u[i], code.k, code.width);
+    else if (u[i]==0)
+      run++;
+    else
+      {
+	put_rice(out, run, code.k, RUN_BITS);
+	put_rice(out, u[i]-1, code.k2, code.width);
+	run = 0;
+      }
+  if (code.type==HGZ_RUNS)
+    put_rice(out, run, code.k, RUN_BITS);
+}
+
+static void unpack(THgzReader &in, const THgzCode &code, unsigned int m, uint64_t *u)
+{
+  uint64_t mask = (code.width==64)?~(uint64_t)0:((uint64_t)1<<code.width)-1, run;
+  unsigned int i = 1;
+
+  if ((code.width==0) || (m<2))
+    ;
+  else if (code.type==HGZ_FIXED)
+    {
+      if (in.bit+(size_t)(m-1)*code.width<=in.limit) // Else it's broken, we don't read out of the block
+	for (; i<m; i++)
+	  u[i] = get_bits(in.words, in.bit+(size_t)(i-1)*code.width, mask);
+      in.bit += (size_t)(m-1)*code.width;
+    }
+  else if (code.type==HGZ_RICE)
+    for (; i<m; i++)
+      u[i] = get_rice(in, code.k, code.width);
+  else
+    for (;;)
+      {
+	run = get_rice(in, code.k, RUN_BITS);
+	if (run>=m-i)		// The last one
+	  break;
+	for (; run>0; run--)
+	  u[i++] = 0;
+	u[i++] = get_rice(in, code.k2, code.width)+1;
+      }
+  for (; i<m; i++)
+    u[i] = 0;
+}
+
+static bool read_block(THgzReader &in, const THgzHeader *h, int64_t *first, int64_t &interval,
+		       THgzCode *codes)
+{
+  uint64_t v;
+
+  if (!get_number(in, v))
+    return false;
+  interval = unzigzag(v);
+  for (int c=1; c<HGZ_COLUMNS; c++)
+    {
+      if (!get_number(in, v))
+	return false;
+      first[c] = h->base[c-1]+unzigzag(v);
+    }
+  for (int c=0; c<HGZ_COLUMNS; c++)
+    {
+      codes[c].width = get(in, 7);
+      codes[c].from_start = false;
+      codes[c].type = HGZ_FIXED;
+      codes[c].k = codes[c].k2 = 0;
+      if (codes[c].width>64)
+	return false;
+      if (codes[c].width==0)
+	continue;
+      codes[c].from_start = get(in, 1);
+      codes[c].type = get(in, 2);
+      if (codes[c].type>HGZ_RUNS)
+	return false;
+      if (codes[c].type!=HGZ_FIXED)
+	codes[c].k = get(in, 6);
+      if (codes[c].type==HGZ_RUNS)
+	codes[c].k2 = get(in, 6);
+    }
+  return (in.bit<=in.limit);
+}
+
+/*************************************************************
+ *     Function: usual_interval                              *
+ *************************************************************
+ *  Description:                                             *
+ *     The most frequent time between records of a block.    *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+static int64_t usual_interval(const int64_t *v, unsigned int m)
+{
+  int64_t d[HGZ_BLOCK], usual = 0;
+  unsigned int n = 0, run, most = 0;
+
+  for (unsigned int i=1; i<m; i++)
+    d[n++] = v[i]-v[i-1];
+  sort(d, d+n);
+  for (unsigned int i=0; i<n; i+=run)
+    {
+      for (run=1; (i+run<n) && (d[i+run]==d[i]); run++)
+	;
+      if (run>most)
+	{
+	  most = run;
+	  usual = d[i];
+	}
+    }
+  return usual;
+}
+
+/*************************************************************
+ *     Function: histcodec_encode                            *
+ *************************************************************
+ *  Description:                                             *
+ *     Compresses records, in time order.                    *
+ *                                                           *
+ * Input:                                                    *
+ *   const THistoryRecord *records, size_t count - Records   *
+ *   vector<char> &out - Compressed segment                  *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - False if there is nothing to compress            *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool histcodec_encode(const THistoryRecord *records, size_t count, vector<char> &out)
+{
+  THgzHeader h;
+  THgzIndex index;
+  THgzCode codes[HGZ_COLUMNS], code;
+  THgzWriter block;
+  int64_t v[HGZ_BLOCK], interval = 0;
+  uint64_t u[HGZ_COLUMNS][HGZ_BLOCK], other[HGZ_BLOCK];
+  unsigned int m;
+
+  if ((count==0) || (count>0xffffffff))
+    return false;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, HGZ_MAGIC, 8);
+  h.count = count;
+  h.blocks = (count+HGZ_BLOCK-1)/HGZ_BLOCK;
+  h.first = records[0].time;
+  h.last = records[count-1].time;
+  for (int c=0; c<HGZ_COLUMNS; c++)
+    {
+      int64_t g = 0;
+      for (size_t k=0; (k<count) && (g!=1); k++)
+	g = gcd(g, column(records[k], c));
+      h.scale[c] = ((g==0) || (g>0x7fffffff))?1:g;
+      if (c>0)
+	h.base[c-1] = column(records[0], c)/h.scale[c];
+    }
+  if ((h.last-h.first)/h.scale[0]>0xffffffff)
+    return false;		// Times in the index are 32 bits
+
+  out.assign(sizeof(h)+h.blocks*sizeof(THgzIndex), 0);
+  out.resize((out.size()+7)/8*8, 0); // Blocks are 64 bit aligned
+  for (unsigned int blk=0; blk<h.blocks; blk++)
+    {
+      const THistoryRecord *r = records+blk*HGZ_BLOCK;
+      m = (count-blk*HGZ_BLOCK<HGZ_BLOCK)?count-blk*HGZ_BLOCK:HGZ_BLOCK;
+
+      block.words.clear();
+      block.bit = 0;
+      for (int c=0; c<HGZ_COLUMNS; c++)
+	{
+	  for (unsigned int i=0; i<m; i++)
+	    v[i] = column(r[i], c)/h.scale[c];
+	  if (c==0)
+	    {
+	      interval = usual_interval(v, m);
+	      index.offset = out.size();
+	      index.start = v[0]-h.first/h.scale[0];
+	      put_number(block, zigzag(interval));
+	    }
+	  else
+	    put_number(block, zigzag(v[0]-h.base[c-1]));
+
+	  for (unsigned int i=1; i<m; i++)
+	    {
+	      u[c][i] = zigzag(v[i]-v[i-1]-((c==0)?interval:0));
+	      other[i] = zigzag(v[i]-v[0]);
+	    }
+	  if (best_code(other, m, code)<best_code(u[c], m, codes[c]))
+	    {
+	      codes[c] = code;
+	      codes[c].from_start = true;
+	      memcpy(u[c], other, sizeof(other));
+	    }
+	  else
+	    codes[c].from_start = false;
+	}
+
+      for (int c=0; c<HGZ_COLUMNS; c++)
+	{
+	  put(block, codes[c].width, 7);
+	  if (codes[c].width==0)
+	    continue;
+	  put(block, codes[c].from_start, 1);
+	  put(block, codes[c].type, 2);
+	  if (codes[c].type!=HGZ_FIXED)
+	    put(block, codes[c].k, 6);
+	  if (codes[c].type==HGZ_RUNS)
+	    put(block, codes[c].k2, 6);
+	}
+      for (int c=0; c<HGZ_COLUMNS; c++)
+	pack(block, u[c], m, codes[c]);
+      block.words.resize((block.bit+63)/64+1, 0); // And a word more
+
+      memcpy(&out[sizeof(h)+blk*sizeof(THgzIndex)], &index, sizeof(index));
+      out.insert(out.end(), (const char*)block.words.data(),
+		 (const char*)(block.words.data()+block.words.size()));
+    }
+  if (out.size()>0xffffffff)
+    return false;
+  memcpy(&out[0], &h, sizeof(h));
+  return true;
+}
+
+/*************************************************************
+ *     Function: histcodec_check                             *
+ *************************************************************
+ *  Description:                                             *
+ *     Checks the index of a compressed segment and the      *
+ *  beginning of every block. HistDecoder::init() calls it,  *
+ *  and the decoder doesn't read out of the blocks, so it    *
+ *  never reads out of the segment, even from a broken file. *
+ *                                                           *
+ * Input:                                                    *
+ *   const void *data, size_t size - Compressed segment      *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - False if it's wrong or truncated                 *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool histcodec_check(const void *data, size_t size)
+{
+  const THgzHeader *h = (const THgzHeader*)data;
+  const THgzIndex *index = INDEX(h);
+  THgzCode codes[HGZ_COLUMNS];
+  THgzReader in;
+  int64_t first[HGZ_COLUMNS], interval;
+  size_t end;
+
+  if ((size<sizeof(THgzHeader)) || (size%8) || (memcmp(h->magic, HGZ_MAGIC, 8)!=0) ||
+      (h->count==0) || (h->blocks!=(h->count+HGZ_BLOCK-1)/HGZ_BLOCK) ||
+      (size<sizeof(THgzHeader)+(size_t)h->blocks*sizeof(THgzIndex)))
+    return false;
+  for (int c=0; c<HGZ_COLUMNS; c++)
+    if (h->scale[c]<1)
+      return false;
+
+  for (unsigned int k=0; k<h->blocks; k++)
+    {
+      end = (k+1<h->blocks)?index[k+1].offset:size;
+      if ((index[k].offset%8) || (index[k].offset<sizeof(THgzHeader)+h->blocks*sizeof(THgzIndex)) ||
+	  (end>size) || (end<(size_t)index[k].offset+8))
+	return false;
+      if ((k>0) && (index[k].start<index[k-1].start))
+	return false;		// seek() needs them in order
+      in.words = (const uint64_t*)((const char*)data+index[k].offset);
+      in.bit = 0;
+      in.limit = (end-index[k].offset-8)*8;
+      if (!read_block(in, h, first, interval, codes))
+	return false;
+    }
+  return true;
+}
+
+/*************************************************************
+ *     Constructor HistDecoder, Method: init, count, first,  *
+ *     last                                                  *
+ *************************************************************
+ *  Description:                                             *
+ *     The segment to decode, and what its header says. It's *
+ *  checked first: a wrong or truncated one has no records,  *
+ *  so we never read out of it.                              *
+ *                                                           *
+ * Input:                                                    *
+ *   const void *data, size_t size - Compressed segment      *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - init() returns false if it's wrong               *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+HistDecoder::HistDecoder()
+{
+  data = NULL;
+  size = 0;
+  block = 0;
+  blocks = 0;
+}
+
+bool HistDecoder::init(const void *data, size_t size)
+{
+  this->data = (const char*)data;
+  this->size = size;
+  block = 0;
+  blocks = (histcodec_check(data, size))?((const THgzHeader*)data)->blocks:0;
+  return (blocks>0);
+}
+
+size_t HistDecoder::count()
+{
+  return (blocks>0)?((const THgzHeader*)data)->count:0;
+}
+
+int64_t HistDecoder::first()
+{
+  return (blocks>0)?((const THgzHeader*)data)->first:0;
+}
+
+int64_t HistDecoder::last()
+{
+  return (blocks>0)?((const THgzHeader*)data)->last:0;
+}
+
+/*************************************************************
+ *     Method: seek                                          *
+ *************************************************************
+ *  Description:                                             *
+ *     Binary search of the last block starting at time or   *
+ *  before, it's where that time may be.                     *
+ *                                                           *
+ * Input:                                                    *
+ *   int64_t time - Time we want                             *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void HistDecoder::seek(int64_t time)
+{
+  const THgzHeader *h = (const THgzHeader*)data;
+  unsigned int lo = 0, hi = blocks, mid;
+
+  while (hi-lo>1)
+    {
+      mid = (lo+hi)/2;
+      if (h->first+(int64_t)INDEX(h)[mid].start*h->scale[0]<=time)
+	lo = mid;
+      else
+	hi = mid;
+    }
+  block = lo;
+}
+
+/*************************************************************
+ *     Method: next                                          *
+ *************************************************************
+ *  Description:                                             *
+ *     Decodes the next block, column by column: the codes   *
+ *  of each value, then the differences added up.            *
+ *                                                           *
+ * Input:                                                    *
+ *   THistoryRecord *records - Room for HGZ_BLOCK            *
+ *                                                           *
+ * Output:                                                   *
+ *   size_t - Records decoded, 0 if there are no more        *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+#define STORE(field) for (unsigned int i=0; i<m; i++) records[i].field = v[i]*scale
+
+size_t HistDecoder::next(THistoryRecord *records)
+{
+  const THgzHeader *h = (const THgzHeader*)data;
+  const THgzIndex *index;
+  THgzCode codes[HGZ_COLUMNS];
+  THgzReader in;
+  int64_t first[HGZ_COLUMNS], v[HGZ_BLOCK], interval, d, scale;
+  uint64_t u[HGZ_BLOCK];
+  unsigned int m;
+
+  if (block>=blocks)
+    return 0;
+  index = INDEX(h)+block;
+  m = (block+1<blocks)?HGZ_BLOCK:h->count-block*HGZ_BLOCK;
+  in.words = (const uint64_t*)(data+index->offset);
+  in.bit = 0;
+  in.limit = (((block+1<blocks)?index[1].offset:size)-index->offset-8)*8; // init() checked them
+  block++;
+  first[0] = h->first/h->scale[0]+index->start;
+  if (!read_block(in, h, first, interval, codes))
+    return 0;
+
+  for (int c=0; c<HGZ_COLUMNS; c++)
+    {
+      unpack(in, codes[c], m, u);
+      v[0] = first[c];
+      if (codes[c].from_start)
+	for (unsigned int i=1; i<m; i++)
+	  v[i] = v[0]+unzigzag(u[i]);
+      else
+	{
+	  d = (c==0)?interval:0;
+	  for (unsigned int i=1; i<m; i++)
+	    v[i] = v[i-1]+d+unzigzag(u[i]);
+	}
+
+      scale = h->scale[c];
+      switch (c)		// Not in the loop, so each one is a plain loop
+	{
+	case 0:
+	  for (unsigned int i=0; i<m; i++)
+	    {
+	      records[i].time = v[i]*scale;
+	      records[i].reserved = 0;
+	    }
+	  break;
+	case 1: STORE(temp); break;
+	case 2: STORE(dewpoint); break;
+	case 3: STORE(pressure); break;
+	case 4: STORE(humidity); break;
+	case 5: STORE(wind_dir); break;
+	case 6: STORE(wind_speed); break;
+	case 7: STORE(theme); break;
+	default: STORE(flags); break;
+	}
+    }
+  return m;
+}
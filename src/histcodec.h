@@ -0,0 +1,38 @@
+#ifndef _HISTCODEC_H_
+#define _HISTCODEC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/* Included by history.h, after THistoryRecord */
+
+#define HGZ_MAGIC        "DWGOHGZ2"
+#define HGZ_BLOCK        256	// Records coded together, with the same codes
+#define HGZ_COLUMNS      9	// time, temp, dewpoint, pressure, humidity, wind_dir, wind_speed, theme, flags
+#define HGZ_ESCAPE       6	// Ones of the longest Rice prefix, then the value with all its bits
+
+/* A sealed history segment, compressed. Don't need an X display */
+bool histcodec_encode(const THistoryRecord *records, size_t count, std::vector<char> &out);
+bool histcodec_check(const void *data, size_t size); /* Is it a whole compressed segment? */
+
+/* Decodes a compressed segment a block at a time, from the block where a
+   time may be. It reads the data where it is (mapped) */
+class HistDecoder
+{
+ public:
+  HistDecoder();
+
+  bool init(const void *data, size_t size); /* False if histcodec_check() doesn't accept it */
+  size_t count();			/* Records in the segment */
+  int64_t first(), last();		/* Times */
+  void seek(int64_t time);		/* next() starts with the block of this time */
+  size_t next(THistoryRecord *records);	/* Up to HGZ_BLOCK of them, 0 at the end */
+
+ private:
+  const char *data;
+  size_t size;
+  unsigned int block, blocks;		/* None if it's wrong */
+};
+
+#endif
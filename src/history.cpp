@@ -0,0 +1,835 @@
+ /********************************************************************************
+ *  File: history.cpp								*
+ *  Author: Gaspar Fernández (helyo@totaki.com) 				*
+ *										*
+ *  Copyright (C) 2008   Gaspar Fernández					*
+ *										*
+ *  This program is free software: you can redistribute it and/or modify	*
+ *  it under the terms of the GNU General Public License as published by	*
+ *  the Free Software Foundation, either version 3 of the License, or 		*
+ *  (at your option) any later version.  	      	  	   		*
+ *										*
+ *  This program is distributed in the hope that it will be useful,		*
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of		*
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the		*
+ *  GNU General Public License for more details.				*
+ *										*
+ *  You should have received a copy of the GNU General Public License		*
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.	*
+ *									        *
+ ********************************************************************************
+ *   Description:
+ *     History of the observations of every station, for trends. Each station
+ *   has a directory with segment files, named after the time of their first
+ *   record. A segment is a small header and room for HISTORY_SEGMENT fixed
+ *   size records, created at its full size and mapped in memory: appending
+ *   is copying the record after the last one and then increasing the count
+ *   in the header, so a crash may lose the last record but never leaves a
+ *   broken one. When a segment is full we start another one.
+ *     Full segments are compressed in the background by compact(), with
+ *   histcodec.cpp, into a file with the same name and HISTORY_PACKED
+ *   extension: a tenth of their size or less, some 15 to 18 bits a record
+ *   instead of 24 bytes, or 40 KB per station and year of half-hourly
+ *   reports. It's written with another name, synced and renamed, and once
+ *   the directory is synced too the raw one is removed. If we crash between
+ *   both, the raw one is removed the next time we read the station.
+ *     Each station also has the min, max and mean of its temperatures at a
+ *   few resolutions (trend.cpp), for sparklines. warm() reads them from the
+ *   history once, out of the lock and out of the drawing thread, and then
+ *   every record we append is added to them. trend() never reads the disk.
+ *     Records are in time order (we only append newer ones, the same report
+ *   is fetched many times), so finding a time range is a binary search on
+ *   the segments and another one inside them. A HistoryCursor gives the
+ *   mapped records where they are and decodes the compressed ones a block
+ *   at a time. Segments are never unmapped while the store exists (not
+ *   even the raw ones we have compressed), so cursors are valid until it's
+ *   deleted.
+ *
+ *   Change History:
+ *    Date       Author     Modification
+ *
+ ********************************************************************************/
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <algorithm>
+#include "history.h"
+#include "localtemp.h"
+#include "errors.h"
+
+using namespace std;
+
+typedef struct
+{
+  char magic[8];		// HISTORY_MAGIC
+  uint32_t record_size;		// sizeof(THistoryRecord)
+  uint32_t capacity;		// Records it has room for
+  uint32_t count;		// Records written. Increased after writing one
+  uint32_t reserved[3];
+} THistoryHeader;
+
+#define RECORDS(map) ((THistoryRecord*)((char*)(map)+sizeof(THistoryHeader)))
+#define HEADER(map) ((THistoryHeader*)(map))
+
+static bool before(const THistoryRecord &rec, int64_t time)
+{
+  return rec.time<time;
+}
+
+static void add_records(HistoryCursor &cursor, TrendTiers *tiers)
+{
+  const THistoryRecord *records;
+  size_t n;
+
+  while ((n = cursor.next(&records))>0)
+    for (size_t k=0; k<n; k++)
+      tiers->add(records[k].time, records[k].temp);
+}
+
+static bool sync_dir(const string &dir) // A rename is only durable then
+{
+  int fd = open(dir.data(), O_RDONLY | O_DIRECTORY);
+  bool ok = (fd>=0) && (fsync(fd)==0);
+
+  if (fd>=0)
+    close(fd);
+  return ok;
+}
+
+/*************************************************************
+ *     Constructor / Destructor HistoryStore                 *
+ *************************************************************
+ *  Description:                                             *
+ *     Stations are read from disk the first time we use     *
+ *  them.                                                    *
+ *                                                           *
+ * Input:                                                    *
+ *    const char* dir - Where the stations are               *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+HistoryStore::HistoryStore(const char* dir)
+{
+  pthread_mutex_init(&lock, NULL);
+  pthread_mutex_init(&packing, NULL);
+  pthread_cond_init(&wake, NULL);
+  this->dir = dir;
+  pending = false;
+  quit = false;
+  running = (pthread_create(&thread, NULL, compactor, this)==0);
+  if (!running)
+    verbsth(VERB_WARNING, "Can't create the history thread, full files won't be compressed");
+}
+
+HistoryStore::~HistoryStore()
+{
+  if (running)
+    {
+      pthread_mutex_lock(&lock);
+      quit = true;
+      pthread_cond_signal(&wake);
+      pthread_mutex_unlock(&lock);
+      pthread_join(thread, NULL); // After the segment it's compressing
+    }
+  for (map<string, TStation>::iterator s=stations.begin(); s!=stations.end(); ++s)
+    {
+      for (unsigned int k=0; k<s->second.segments.size(); k++)
+	munmap(s->second.segments[k].map, s->second.segments[k].size);
+      delete s->second.tiers;
+    }
+  for (unsigned int k=0; k<retired.size(); k++)
+    munmap(retired[k].map, retired[k].size);
+  pthread_cond_destroy(&wake);
+  pthread_mutex_destroy(&packing);
+  pthread_mutex_destroy(&lock);
+}
+
+/*************************************************************
+ *     Method: record                                        *
+ *************************************************************
+ *  Description:                                             *
+ *     What we store of the last report of a station.        *
+ *                                                           *
+ * Input:                                                    *
+ *    const localtemp *station - Station just parsed         *
+ *    THistoryRecord &rec - Where to write it                *
+ *                                                           *
+ * Output:                                                   *
+ *    bool - False if we don't have a report                 *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool HistoryStore::record(const localtemp *station, THistoryRecord &rec)
+{
+  memset(&rec, 0, sizeof(rec));
+  if ((!station->loaded) || (station->report_time<=0))
+    return false;
+
+  rec.time = station->report_time;
+  rec.temp = station->celsius*10;
+  rec.theme = station->theme;
+  if (station->humidity>0)
+    {
+      rec.humidity = station->humidity;
+      rec.flags |= HISTORY_HUMIDITY;
+    }
+  if (station->dewpoint!=UNKNOWN_VALUE)
+    {
+      rec.dewpoint = station->dewpoint*10;
+      rec.flags |= HISTORY_DEWPOINT;
+    }
+  if (station->pressure!=UNKNOWN_VALUE)
+    {
+      rec.pressure = station->pressure*10;
+      rec.flags |= HISTORY_PRESSURE;
+    }
+  if (station->wind_speed!=UNKNOWN_VALUE)
+    {
+      rec.wind_speed = station->wind_speed*10;
+      rec.flags |= HISTORY_WIND;
+    }
+  if (station->wind_dir!=UNKNOWN_VALUE)
+    {
+      rec.wind_dir = station->wind_dir;
+      rec.flags |= HISTORY_WIND_DIR;
+    }
+  return true;
+}
+
+/*************************************************************
+ *     Method: openSegment, newSegment                       *
+ *************************************************************
+ *  Description:                                             *
+ *     Maps a segment file, after checking its header, or    *
+ *  creates a new one for a station. Call them locked.       *
+ *                                                           *
+ * Input:                                                    *
+ *    TSegment &seg - Segment, with its file                 *
+ *    bool create - The file must not exist                  *
+ *    const char* metar, TStation &st - Station              *
+ *    int64_t first - Time of its first record               *
+ *                                                           *
+ * Output:                                                   *
+ *    bool - False if we can't use it                        *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool HistoryStore::openSegment(TSegment &seg, bool create)
+{
+  THistoryHeader *h;
+  struct stat st;
+  int fd = open(seg.file.data(), (create)?(O_RDWR | O_CREAT | O_EXCL):O_RDWR, 0644);
+
+  seg.map = NULL;
+  seg.size = sizeof(THistoryHeader)+HISTORY_SEGMENT*sizeof(THistoryRecord);
+  seg.packed = false;
+  if (fd<0)
+    return false;
+  if (((create) && (ftruncate(fd, seg.size)<0)) || (fstat(fd, &st)<0) || ((size_t)st.st_size!=seg.size))
+    {
+      close(fd);
+      return false;
+    }
+  seg.map = mmap(NULL, seg.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (seg.map==MAP_FAILED)
+    {
+      seg.map = NULL;
+      return false;
+    }
+
+  h = HEADER(seg.map);
+  if (create)			// The file is all zeros
+    {
+      memcpy(h->magic, HISTORY_MAGIC, 8);
+      h->record_size = sizeof(THistoryRecord);
+      h->capacity = HISTORY_SEGMENT;
+    }
+  else if ((memcmp(h->magic, HISTORY_MAGIC, 8)!=0) || (h->record_size!=sizeof(THistoryRecord)) ||
+	   (h->capacity!=HISTORY_SEGMENT) || (h->count>h->capacity))
+    {
+      munmap(seg.map, seg.size);
+      seg.map = NULL;
+      return false;
+    }
+
+  seg.first = (h->count>0)?RECORDS(seg.map)[0].time:0;
+  seg.last = (h->count>0)?RECORDS(seg.map)[h->count-1].time:0;
+  return true;
+}
+
+bool HistoryStore::newSegment(const char* metar, TStation &st, int64_t first)
+{
+  string path = dir+"/"+metar;
+  TSegment seg;
+  char name[32];
+
+  if ((mkdir(dir.substr(0, dir.rfind('/')).data(), 0755)<0) && (errno!=EEXIST))
+    return false;		// ~/.dwgo may not be there yet
+  if (((mkdir(dir.data(), 0755)<0) && (errno!=EEXIST)) ||
+      ((mkdir(path.data(), 0755)<0) && (errno!=EEXIST)))
+    return false;
+
+  snprintf(name, sizeof(name), "/%012lld" HISTORY_RAW, (long long)first); // They sort by time
+  seg.file = path+name;
+  if (!openSegment(seg, true))
+    {
+      verbsth(VERB_WARNING, "Can't create history file: "+seg.file);
+      return false;
+    }
+  if (!st.segments.empty())
+    {
+      pending = true;		// The one before is full now
+      pthread_cond_signal(&wake);
+    }
+  st.segments.push_back(seg);
+  return true;
+}
+
+/*************************************************************
+ *     Method: openPacked, pack                              *
+ *************************************************************
+ *  Description:                                             *
+ *     Maps a compressed segment, read only, after checking  *
+ *  all of it. Or compresses a full segment into a new file, *
+ *  and checks it decodes to the same records before using   *
+ *  it. pack() doesn't need the lock: full segments don't    *
+ *  change.                                                  *
+ *                                                           *
+ * Input:                                                    *
+ *    TSegment &seg - Compressed segment, with its file      *
+ *    const TSegment &seg, TSegment &packed - Full segment   *
+ *                and where to put the compressed one        *
+ *                                                           *
+ * Output:                                                   *
+ *    bool - False if we can't use it                        *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool HistoryStore::openPacked(TSegment &seg)
+{
+  HistDecoder decoder;
+  struct stat st;
+  int fd = open(seg.file.data(), O_RDONLY);
+
+  seg.map = NULL;
+  seg.packed = true;
+  if (fd<0)
+    return false;
+  if (fstat(fd, &st)<0)
+    {
+      close(fd);
+      return false;
+    }
+  seg.size = st.st_size;
+  seg.map = (seg.size>0)?mmap(NULL, seg.size, PROT_READ, MAP_SHARED, fd, 0):MAP_FAILED;
+  close(fd);
+  if (seg.map==MAP_FAILED)
+    {
+      seg.map = NULL;
+      return false;
+    }
+  if (!decoder.init(seg.map, seg.size)) // Wrong or truncated
+    {
+      munmap(seg.map, seg.size);
+      seg.map = NULL;
+      return false;
+    }
+  seg.first = decoder.first();
+  seg.last = decoder.last();
+  return true;
+}
+
+bool HistoryStore::pack(const TSegment &seg, TSegment &packed)
+{
+  const THistoryRecord *records = RECORDS(seg.map);
+  THistoryRecord check[HGZ_BLOCK];
+  size_t count = HEADER(seg.map)->count, done = 0, n;
+  HistDecoder decoder;
+  vector<char> data;
+  string tmp;
+  bool ok;
+  int fd;
+
+  if (!histcodec_encode(records, count, data))
+    return false;
+  if (!decoder.init(&data[0], data.size()))
+    return false;
+  while ((n = decoder.next(check))>0)
+    {
+      if ((done+n>count) || (memcmp(check, records+done, n*sizeof(THistoryRecord))!=0))
+	return false;
+      done += n;
+    }
+  if (done!=count)
+    return false;
+
+  packed.file = seg.file.substr(0, seg.file.size()-strlen(HISTORY_RAW))+HISTORY_PACKED;
+  tmp = packed.file+".tmp";
+  fd = open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ok = (fd>=0) && (write(fd, &data[0], data.size())==(ssize_t)data.size()) &&
+    (fsync(fd)==0);		// Data on disk before the rename
+  if (fd>=0)
+    close(fd);
+  if ((!ok) || (rename(tmp.data(), packed.file.data())<0))
+    {
+      unlink(tmp.data());
+      return false;
+    }
+  if ((!sync_dir(packed.file.substr(0, packed.file.rfind('/')))) || (!openPacked(packed)))
+    {
+      unlink(packed.file.data());
+      return false;
+    }
+  return true;
+}
+
+/*************************************************************
+ *     Method: station                                       *
+ *************************************************************
+ *  Description:                                             *
+ *     Segments of a station, mapped the first time we want  *
+ *  them. Wrong files are skipped. Call it locked.           *
+ *                                                           *
+ * Input:                                                    *
+ *    const char* metar - ICAO id                            *
+ *                                                           *
+ * Output:                                                   *
+ *    TStation& - Its segments, maybe none                   *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+HistoryStore::TStation &HistoryStore::station(const char* metar)
+{
+  map<string, TStation>::iterator found = stations.find(metar);
+  vector<string> files;
+  struct dirent *entry;
+  TSegment seg;
+  const char *ext;
+  bool ok;
+  DIR *d;
+
+  if (found!=stations.end())
+    return found->second;
+
+  TStation &st = stations[metar];
+  st.tiers = NULL;
+  d = opendir((dir+"/"+metar).data());
+  if (d==NULL)
+    return st;
+  while ((entry = readdir(d))!=NULL)
+    if ((strlen(entry->d_name)>4) &&
+	((strcmp(entry->d_name+strlen(entry->d_name)-4, HISTORY_RAW)==0) ||
+	 (strcmp(entry->d_name+strlen(entry->d_name)-4, HISTORY_PACKED)==0)))
+      files.push_back(entry->d_name);
+  closedir(d);
+
+  sort(files.begin(), files.end()); // The compressed one first, if both are there
+  for (unsigned int k=0; k<files.size(); k++)
+    {
+      seg.file = dir+"/"+metar+"/"+files[k];
+      ext = files[k].data()+files[k].size()-4;
+      if ((strcmp(ext, HISTORY_RAW)==0) && (!st.segments.empty()) && (st.segments.back().packed) &&
+	  (st.segments.back().file.compare(0, seg.file.size()-4, seg.file, 0, seg.file.size()-4)==0))
+	{
+	  unlink(seg.file.data()); // We crashed after compressing it
+	  continue;
+	}
+
+      ok = (strcmp(ext, HISTORY_RAW)==0)?openSegment(seg, false):openPacked(seg);
+      if (!ok)
+	verbsth(VERB_WARNING, "Ignoring history file: "+seg.file);
+      else if (((!seg.packed) && (HEADER(seg.map)->count==0)) ||
+	       ((!st.segments.empty()) && (seg.first<=st.segments.back().last)))
+	munmap(seg.map, seg.size); // Empty, or out of order: we can't search it
+      else
+	st.segments.push_back(seg);
+    }
+  for (unsigned int k=0; k+1<st.segments.size(); k++)
+    if (!st.segments[k].packed)
+      {
+	pending = true;		// Full, from a run that didn't compress it
+	pthread_cond_signal(&wake);
+      }
+  return st;
+}
+
+/*************************************************************
+ *     Method: append                                        *
+ *************************************************************
+ *  Description:                                             *
+ *     Adds a record after the last one of a station. It     *
+ *  must be newer, so the same report isn't stored twice.    *
+ *                                                           *
+ * Input:                                                    *
+ *    const char* metar - ICAO id                            *
+ *    const THistoryRecord &rec - Observation                *
+ *                                                           *
+ * Output:                                                   *
+ *    bool - False if it's not newer or we can't write it    *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool HistoryStore::append(const char* metar, const THistoryRecord &rec)
+{
+  THistoryHeader *h;
+  TSegment *seg;
+
+  if ((metar[0]=='\0') || (metar[0]=='.') || (strchr(metar, '/')))
+    return false;		// It's a directory name
+
+  pthread_mutex_lock(&lock);
+  TStation &st = station(metar);
+  seg = (st.segments.empty())?NULL:&st.segments.back();
+  if ((seg) && (rec.time<=seg->last)) // Empty ones have last 0
+    {
+      pthread_mutex_unlock(&lock);
+      return false;
+    }
+  if ((seg==NULL) || (seg->packed) || (HEADER(seg->map)->count==HISTORY_SEGMENT))
+    {
+      if (!newSegment(metar, st, rec.time))
+	{
+	  pthread_mutex_unlock(&lock);
+	  return false;
+	}
+      seg = &st.segments.back();
+    }
+
+  h = HEADER(seg->map);
+  memcpy(RECORDS(seg->map)+h->count, &rec, sizeof(rec));
+  __atomic_store_n(&h->count, h->count+1, __ATOMIC_RELEASE); // After the record
+  if (h->count==1)
+    seg->first = rec.time;
+  seg->last = rec.time;
+  if (st.tiers)
+    st.tiers->add(rec.time, rec.temp);
+  pthread_mutex_unlock(&lock);
+  return true;
+}
+
+/*************************************************************
+ *     Method: range, parts, last                            *
+ *************************************************************
+ *  Description:                                             *
+ *     Gives a cursor the segments of a station which may    *
+ *  have records in a time range, as they are now. Records   *
+ *  appended later aren't seen by it. parts() is range()     *
+ *  for a station we have locked.                            *
+ *                                                           *
+ * Input:                                                    *
+ *    const char* metar - ICAO id                            *
+ *    TStation &st - The station                             *
+ *    time_t from, time_t to - Range, to isn't included      *
+ *    HistoryCursor &cursor - Where to read them             *
+ *                                                           *
+ * Output:                                                   *
+ *    time_t - last(): time of the last one, 0 if none       *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void HistoryStore::range(const char* metar, time_t from, time_t to, HistoryCursor &cursor)
+{
+  pthread_mutex_lock(&lock);
+  parts(station(metar), from, to, cursor);
+  pthread_mutex_unlock(&lock);
+}
+
+void HistoryStore::parts(TStation &st, time_t from, time_t to, HistoryCursor &cursor)
+{
+  HistoryCursor::TPart part;
+  unsigned int lo, hi, mid;
+
+  cursor.parts.clear();
+  cursor.part = 0;
+  cursor.from = from;
+  cursor.to = to;
+  cursor.decoding = false;
+
+  lo = 0;			// First segment that ends at from or later
+  hi = st.segments.size();
+  while (lo<hi)
+    {
+      mid = (lo+hi)/2;
+      if (st.segments[mid].last<from)
+	lo = mid+1;
+      else
+	hi = mid;
+    }
+
+  for (unsigned int k=lo; (k<st.segments.size()) && (st.segments[k].first<to); k++)
+    {
+      part.map = st.segments[k].map;
+      part.packed = st.segments[k].packed;
+      part.size = (part.packed)?st.segments[k].size:
+	__atomic_load_n(&HEADER(part.map)->count, __ATOMIC_ACQUIRE);
+      cursor.parts.push_back(part);
+    }
+}
+
+time_t HistoryStore::last(const char* metar)
+{
+  time_t t;
+
+  pthread_mutex_lock(&lock);
+  TStation &st = station(metar);
+  t = (st.segments.empty())?0:st.segments.back().last;
+  pthread_mutex_unlock(&lock);
+  return t;
+}
+
+/*************************************************************
+ *     Method: trend, warm                                   *
+ *************************************************************
+ *  Description:                                             *
+ *     trend() gives the min, max and mean temperatures of a *
+ *  station in a time span, at most max points, from its     *
+ *  tiers. It's quick and never reads the disk: without      *
+ *  tiers there are no points.                               *
+ *    warm() fills them with what the coarsest one keeps.    *
+ *  The history is decoded unlocked, so trend() doesn't wait *
+ *  for it, and what was appended meanwhile is added locked. *
+ *                                                           *
+ * Input:                                                    *
+ *    const char* metar - ICAO id                            *
+ *    time_t from, time_t to - Span, to isn't included       *
+ *    size_t max - Max. points, 0 for TREND_POINTS           *
+ *    vector<TTrendPoint> &points - Where they go            *
+ *                                                           *
+ * Output:                                                   *
+ *    size_t - How many points                               *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+size_t HistoryStore::trend(const char* metar, time_t from, time_t to, size_t max, vector<TTrendPoint> &points)
+{
+  map<string, TStation>::iterator st;
+  size_t n = 0;
+
+  pthread_mutex_lock(&lock);
+  st = stations.find(metar);
+  if ((st!=stations.end()) && (st->second.tiers!=NULL))
+    n = st->second.tiers->points(from, to, max, points);
+  pthread_mutex_unlock(&lock);
+  return n;
+}
+
+void HistoryStore::warm(const char* metar)
+{
+  TrendTiers *built = new TrendTiers();
+  HistoryCursor cursor, since;
+  int64_t last = 0, now;
+
+  pthread_mutex_lock(&lock);
+  TStation &st = station(metar); // Stations are never removed
+  if (st.tiers!=NULL)
+    {
+      pthread_mutex_unlock(&lock);
+      delete built;
+      return;
+    }
+  if (!st.segments.empty())
+    {
+      last = st.segments.back().last;
+      parts(st, last-TrendTiers::span(), last+1, cursor);
+    }
+  pthread_mutex_unlock(&lock);
+
+  add_records(cursor, built);	// The slow part, unlocked
+
+  pthread_mutex_lock(&lock);
+  if (!st.segments.empty())
+    {
+      now = st.segments.back().last;
+      if (now>last)		// Appended meanwhile, a few at most
+	{
+	  parts(st, (last>0)?last+1:now-TrendTiers::span(), now+1, since);
+	  add_records(since, built);
+	}
+    }
+  if (st.tiers==NULL)		// Unless another thread was quicker
+    {
+      st.tiers = built;
+      built = NULL;
+    }
+  pthread_mutex_unlock(&lock);
+  delete built;
+}
+
+/*************************************************************
+ *     Method: compact, compactor                            *
+ *************************************************************
+ *  Description:                                             *
+ *     Compresses the full segments of every station (all    *
+ *  but the last one of each). The work is done unlocked,    *
+ *  the store is only locked to find them and to replace     *
+ *  them, so appends and reads don't wait for it. If one     *
+ *  can't be compressed it stays as it is.                   *
+ *    compactor() is the thread that calls it when a segment *
+ *  is full. It has the lowest priority we can give it: the  *
+ *  fetch and the drawing threads come first.                *
+ *                                                           *
+ * Input:                                                    *
+ *   void *arg - The store                                   *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void *HistoryStore::compactor(void *arg)
+{
+  HistoryStore *store = (HistoryStore*)arg;
+#ifdef SCHED_IDLE
+  struct sched_param param;
+
+  param.sched_priority = 0;
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &param); // Only when the CPU is idle
+#endif
+
+  pthread_mutex_lock(&store->lock);
+  while (!store->quit)
+    {
+      if (!store->pending)
+	{
+	  pthread_cond_wait(&store->wake, &store->lock);
+	  continue;
+	}
+      pthread_mutex_unlock(&store->lock);
+      store->compact();
+      pthread_mutex_lock(&store->lock);
+    }
+  pthread_mutex_unlock(&store->lock);
+  return NULL;
+}
+
+void HistoryStore::compact()
+{
+  vector<pair<string, TSegment> > full;
+  TSegment packed;
+
+  pthread_mutex_lock(&packing);
+  pthread_mutex_lock(&lock);
+  if (pending)
+    for (map<string, TStation>::iterator s=stations.begin(); s!=stations.end(); ++s)
+      for (unsigned int k=0; k+1<s->second.segments.size(); k++)
+	if (!s->second.segments[k].packed)
+	  full.push_back(make_pair(s->first, s->second.segments[k]));
+  pending = false;
+  pthread_mutex_unlock(&lock);
+
+  for (unsigned int j=0; j<full.size(); j++)
+    {
+      if (!pack(full[j].second, packed))
+	{
+	  verbsth(VERB_WARNING, "Can't compress history file: "+full[j].second.file);
+	  continue;
+	}
+
+      pthread_mutex_lock(&lock);
+      TStation &st = stations[full[j].first];
+      for (unsigned int k=0; k<st.segments.size(); k++)
+	if (st.segments[k].file==full[j].second.file)
+	  {
+	    retired.push_back(st.segments[k]);
+	    st.segments[k] = packed;
+	    break;
+	  }
+      pthread_mutex_unlock(&lock);
+      unlink(full[j].second.file.data());
+    }
+  pthread_mutex_unlock(&packing);
+}
+
+/*************************************************************
+ *     Constructor HistoryCursor, Method: next               *
+ *************************************************************
+ *  Description:                                             *
+ *     Records of the range from one segment, or from one    *
+ *  block of a compressed one. They are trimmed to the       *
+ *  range: the block where from is starts before it.         *
+ *                                                           *
+ * Input:                                                    *
+ *    const THistoryRecord **records - Where they are        *
+ *                                                           *
+ * Output:                                                   *
+ *    size_t - How many, 0 if there are no more              *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+HistoryCursor::HistoryCursor()
+{
+  part = 0;
+  from = 0;
+  to = 0;
+  decoding = false;
+}
+
+size_t HistoryCursor::next(const THistoryRecord **records)
+{
+  const THistoryRecord *first, *end;
+  size_t n;
+
+  while (part<parts.size())
+    {
+      if (!parts[part].packed)
+	{
+	  first = RECORDS(parts[part].map);
+	  end = first+parts[part].size;
+	  part++;
+	}
+      else
+	{
+	  if (!decoding)
+	    {
+	      decoder.init(parts[part].map, parts[part].size);
+	      decoder.seek(from);
+	      decoding = true;
+	    }
+	  n = decoder.next(buffer);
+	  if ((n==0) || (buffer[0].time>=to))
+	    {
+	      decoding = false;
+	      part++;
+	      continue;
+	    }
+	  first = buffer;
+	  end = buffer+n;
+	}
+
+      first = lower_bound(first, end, from, before);
+      end = lower_bound(first, end, to, before);
+      if (first<end)
+	{
+	  *records = first;
+	  return end-first;
+	}
+    }
+  return 0;
+}
@@ -0,0 +1,126 @@
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <vector>
+#include <map>
+#include <string>
+
+#define HISTORY_DIR      "/.dwgo/history" // Under the home directory, a directory per station
+#define HISTORY_MAGIC    "DWGOHST1"
+#define HISTORY_SEGMENT  4096	// Records per segment file (about 3 months), then a new one
+#define HISTORY_RAW      ".hst"	// Segment we append to, mapped as it is
+#define HISTORY_PACKED   ".hgz"	// Full segment, compressed (histcodec.h)
+
+#define HISTORY_HUMIDITY 1	// THistoryRecord.flags: which values the report had
+#define HISTORY_DEWPOINT 2
+#define HISTORY_PRESSURE 4
+#define HISTORY_WIND     8	// Speed. Direction may be unknown (calm, variable)
+#define HISTORY_WIND_DIR 16
+
+class localtemp;
+
+/* An observation, as it's stored. 24 bytes */
+typedef struct
+{
+  int64_t time;			// UTC time of the report
+  int16_t temp;			// Tenths of Celsius
+  int16_t dewpoint;		// Tenths of Celsius
+  uint16_t pressure;		// Tenths of hPa
+  uint16_t wind_dir;		// Degrees
+  uint16_t wind_speed;		// Tenths of knots
+  uint8_t humidity;		// %
+  uint8_t theme;		// *_THEME
+  uint16_t flags;		// HISTORY_*
+  uint16_t reserved;
+} THistoryRecord;
+
+#include "histcodec.h"
+#include "trend.h"
+
+/* Records of a station in a time range, a few at a time. Records of
+   segments we append to are read where they are mapped, compressed ones are
+   decoded a block at a time. What next() gives is valid until it's called
+   again, the cursor doesn't need the store locked */
+class HistoryCursor
+{
+ public:
+  HistoryCursor();
+
+  size_t next(const THistoryRecord **records); /* Some of them, in time order. 0 at the end */
+
+ private:
+  friend class HistoryStore;
+
+  typedef struct
+  {
+    const void *map;
+    size_t size;		// Compressed size, or records we had
+    bool packed;
+  } TPart;
+
+  std::vector<TPart> parts;
+  unsigned int part;
+  int64_t from, to;
+  bool decoding;		// We are in a compressed part
+  HistDecoder decoder;
+  THistoryRecord buffer[HGZ_BLOCK];
+};
+
+/* Every observation of every station, appended to files mapped in memory,
+   full ones compressed later by a thread of its own, with the lowest
+   priority. Doesn't need an X display. Thread safe */
+class HistoryStore
+{
+ public:
+  HistoryStore(const char* dir);
+  virtual ~HistoryStore();
+
+  static bool record(const localtemp *station, THistoryRecord &rec); /* False if it isn't loaded */
+  bool append(const char* metar, const THistoryRecord &rec); /* False if it's not newer than the last one */
+  void range(const char* metar, time_t from, time_t to, HistoryCursor &cursor); /* [from, to) */
+  time_t last(const char* metar);	/* Time of the last record, 0 if none */
+  void compact();		/* Compresses full segments now, if there are. Slow */
+  void warm(const char* metar);	/* Reads its tiers from the history, if we haven't. Slow the first time */
+  size_t trend(const char* metar, time_t from, time_t to, size_t max, std::vector<TTrendPoint> &points); /* Temperatures, from the tiers. None until warm() */
+
+ private:
+  typedef struct
+  {
+    int64_t first, last;	// Times of its first and last records
+    std::string file;
+    void *map;			// Header and HISTORY_SEGMENT records, or compressed
+    size_t size;
+    bool packed;		// Compressed, read only
+  } TSegment;
+
+  typedef struct
+  {
+    std::vector<TSegment> segments; // By time, the last one is where we append
+    TrendTiers *tiers;		// Filled by warm()
+  } TStation;
+
+  pthread_mutex_t lock;
+  pthread_mutex_t packing;	// Held by compact(), one at a time
+  pthread_cond_t wake;		// There are segments to compress, or quit
+  pthread_t thread;		// Compressing them
+  bool running;			// We have that thread
+  bool quit;
+  std::string dir;
+  std::map<std::string, TStation> stations;
+  std::vector<TSegment> retired; // Compressed already, cursors may still read them
+  bool pending;			// There may be full segments to compress
+
+  static void *compactor(void *arg);
+  TStation &station(const char* metar);
+  bool openSegment(TSegment &seg, bool create);
+  bool openPacked(TSegment &seg);
+  bool pack(const TSegment &seg, TSegment &packed);
+  void parts(TStation &st, time_t from, time_t to, HistoryCursor &cursor);
+  bool newSegment(const char* metar, TStation &st, int64_t first);
+};
+
+#endif
@@ -0,0 +1,468 @@
+ /********************************************************************************
+ *  File: imgcache.cpp							*
+ *  Author: Gaspar Fernández (helyo@totaki.com) 				*
+ *										*
+ *  Copyright (C) 2008   Gaspar Fernández					*
+ *										*
+ *  This program is free software: you can redistribute it and/or modify	*
+ *  it under the terms of the GNU General Public License as published by	*
+ *  the Free Software Foundation, either version 3 of the License, or 		*
+ *  (at your option) any later version.  	      	  	   		*
+ *										*
+ *  This program is distributed in the hope that it will be useful,		*
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of		*
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the		*
+ *  GNU General Public License for more details.				*
+ *										*
+ *  You should have received a copy of the GNU General Public License		*
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.	*
+ *									        *
+ ********************************************************************************
+ *   Description:
+ *     Theme images ready to be copied to the display. Each one is decoded
+ *   (XPM, PNG or JPEG), scaled and converted to the pixel format of the
+ *   display once, and saved like that in ~/.dwgo/cache. Next time, if the
+ *   file has the same mtime and size, we read the pixels as they are.
+ *     The conversion is a byte shuffle when every channel is in a byte of
+ *   a 32 bit pixel (SSSE3/AVX2 do 4/8 pixels in an instruction), and the
+ *   shape mask comes from the sign of the alpha byte, 8 pixels a time.
+ *     A cache file is named after a hash of the path, scale and format.
+ *   Its header keeps all of them and the path, in case two of them give
+ *   the same hash. Files are written with another name and renamed, so
+ *   another dwgo never reads half of one.
+ *
+ *   Change History:
+ *    Date       Author     Modification
+ *
+ ********************************************************************************/
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string>
+#include "imgcache.h"
+#include "imgload.h"
+#include "errors.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+using namespace std;
+
+typedef struct
+{
+  char magic[8];		// IMGCACHE_MAGIC
+  int64_t mtime, mtime_ns, size; // Of the image file
+  uint32_t red, green, blue, alpha;
+  int32_t scale, width, height, transparent;
+  uint32_t pathlen;		// The path follows, then the pixels
+} TCacheHeader;
+
+static string cachedir;
+
+/*************************************************************
+ *     Function: pixfmt_make                                 *
+ *************************************************************
+ *  Description:                                             *
+ *     Checks the masks of a 32 bit display and gives the    *
+ *  alpha the byte left.                                     *
+ *                                                           *
+ * Input:                                                    *
+ *   TPixelFormat &fmt - Where to store it                   *
+ *   uint32_t red, green, blue - Masks of the display        *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - False if a channel isn't a whole byte            *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+static bool is_byte(uint32_t mask)
+{
+  return (mask==0xff) || (mask==0xff00) || (mask==0xff0000) || (mask==0xff000000);
+}
+
+bool pixfmt_make(TPixelFormat &fmt, uint32_t red, uint32_t green, uint32_t blue)
+{
+  if ((!is_byte(red)) || (!is_byte(green)) || (!is_byte(blue)) ||
+      (red==green) || (red==blue) || (green==blue))
+    return false;
+  fmt.red = red;
+  fmt.green = green;
+  fmt.blue = blue;
+  fmt.alpha = ~(red | green | blue);
+  return true;
+}
+
+static int byte_of(uint32_t mask)
+{
+  return (mask & 0xffff)?((mask & 0xff)?0:1):((mask & 0xff0000)?2:3);
+}
+
+/*************************************************************
+ *     Function: pixfmt_convert                              *
+ *************************************************************
+ *  Description:                                             *
+ *     0xAARRGGBB pixels to the display format. Each byte    *
+ *  just goes somewhere else.                                *
+ *                                                           *
+ * Input:                                                    *
+ *   const uint32_t *argb - Pixels                           *
+ *   uint32_t *dst - Result (may be argb)                    *
+ *   size_t n - Pixels                                       *
+ *   const TPixelFormat &fmt - Display format                *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+static void convert_c(const uint32_t *argb, uint32_t *dst, size_t n, const TPixelFormat &fmt)
+{
+  const int rs = byte_of(fmt.red)*8, gs = byte_of(fmt.green)*8;
+  const int bs = byte_of(fmt.blue)*8, as = byte_of(fmt.alpha)*8;
+  uint32_t p;
+
+  for (size_t k=0; k<n; k++)
+    {
+      p = argb[k];
+      dst[k] = (((p>>16) & 0xff)<<rs) | (((p>>8) & 0xff)<<gs) | ((p & 0xff)<<bs) | ((p>>24)<<as);
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+/* pshufb control: for every byte of the result, the byte of the source.
+   Pixels are little endian, 0xAARRGGBB is B, G, R, A in memory */
+static void shuffle_control(const TPixelFormat &fmt, char ctl[16])
+{
+  char pixel[4];
+
+  pixel[byte_of(fmt.blue)] = 0;
+  pixel[byte_of(fmt.green)] = 1;
+  pixel[byte_of(fmt.red)] = 2;
+  pixel[byte_of(fmt.alpha)] = 3;
+  for (int k=0; k<16; k++)
+    ctl[k] = pixel[k%4]+(k/4)*4;
+}
+
+__attribute__((target("ssse3")))
+static size_t convert_ssse3(const uint32_t *argb, uint32_t *dst, size_t n, const TPixelFormat &fmt)
+{
+  char c[16];
+  size_t k;
+
+  shuffle_control(fmt, c);
+  const __m128i ctl = _mm_loadu_si128((const __m128i*)c);
+  for (k=0; k+4<=n; k+=4)
+    _mm_storeu_si128((__m128i*)(dst+k),
+		     _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(argb+k)), ctl));
+  return k;
+}
+
+__attribute__((target("avx2")))
+static size_t convert_avx2(const uint32_t *argb, uint32_t *dst, size_t n, const TPixelFormat &fmt)
+{
+  char c[16];
+  size_t k;
+
+  shuffle_control(fmt, c);
+  const __m256i ctl = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)c)); // Shuffles by 128 bit lanes
+  for (k=0; k+8<=n; k+=8)
+    _mm256_storeu_si256((__m256i*)(dst+k),
+			_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(argb+k)), ctl));
+  return k;
+}
+#endif
+
+void pixfmt_convert(const uint32_t *argb, uint32_t *dst, size_t n, const TPixelFormat &fmt)
+{
+  size_t done = 0;
+
+#ifdef HAVE_X86_KERNELS
+  static int avx2 = -1, ssse3 = -1;
+
+  if (avx2<0)
+    {
+      avx2 = __builtin_cpu_supports("avx2");
+      ssse3 = __builtin_cpu_supports("ssse3");
+    }
+  if (avx2)
+    done = convert_avx2(argb, dst, n, fmt);
+  else if (ssse3)
+    done = convert_ssse3(argb, dst, n, fmt);
+#endif
+  convert_c(argb+done, dst+done, n-done, fmt);
+}
+
+/*************************************************************
+ *     Function: pixfmt_mask                                 *
+ *************************************************************
+ *  Description:                                             *
+ *     Sets the bits of the visible pixels of a row in a     *
+ *  XBM (least significant bit first), from bits[0] bit 0.   *
+ *  Other bits are kept.                                     *
+ *                                                           *
+ * Input:                                                    *
+ *   const uint32_t *pixels - A row in the display format    *
+ *   int width - Pixels                                      *
+ *   const TPixelFormat &fmt - Display format                *
+ *   unsigned char *bits - XBM row                           *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+static void mask_c(const uint32_t *pixels, int from, int width, const TPixelFormat &fmt, unsigned char *bits)
+{
+  for (int x=from; x<width; x++)
+    if (pixels[x] & fmt.alpha)
+      bits[x/8] |= 1<<(x%8);
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static int mask_sse2(const uint32_t *pixels, int width, const TPixelFormat &fmt, unsigned char *bits)
+{
+  const __m128i up = _mm_cvtsi32_si128(24-byte_of(fmt.alpha)*8); // Alpha to the sign bit
+  __m128 lo, hi;
+  int x;
+
+  for (x=0; x+8<=width; x+=8)
+    {
+      lo = _mm_castsi128_ps(_mm_sll_epi32(_mm_loadu_si128((const __m128i*)(pixels+x)), up));
+      hi = _mm_castsi128_ps(_mm_sll_epi32(_mm_loadu_si128((const __m128i*)(pixels+x+4)), up));
+      bits[x/8] |= _mm_movemask_ps(lo) | (_mm_movemask_ps(hi)<<4);
+    }
+  return x;
+}
+#endif
+
+void pixfmt_mask(const uint32_t *pixels, int width, const TPixelFormat &fmt, unsigned char *bits)
+{
+  int done = 0;
+
+#ifdef HAVE_X86_KERNELS
+  if (__builtin_cpu_supports("sse2"))
+    done = mask_sse2(pixels, width, fmt, bits);
+#endif
+  mask_c(pixels, done, width, fmt, bits);
+}
+
+/*************************************************************
+ *     Function: imgcache_dir                                *
+ *************************************************************
+ *  Description:                                             *
+ *     Where the cache files are. It's created when we write *
+ *  the first one.                                           *
+ *                                                           *
+ * Input:                                                    *
+ *   const char *dir - Directory, NULL not to use a cache    *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void imgcache_dir(const char *dir)
+{
+  cachedir = (dir)?dir:"";
+}
+
+/*************************************************************
+ *     Function: cache_file                                  *
+ *************************************************************
+ *  Description:                                             *
+ *     Name of the cache file of an image: FNV-1a of its     *
+ *  path, scale and format.                                  *
+ *                                                           *
+ * Input:                                                    *
+ *   const TCacheHeader &h - Scale and format                *
+ *   const char *file - Image file                           *
+ *                                                           *
+ * Output:                                                   *
+ *   string - Cache file, with its path                      *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+  for (size_t k=0; k<len; k++)
+    hash = (hash ^ ((const unsigned char*)data)[k])*0x100000001b3ULL;
+  return hash;
+}
+
+static string cache_file(const TCacheHeader &h, const char *file)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  char name[32];
+
+  hash = fnv1a(hash, file, strlen(file));
+  hash = fnv1a(hash, &h.red, sizeof(uint32_t)*4);
+  hash = fnv1a(hash, &h.scale, sizeof(h.scale));
+  snprintf(name, sizeof(name), "/%016llx", (unsigned long long)hash);
+  return cachedir+name;
+}
+
+/*************************************************************
+ *     Function: cache_read, cache_write                     *
+ *************************************************************
+ *  Description:                                             *
+ *     Reads the pixels if the header matches, writes a new  *
+ *  file.                                                    *
+ *                                                           *
+ * Input:                                                    *
+ *   const TCacheHeader &h - What we are looking for         *
+ *   const char *file - Image file                           *
+ *   TPixelImage &img - Image                                *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - cache_read(): false if we don't have it          *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+static bool cache_read(const TCacheHeader &h, const char *file, TPixelImage &img)
+{
+  string name = cache_file(h, file);
+  TCacheHeader c;
+  size_t bytes;
+  char *path;
+  bool ok;
+  int fd = open(name.data(), O_RDONLY);
+
+  if (fd<0)
+    return false;
+  ok = (read(fd, &c, sizeof(c))==(ssize_t)sizeof(c)) && (memcmp(c.magic, h.magic, 8)==0) &&
+    (c.mtime==h.mtime) && (c.mtime_ns==h.mtime_ns) && (c.size==h.size) &&
+    (c.red==h.red) && (c.green==h.green) && (c.blue==h.blue) && (c.alpha==h.alpha) &&
+    (c.scale==h.scale) && (c.pathlen==h.pathlen) && (c.width>0) && (c.height>0);
+  if (ok)
+    {
+      path = (char*)malloc(c.pathlen);
+      ok = (read(fd, path, c.pathlen)==(ssize_t)c.pathlen) && (memcmp(path, file, c.pathlen)==0);
+      free(path);
+    }
+  if (ok)
+    {
+      bytes = (size_t)c.width*c.height*sizeof(uint32_t);
+      img.pixels = (uint32_t*)malloc(bytes);
+      ok = (img.pixels) && (read(fd, img.pixels, bytes)==(ssize_t)bytes);
+      if (!ok)
+	imgcache_free(img);
+    }
+  close(fd);
+  if (!ok)
+    return false;
+
+  img.width = c.width;
+  img.height = c.height;
+  img.transparent = c.transparent;
+  return true;
+}
+
+static void cache_write(const TCacheHeader &h, const char *file, const TPixelImage &img)
+{
+  string name = cache_file(h, file);
+  string tmp = name+".tmp";
+  size_t bytes = (size_t)img.width*img.height*sizeof(uint32_t);
+  TCacheHeader c = h;
+  bool ok;
+  int fd;
+
+  if ((mkdir(cachedir.substr(0, cachedir.rfind('/')).data(), 0755)<0) && (errno!=EEXIST))
+    return;			// ~/.dwgo may not be there yet
+  if ((mkdir(cachedir.data(), 0755)<0) && (errno!=EEXIST))
+    return;
+
+  c.width = img.width;
+  c.height = img.height;
+  c.transparent = img.transparent;
+  fd = open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd<0)
+    return;
+  ok = (write(fd, &c, sizeof(c))==(ssize_t)sizeof(c)) &&
+    (write(fd, file, c.pathlen)==(ssize_t)c.pathlen) &&
+    (write(fd, img.pixels, bytes)==(ssize_t)bytes);
+  close(fd);
+  if ((!ok) || (rename(tmp.data(), name.data())<0))
+    {
+      unlink(tmp.data());
+      verbsth(VERB_NOTICE, (string)"Can't write to the image cache: "+cachedir);
+    }
+}
+
+/*************************************************************
+ *     Function: imgcache_load, imgcache_free                *
+ *************************************************************
+ *  Description:                                             *
+ *     Gives an image scaled and in the display format,      *
+ *  from the cache or decoding it (and caching it).          *
+ *                                                           *
+ * Input:                                                    *
+ *   const char *file - XPM, PNG or JPEG file                *
+ *   int scale - Size multiplier (HiDPI)                     *
+ *   const TPixelFormat &fmt - Display format                *
+ *   TPixelImage &img - Where to store the image             *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - False if we can't load it                        *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool imgcache_load(const char *file, int scale, const TPixelFormat &fmt, TPixelImage &img)
+{
+  TCacheHeader h;
+  TXpmImage xpm;
+  struct stat st;
+  bool cached = (!cachedir.empty()) && (stat(file, &st)==0);
+
+  img.pixels = NULL;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, IMGCACHE_MAGIC, 8);
+  h.red = fmt.red;
+  h.green = fmt.green;
+  h.blue = fmt.blue;
+  h.alpha = fmt.alpha;
+  h.scale = scale;
+  h.pathlen = strlen(file);
+  if (cached)
+    {
+      h.mtime = st.st_mtim.tv_sec;
+      h.mtime_ns = st.st_mtim.tv_nsec;
+      h.size = st.st_size;
+      if (cache_read(h, file, img))
+	return true;
+    }
+
+  if ((!img_load(file, xpm)) || (!xpm_scale(xpm, scale)))
+    {
+      xpm_free(xpm);
+      return false;
+    }
+  img.width = xpm.width;
+  img.height = xpm.height;
+  img.transparent = xpm.transparent;
+  img.pixels = (uint32_t*)xpm.pixels; // Converted in place
+  pixfmt_convert(img.pixels, img.pixels, (size_t)img.width*img.height, fmt);
+
+  if (cached)
+    cache_write(h, file, img);
+  return true;
+}
+
+void imgcache_free(TPixelImage &img)
+{
+  free(img.pixels);
+  img.pixels = NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef _IMGCACHE_H_
+#define _IMGCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IMGCACHE_DIR     "/.dwgo/cache"	// Under the home directory
+#define IMGCACHE_MAGIC   "DWGOIMG1"
+
+/* 32 bit pixels with each channel in a whole byte, as most TrueColor
+   displays have. The byte none of them use keeps the alpha */
+typedef struct
+{
+  uint32_t red, green, blue, alpha;
+} TPixelFormat;
+
+typedef struct
+{
+  int width, height;
+  uint32_t *pixels;		// In a TPixelFormat, width*height. Alpha is 0 or 0xff
+  bool transparent;		// Some pixel has alpha 0, we need a mask
+} TPixelImage;
+
+/* Themes decoded once, ready for the display. Don't need an X display */
+bool pixfmt_make(TPixelFormat &fmt, uint32_t red, uint32_t green, uint32_t blue); /* False if we can't use it */
+void pixfmt_convert(const uint32_t *argb, uint32_t *dst, size_t n, const TPixelFormat &fmt);
+void pixfmt_mask(const uint32_t *pixels, int width, const TPixelFormat &fmt, unsigned char *bits); /* XBM row */
+
+void imgcache_dir(const char *dir);	/* NULL: decode every time */
+bool imgcache_load(const char *file, int scale, const TPixelFormat &fmt, TPixelImage &img);
+void imgcache_free(TPixelImage &img);
+
+#endif
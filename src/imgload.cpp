@@ -0,0 +1,293 @@
+ /********************************************************************************
+ *  File: imgload.cpp								*
+ *  Author: Gaspar Fernández (helyo@totaki.com) 				*
+ *										*
+ *  Copyright (C) 2008   Gaspar Fernández					*
+ *										*
+ *  This program is free software: you can redistribute it and/or modify	*
+ *  it under the terms of the GNU General Public License as published by	*
+ *  the Free Software Foundation, either version 3 of the License, or 		*
+ *  (at your option) any later version.  	      	  	   		*
+ *										*
+ *  This program is distributed in the hope that it will be useful,		*
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of		*
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the		*
+ *  GNU General Public License for more details.				*
+ *										*
+ *  You should have received a copy of the GNU General Public License		*
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.	*
+ *									        *
+ ********************************************************************************
+ *   Description:
+ *     PNG and JPEG themes. They are decoded into the same 0xAARRGGBB image
+ *   the XPM loader gives, so the rest of dwgo doesn't see the difference:
+ *   PNG alpha becomes "None" below IMG_ALPHA_CUT (our masks have a single
+ *   bit), JPEGs are opaque. The type is told by the first bytes, not by
+ *   the name of the file.
+ *     Without libpng or libjpeg those files can't be loaded, and the theme
+ *   is skipped as any other unreadable image.
+ *
+ *   Change History:
+ *    Date       Author     Modification
+ *
+ ********************************************************************************/
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <setjmp.h>
+#include <string>
+#include "config.h"
+#include "imgload.h"
+#include "errors.h"
+
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+#ifdef HAVE_LIBJPEG
+#include <jpeglib.h>
+#include <jerror.h>
+#endif
+
+using namespace std;
+
+/*************************************************************
+ *     Function: img_type                                    *
+ *************************************************************
+ *  Description:                                             *
+ *     What kind of image we have, by its signature.         *
+ *                                                           *
+ * Input:                                                    *
+ *   const char *data, size_t len - File contents            *
+ *                                                           *
+ * Output:                                                   *
+ *   int - IMG_*. Anything we don't know is IMG_XPM          *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+int img_type(const char *data, size_t len)
+{
+  if ((len>=8) && (memcmp(data, "\x89PNG\r\n\x1a\n", 8)==0))
+    return IMG_PNG;
+  if ((len>=3) && (memcmp(data, "\xff\xd8\xff", 3)==0))
+    return IMG_JPEG;
+  return IMG_XPM;
+}
+
+/*************************************************************
+ *     Function: png_parse                                   *
+ *************************************************************
+ *  Description:                                             *
+ *     Decodes a PNG in memory, whatever its color type,     *
+ *  with the simplified API of libpng (1.6).                 *
+ *                                                           *
+ * Input:                                                    *
+ *   const char *data, size_t len - File contents            *
+ *   TXpmImage &img - Where to store the image               *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - False if it's wrong or we don't have libpng      *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+static bool png_parse(const char *data, size_t len, TXpmImage &img)
+{
+#ifdef HAVE_LIBPNG
+  png_image png;
+  unsigned char *rgba;
+  unsigned int n;
+
+  memset(&png, 0, sizeof(png));
+  png.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_memory(&png, data, len))
+    return false;
+  png.format = PNG_FORMAT_RGBA;	// Bytes, whatever the endianness
+  if ((size_t)png.width*png.height>IMG_MAX_PIXELS) // PNG_IMAGE_SIZE would overflow
+    {
+      png_image_free(&png);
+      return false;
+    }
+
+  n = png.width*png.height;
+  rgba = (unsigned char*)malloc(PNG_IMAGE_SIZE(png));
+  if ((rgba==NULL) || (!png_image_finish_read(&png, NULL, rgba, 0, NULL)))
+    {
+      png_image_free(&png);
+      free(rgba);
+      return false;
+    }
+
+  img.width = png.width;
+  img.height = png.height;
+  img.transparent = false;
+  img.pixels = (unsigned int*)rgba; // In place, 4 bytes in, 4 bytes out
+  for (unsigned int k=0; k<n; k++)
+    {
+      const unsigned char *p = rgba+k*4;
+      if (p[3]<IMG_ALPHA_CUT)
+	{
+	  img.pixels[k] = XPM_TRANSPARENT;
+	  img.transparent = true;
+	}
+      else
+	img.pixels[k] = XPM_OPAQUE | (p[0]<<16) | (p[1]<<8) | p[2];
+    }
+  return true;
+#else
+  verbsth(VERB_WARNING, "Built without libpng, can't load PNG images");
+  return false;
+#endif
+}
+
+/*************************************************************
+ *     Function: jpeg_parse                                  *
+ *************************************************************
+ *  Description:                                             *
+ *     Decodes a JPEG in memory. libjpeg exit()s on errors   *
+ *  unless we jump out of it.                                *
+ *                                                           *
+ * Input:                                                    *
+ *   const char *data, size_t len - File contents            *
+ *   TXpmImage &img - Where to store the image               *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - False if it's wrong or we don't have libjpeg     *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+#ifdef HAVE_LIBJPEG
+typedef struct
+{
+  struct jpeg_error_mgr pub;
+  jmp_buf jump;
+} TJpegError;
+
+static void jpeg_error(j_common_ptr cinfo)
+{
+  longjmp(((TJpegError*)cinfo->err)->jump, 1);
+}
+
+static void jpeg_quiet(j_common_ptr /* cinfo */)
+{				// Warnings of broken files, we only care if it fails
+}
+#endif
+
+static bool jpeg_parse(const char *data, size_t len, TXpmImage &img)
+{
+#ifdef HAVE_LIBJPEG
+  struct jpeg_decompress_struct cinfo;
+  TJpegError err;
+  unsigned char * volatile row = NULL;
+  unsigned int *pixels;
+
+  cinfo.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = jpeg_error;
+  err.pub.output_message = jpeg_quiet;
+  if (setjmp(err.jump))
+    {
+      jpeg_destroy_decompress(&cinfo);
+      free(row);
+      xpm_free(img);
+      return false;
+    }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, (unsigned char*)data, len);
+  jpeg_read_header(&cinfo, TRUE);
+  cinfo.out_color_space = JCS_RGB; // Grayscale too
+  jpeg_start_decompress(&cinfo);
+
+  img.width = cinfo.output_width;
+  img.height = cinfo.output_height;
+  img.transparent = false;
+  if ((size_t)img.width*img.height>IMG_MAX_PIXELS)
+    ERREXIT(&cinfo, JERR_IMAGE_TOO_BIG); // Jumps to the cleanup above
+  img.pixels = (unsigned int*)malloc((size_t)img.width*img.height*4);
+  row = (unsigned char*)malloc((size_t)img.width*3);
+  if ((img.pixels==NULL) || (row==NULL))
+    ERREXIT(&cinfo, JERR_OUT_OF_MEMORY);
+  while (cinfo.output_scanline<cinfo.output_height)
+    {
+      pixels = img.pixels+(size_t)cinfo.output_scanline*img.width;
+      jpeg_read_scanlines(&cinfo, (JSAMPARRAY)&row, 1);
+      for (int x=0; x<img.width; x++)
+	pixels[x] = XPM_OPAQUE | (row[x*3]<<16) | (row[x*3+1]<<8) | row[x*3+2];
+    }
+
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  free(row);
+  return true;
+#else
+  verbsth(VERB_WARNING, "Built without libjpeg, can't load JPEG images");
+  return false;
+#endif
+}
+
+/*************************************************************
+ *     Function: img_parse, img_load                         *
+ *************************************************************
+ *  Description:                                             *
+ *     Like xpm_parse() and xpm_load(), for any of the       *
+ *  types we know. Free them with xpm_free().                *
+ *                                                           *
+ * Input:                                                    *
+ *   const char *data, size_t len - File contents            *
+ *   const char *file - Image file                           *
+ *   TXpmImage &img - Where to store the image               *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - False if we can't read it                        *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool img_parse(const char *data, size_t len, TXpmImage &img)
+{
+  img.pixels = NULL;
+  switch (img_type(data, len))
+    {
+    case IMG_PNG:
+      return png_parse(data, len, img);
+    case IMG_JPEG:
+      return jpeg_parse(data, len, img);
+    default:
+      return xpm_parse(data, len, img);
+    }
+}
+
+bool img_load(const char *file, TXpmImage &img)
+{
+  struct stat st;
+  void *data;
+  bool res;
+  int fd=open(file, O_RDONLY);
+
+  img.pixels=NULL;
+  if (fd<0)
+    return false;
+  if ((fstat(fd, &st)<0) || (st.st_size==0))
+    {
+      close(fd);
+      return false;
+    }
+  data=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data==MAP_FAILED)
+    return false;
+
+  res=img_parse((const char*)data, st.st_size, img);
+  munmap(data, st.st_size);
+  return res;
+}
@@ -0,0 +1,20 @@
+#ifndef _IMGLOAD_H_
+#define _IMGLOAD_H_
+
+#include <stddef.h>
+#include "xpmload.h"
+
+#define IMG_XPM          0
+#define IMG_PNG          1
+#define IMG_JPEG         2
+
+#define IMG_ALPHA_CUT    128	// PNG alpha below this is "None", the rest opaque
+#define IMG_MAX_PIXELS   (1<<26) // Larger PNGs and JPEGs are refused, 256 MB decoded
+
+/* XPM, PNG or JPEG themes, by their first bytes, into the same image XPMs
+   give. PNG and JPEG need libpng and libjpeg. Don't need an X display */
+int img_type(const char *data, size_t len);
+bool img_load(const char *file, TXpmImage &img);
+bool img_parse(const char *data, size_t len, TXpmImage &img);
+
+#endif
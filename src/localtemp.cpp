@@ -61,7 +61,18 @@ localtemp::localtemp(char *metar, char *location_name)
   this->celsius=0;
   this->fahrenheit=0;
   this->loaded=false;
+  this->stale=false;
+  this->humidity=0;
+  this->dewpoint=UNKNOWN_VALUE;
+  this->pressure=UNKNOWN_VALUE;
+  this->wind_dir=UNKNOWN_VALUE;
+  this->wind_speed=UNKNOWN_VALUE;
   this->theme=DEFAULT_THEME;
+  this->info_time=0;
+  this->report_time=0;
+  this->issue_count=0;
+  this->issue_pos=0;
+  this->refs=0;
 }
 
 /*************************************************************
@@ -109,6 +120,52 @@ void localtemp::set_humidity(string hum)
   this->humidity=atoi(buf);
 }
 
+/*************************************************************
+ *     Method: set_dewpoint, set_pressure, set_wind          *
+ *************************************************************
+ *  Description:                                             *
+ *     Extract dew point, pressure and wind. We take the     *
+ *  values between parentheses: Celsius, hPa and knots.      *
+ *                                                           *
+ * Input:                                                    *
+ *   string dew - "xx F (xx C)"                              *
+ *   string pres - "xx.xx in. Hg (xxxx hPa)"                 *
+ *   string wind - "from the NW (320 degrees) at 9 MPH       *
+ *                 (8 KT)", "Calm"...                        *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+void localtemp::set_dewpoint(string dew)
+{
+  string::size_type pos=dew.find(" C)");
+
+  if (pos!=string::npos)
+    this->dewpoint=atoi(dew.substr(dew.rfind('(', pos)+1).data());
+}
+
+void localtemp::set_pressure(string pres)
+{
+  string::size_type pos=pres.find(" hPa)");
+
+  if (pos!=string::npos)
+    this->pressure=atoi(pres.substr(pres.rfind('(', pos)+1).data());
+}
+
+void localtemp::set_wind(string wind)
+{
+  string::size_type pos=wind.find(" degrees)");
+
+  if (pos!=string::npos)
+    this->wind_dir=atoi(wind.substr(wind.rfind('(', pos)+1).data());
+  pos=wind.find(" KT)");
+  if (pos!=string::npos)
+    this->wind_speed=atoi(wind.substr(wind.rfind('(', pos)+1).data());
+  else if (wind.find("Calm")!=string::npos)
+    this->wind_speed=0;
+}
+
 /*************************************************************
  *     Method: get_ob_info                                   *
  *************************************************************
@@ -166,6 +223,7 @@ try
 	  remotetm->tm_year++;
 	}       
     }
+  report_time=timegm(remotetm);	// Fields are UTC
   info_time=mktime(remotetm);
 
 try
@@ -269,11 +327,34 @@ try
     theme=DEFAULT_THEME;	// Nothing significant found.
 }
 
+/*************************************************************
+ *     Method: getURL                                        *
+ *************************************************************
+ *  Description:                                             *
+ *     Where to download this station from                   *
+ *                                                           *
+ * Output:                                                   *
+ *    string - The URL                                       *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+string localtemp::getURL()
+{
+  char metar_fetch[80];
+
+  snprintf(metar_fetch, sizeof(metar_fetch), METAR_URL, this->metar.data());
+  return metar_fetch;
+}
+
 /*************************************************************
  *     Method: getInfo                                       *
  *************************************************************
  *  Description:                                             *
- *     Fetch information and parse the file                  *
+ *     Fetch information and parse the file. It blocks until *
+ *  we get it, the fetch thread uses Fetcher and parseInfo() *
+ *  instead.                                                 *
  *                                                           *
  * Output:                                                   *
  *    True if we downloaded it right, false if not.          *
@@ -284,31 +365,59 @@ try
  *************************************************************/ 
 bool localtemp::getInfo()
 {
-  char *metar_fetch; 		               // Get Metar data URL
   MySock *skt;
   HTTP_Request *http;
-  string::size_type pos, pos2;
-  TKey_Value datarl;
+  bool res;
+
   this->error=0;        // No error
   this->loaded=false;
-  metar_fetch= (char*) malloc(80);
-  string tmp;
 
-  sprintf(metar_fetch, METAR_URL, this->metar.data());
-
-  skt = new MySock(metar_fetch);
+  skt = new MySock(getURL());
   verbsth(VERB_ASTTO, "Open connection: ");
  
   http=skt->GetHTTPData();
 
   delete skt;			// We don't need this anymore
 
+  res=parseInfo(http);
+  delete http;
+  return res;
+}
+
+/*************************************************************
+ *     Method: parseInfo                                     *
+ *************************************************************
+ *  Description:                                             *
+ *     Parse the file we have downloaded                     *
+ *                                                           *
+ * Input:                                                    *
+ *    HTTP_Request *http - The response, NULL if we couldn't *
+ *  get it.                                                  *
+ *                                                           *
+ * Output:                                                   *
+ *    True if we downloaded it right, false if not.          *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author            Modification                 *
+ *                                                           *
+ *************************************************************/ 
+bool localtemp::parseInfo(HTTP_Request *http)
+{
+  string::size_type pos, pos2;
+  TKey_Value datarl;
+  time_t last_report;
+  string tmp;
+
+  this->error=0;        // No error
+  this->loaded=false;
+
   if (http!=NULL)
     {
       if (http->status==200)
 	{
 	  time(&get_time);	// We got the file at this moment
 	  pos=0;
+	  dewpoint=pressure=wind_dir=wind_speed=UNKNOWN_VALUE; // Not every report has them
 
 	  verbsth(VERB_ASTTO, "Get Data: ");
 
@@ -329,6 +438,12 @@ bool localtemp::getInfo()
 		    this->set_temp(datarl.value);
 		  else if (datarl.key=="Relative Humidity")
 		    this->set_humidity(datarl.value);
+		  else if (datarl.key=="Dew Point")
+		    this->set_dewpoint(datarl.value);
+		  else if (datarl.key=="Pressure (altimeter)")
+		    this->set_pressure(datarl.value);
+		  else if (datarl.key=="Wind")
+		    this->set_wind(datarl.value);
 		  else if (datarl.key=="Sky conditions")
 		    this->sky=datarl.value;
 		  else if (datarl.key=="ob")
@@ -339,7 +454,9 @@ bool localtemp::getInfo()
 	    } while (pos2!=string::npos);
 	  verbsth(VERB_ASTTO, "Get ob info: ");
 
+	  last_report=report_time;
 	  get_ob_info();	// Get info from the METAR string
+	  learn_issue(last_report);
 	  this->loaded=true;
 	  verbsth(VERB_ASTTO, "Close connection: ");
 
@@ -357,3 +474,108 @@ bool localtemp::getInfo()
   return true;			// Everything is OK (or almost)
 
 }
+
+/*************************************************************
+ *     Method: learn_issue                                   *
+ *************************************************************
+ *  Description:                                             *
+ *     Stations issue routine reports at the same minute     *
+ *  every hour (or half an hour). When we get a new report   *
+ *  we store its minute and how long it took until we could  *
+ *  download it, so next_poll() can guess when the next one  *
+ *  will be available.                                       *
+ *                                                           *
+ * Input:                                                    *
+ *   time_t last_report - report_time before this fetch      *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+void localtemp::learn_issue(time_t last_report)
+{
+  int delay;
+
+  if ((report_time<=0) || (report_time==last_report))
+    return;			// Nothing new
+
+  delay=get_time-report_time;
+  if ((delay<0) || (delay>=3600)) // Clocks don't agree, or we started late
+    delay=-1;
+
+  issue_minute[issue_pos]=(report_time%3600)/60;
+  issue_delay[issue_pos]=delay;
+  issue_pos=(issue_pos+1)%ISSUE_HISTORY;
+  if (issue_count<ISSUE_HISTORY)
+    issue_count++;
+}
+
+/*************************************************************
+ *     Method: next_poll                                     *
+ *************************************************************
+ *  Description:                                             *
+ *     When should we fetch this station again? Minutes      *
+ *  repeated in the history are routine reports (the rest    *
+ *  are SPECIs). The shortest delay seen is how long the     *
+ *  server takes to publish them. We poll often for a few    *
+ *  minutes after the next report is expected, and rarely    *
+ *  otherwise. Until we know the station we poll each        *
+ *  interval seconds, as always.                             *
+ *                                                           *
+ * Input:                                                    *
+ *   time_t now - Current time                               *
+ *   int interval - Configured update interval               *
+ *                                                           *
+ * Output:                                                   *
+ *   time_t - When to fetch it again                         *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/ 
+time_t localtemp::next_poll(time_t now, int interval)
+{
+  int counts[60];
+  int delay=-1;
+  bool routine=false;
+  time_t base, hour, expected, candidate;
+
+  bzero(counts, sizeof(counts));
+  for (int k=0; k<issue_count; k++)
+    {
+      counts[issue_minute[k]]++;
+      if ((issue_delay[k]>=0) && ((delay<0) || (issue_delay[k]<delay)))
+	delay=issue_delay[k];
+    }
+  for (int m=0; m<60; m++)
+    routine=routine || (counts[m]>=2);
+
+  if ((!loaded) || (!routine) || (delay<0))
+    return now+interval;	// We don't know this station yet
+
+  // First routine report after the last one whose polling window is still open
+  base=report_time+1;
+  if (base<now-delay-POLL_WINDOW+1)
+    base=now-delay-POLL_WINDOW+1;
+  hour=base-base%3600;
+  expected=0;
+  for (int m=0; m<120; m++)
+    {
+      candidate=hour+m*60;
+      if ((counts[m%60]>=2) && (candidate>=base))
+	{
+	  expected=candidate;
+	  break;
+	}
+    }
+
+  // We ask a little bit earlier than we used to get it, so the delay we learn can get shorter
+  if (expected+delay<=now)	// It should be there, ask often
+    return now+POLL_BURST_INTERVAL;
+  else if (expected+delay-POLL_BURST_INTERVAL/2<=now)
+    return expected+delay;
+  else if (expected+delay-POLL_BURST_INTERVAL/2<now+interval*POLL_IDLE_FACTOR)
+    return expected+delay-POLL_BURST_INTERVAL/2;
+  else
+    return now+interval*POLL_IDLE_FACTOR; // SPECIs may come before
+}
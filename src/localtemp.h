@@ -1,6 +1,8 @@
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include "errors.h"
+#include "MySock.h"
 
 // Old URL
 //#define METAR_URL               "http://weather.noaa.gov/pub/data/observations/metar/decoded/%s.TXT"
@@ -8,6 +10,9 @@
 // New URL
 #define METAR_URL               "http://tgftp.nws.noaa.gov/data/observations/metar/decoded/%s.TXT"
 
+#define ISSUE_HISTORY           12	// Reports used to learn when a station issues them
+#define UNKNOWN_VALUE           -9999	// The report doesn't have it
+
 class localtemp {
 public: 
   enum ESky
@@ -47,15 +52,34 @@ public:
   int error, celsius, fahrenheit;
   int theme;			// Âº theme to use
   short humidity;
+  int dewpoint;			// Celsius
+  int pressure;			// hPa
+  int wind_dir, wind_speed;	// Degrees (UNKNOWN_VALUE if calm or variable), knots
   bool loaded;
+  bool stale;			// From the observation cache, not fetched yet
   string sky;
   TMetar mInfo;
   time_t info_time;		// Time stored in file
   time_t get_time;		// Time when we got the file
+  time_t report_time;		// UTC time of the report
+  int refs;			// Station lists using it
   localtemp(char* metar, char* location_name);
   bool getInfo();
+  std::string getURL();
+  bool parseInfo(HTTP_Request *http);
+  time_t next_poll(time_t now, int interval);
 private:
+  friend class ObsCache;	// Saves and restores all of it
+
+  short issue_minute[ISSUE_HISTORY]; // Minute of the hour of the last reports
+  int issue_delay[ISSUE_HISTORY];    // Seconds until we could download them
+  int issue_count, issue_pos;
+
   void set_temp(std::string temp);
   void set_humidity(std::string hum);
+  void set_dewpoint(std::string dew);
+  void set_pressure(std::string pres);
+  void set_wind(std::string wind);
   void get_ob_info();
+  void learn_issue(time_t last_report);
 };
@@ -0,0 +1,370 @@
+ /********************************************************************************
+ *  File: obscache.cpp							*
+ *  Author: Gaspar Fernández (helyo@totaki.com) 				*
+ *										*
+ *  Copyright (C) 2008   Gaspar Fernández					*
+ *										*
+ *  This program is free software: you can redistribute it and/or modify	*
+ *  it under the terms of the GNU General Public License as published by	*
+ *  the Free Software Foundation, either version 3 of the License, or 		*
+ *  (at your option) any later version.  	      	  	   		*
+ *										*
+ *  This program is distributed in the hope that it will be useful,		*
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of		*
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the		*
+ *  GNU General Public License for more details.				*
+ *										*
+ *  You should have received a copy of the GNU General Public License		*
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.	*
+ *									        *
+ ********************************************************************************
+ *   Description:
+ *     The last observation of every station is kept in ~/.dwgo/observations,
+ *   so the next time dwgo starts they are drawn at once (with their age)
+ *   instead of the wait bar, while the fetch thread gets them again.
+ *     The file is a header and fixed size records, mapped in memory when we
+ *   start and after every write. Records are not changed in place: the
+ *   whole file is written with another name, synced and renamed over the
+ *   old one, and the directory is synced, so a crash leaves the old file
+ *   or the new one, never half of them. Each record has a checksum too, just in case.
+ *     Records older than the max. age (from the time of the report) are
+ *   ignored, and dropped the next time we write.
+ *
+ *   Change History:
+ *    Date       Author     Modification
+ *
+ ********************************************************************************/
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+#include "obscache.h"
+#include "localtemp.h"
+#include "errors.h"
+
+using namespace std;
+
+typedef struct
+{
+  char magic[8];		// OBSCACHE_MAGIC
+  uint32_t record_size;		// sizeof(TObservation), they change together
+  uint32_t count;
+} TObsHeader;
+
+typedef struct TObservation
+{
+  char metar[8];		// ICAO id
+  int64_t get_time, info_time, report_time;
+  int32_t celsius, fahrenheit, humidity, theme;
+  int32_t sky, CB, rain, fog;	// TMetar
+  int32_t issue_count, issue_pos;
+  int16_t issue_minute[ISSUE_HISTORY];
+  int32_t issue_delay[ISSUE_HISTORY];
+  uint32_t check;		// FNV-1a of the rest
+} TObservation;
+
+static uint32_t checksum(const TObservation *obs)
+{
+  uint32_t hash = 0x811c9dc5;
+
+  for (size_t k=0; k<offsetof(TObservation, check); k++)
+    hash = (hash ^ ((const unsigned char*)obs)[k])*0x01000193;
+  return hash;
+}
+
+static bool sync_dir(const string &dir) // A rename is only durable then
+{
+  int fd = open(dir.data(), O_RDONLY | O_DIRECTORY);
+  bool ok = (fd>=0) && (fsync(fd)==0);
+
+  if (fd>=0)
+    close(fd);
+  return ok;
+}
+
+/*************************************************************
+ *     Constructor / Destructor ObsCache                     *
+ *************************************************************
+ *  Description:                                             *
+ *     Maps the file, if we have it.                         *
+ *                                                           *
+ * Input:                                                    *
+ *    const char* file - Cache file                          *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+ObsCache::ObsCache(const char* file)
+{
+  pthread_mutex_init(&lock, NULL);
+  this->file = strdup(file);
+  max_age = 0;
+  map = NULL;
+  size = 0;
+  remap();
+}
+
+ObsCache::~ObsCache()
+{
+  if (map)
+    munmap(map, size);
+  free(file);
+  pthread_mutex_destroy(&lock);
+}
+
+/*************************************************************
+ *     Method: setMaxAge                                     *
+ *************************************************************
+ *  Description:                                             *
+ *     Observations older than this are not used.            *
+ *                                                           *
+ * Input:                                                    *
+ *    int seconds - Max. age, 0 not to use the cache         *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void ObsCache::setMaxAge(int seconds)
+{
+  pthread_mutex_lock(&lock);
+  max_age = (seconds>0)?seconds:0;
+  pthread_mutex_unlock(&lock);
+}
+
+/*************************************************************
+ *     Method: remap                                         *
+ *************************************************************
+ *  Description:                                             *
+ *     Maps the file again, after we have replaced it. If    *
+ *  its header is wrong we don't keep it. Call it locked.    *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void ObsCache::remap()
+{
+  struct stat st;
+  const TObsHeader *h;
+  int fd;
+
+  if (map)
+    munmap(map, size);
+  map = NULL;
+  size = 0;
+
+  fd = open(file, O_RDONLY);
+  if (fd<0)
+    return;
+  if ((fstat(fd, &st)==0) && ((size_t)st.st_size>=sizeof(TObsHeader)))
+    {
+      size = st.st_size;
+      map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (map==MAP_FAILED)
+	map = NULL;
+    }
+  close(fd);
+  if (map==NULL)
+    return;
+
+  h = (const TObsHeader*)map;
+  if ((memcmp(h->magic, OBSCACHE_MAGIC, 8)!=0) || (h->record_size!=sizeof(TObservation)) ||
+      (size<sizeof(TObsHeader)+(size_t)h->count*sizeof(TObservation)))
+    {
+      verbsth(VERB_NOTICE, (string)"Ignoring observation cache: "+file);
+      munmap(map, size);
+      map = NULL;
+      size = 0;
+    }
+}
+
+/*************************************************************
+ *     Method: find                                          *
+ *************************************************************
+ *  Description:                                             *
+ *     Record of a station, if it's right and new enough.    *
+ *  Call it locked.                                          *
+ *                                                           *
+ * Input:                                                    *
+ *    const char *metar - ICAO id                            *
+ *    time_t now - Current time                              *
+ *                                                           *
+ * Output:                                                   *
+ *    const TObservation* - NULL if we don't have it         *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+const TObservation *ObsCache::find(const char *metar, time_t now)
+{
+  const TObservation *obs;
+  unsigned int count;
+
+  if ((map==NULL) || (max_age==0))
+    return NULL;
+
+  count = ((const TObsHeader*)map)->count;
+  obs = (const TObservation*)((const char*)map+sizeof(TObsHeader));
+  for (unsigned int k=0; k<count; k++)
+    if ((strncmp(obs[k].metar, metar, sizeof(obs[k].metar))==0) && (obs[k].check==checksum(obs+k)))
+      return ((obs[k].report_time>0) && (now-obs[k].report_time<=max_age))?obs+k:NULL;
+  return NULL;
+}
+
+/*************************************************************
+ *     Method: restore                                       *
+ *************************************************************
+ *  Description:                                             *
+ *     Gives a new station its last observation. It's marked *
+ *  as stale until it's fetched again.                       *
+ *                                                           *
+ * Input:                                                    *
+ *    localtemp *station - Station, not loaded yet           *
+ *                                                           *
+ * Output:                                                   *
+ *    bool - False if we don't have it                       *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool ObsCache::restore(localtemp *station)
+{
+  const TObservation *obs;
+
+  pthread_mutex_lock(&lock);
+  obs = find(station->metar.data(), time(NULL));
+  if (obs)
+    {
+      station->get_time = obs->get_time;
+      station->info_time = obs->info_time;
+      station->report_time = obs->report_time;
+      station->celsius = obs->celsius;
+      station->fahrenheit = obs->fahrenheit;
+      station->humidity = obs->humidity;
+      station->theme = obs->theme;
+      station->mInfo.sky = (localtemp::ESky)obs->sky;
+      station->mInfo.CB = obs->CB;
+      station->mInfo.rain = (localtemp::ERain)obs->rain;
+      station->mInfo.fog = (localtemp::EFog)obs->fog;
+      station->issue_count = obs->issue_count;
+      station->issue_pos = obs->issue_pos;
+      for (int k=0; k<ISSUE_HISTORY; k++)
+	{
+	  station->issue_minute[k] = obs->issue_minute[k];
+	  station->issue_delay[k] = obs->issue_delay[k];
+	}
+      station->error = 0;
+      station->stale = true;
+      station->loaded = true;
+    }
+  pthread_mutex_unlock(&lock);
+  return (obs!=NULL);
+}
+
+/*************************************************************
+ *     Method: save                                          *
+ *************************************************************
+ *  Description:                                             *
+ *     Writes the file again with the new observation of a   *
+ *  station and the records of the others we still have.     *
+ *                                                           *
+ * Input:                                                    *
+ *    const localtemp *station - Station just fetched        *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void ObsCache::save(const localtemp *station)
+{
+  vector<TObservation> records;
+  TObservation obs;
+  TObsHeader h;
+  string tmp = (string)file+".tmp";
+  string dir = file;
+  time_t now = time(NULL);
+  const TObservation *old;
+  bool ok;
+  int fd;
+
+  pthread_mutex_lock(&lock);
+  if (max_age==0)
+    {
+      pthread_mutex_unlock(&lock);
+      return;
+    }
+
+  if (map)			// The others, if they are still useful
+    {
+      old = (const TObservation*)((const char*)map+sizeof(TObsHeader));
+      for (unsigned int k=0; k<((const TObsHeader*)map)->count; k++)
+	if ((strncmp(old[k].metar, station->metar.data(), sizeof(old[k].metar))!=0) &&
+	    (old[k].check==checksum(old+k)) && (now-old[k].report_time<=max_age))
+	  records.push_back(old[k]);
+    }
+
+  memset(&obs, 0, sizeof(obs));	// Padding too, for the checksum
+  strncpy(obs.metar, station->metar.data(), sizeof(obs.metar)-1);
+  obs.get_time = station->get_time;
+  obs.info_time = station->info_time;
+  obs.report_time = station->report_time;
+  obs.celsius = station->celsius;
+  obs.fahrenheit = station->fahrenheit;
+  obs.humidity = station->humidity;
+  obs.theme = station->theme;
+  obs.sky = station->mInfo.sky;
+  obs.CB = station->mInfo.CB;
+  obs.rain = station->mInfo.rain;
+  obs.fog = station->mInfo.fog;
+  obs.issue_count = station->issue_count;
+  obs.issue_pos = station->issue_pos;
+  for (int k=0; k<ISSUE_HISTORY; k++)
+    {
+      obs.issue_minute[k] = station->issue_minute[k];
+      obs.issue_delay[k] = station->issue_delay[k];
+    }
+  obs.check = checksum(&obs);
+  records.push_back(obs);
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, OBSCACHE_MAGIC, 8);
+  h.record_size = sizeof(TObservation);
+  h.count = records.size();
+
+  dir = dir.substr(0, dir.rfind('/'));
+  if ((mkdir(dir.data(), 0755)<0) && (errno!=EEXIST))
+    {
+      pthread_mutex_unlock(&lock);
+      return;
+    }
+  fd = open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ok = (fd>=0) && (write(fd, &h, sizeof(h))==(ssize_t)sizeof(h)) &&
+    (write(fd, &records[0], records.size()*sizeof(TObservation))==(ssize_t)(records.size()*sizeof(TObservation))) &&
+    (fsync(fd)==0);		// Data on disk before the rename
+  if (fd>=0)
+    close(fd);
+  if ((ok) && (rename(tmp.data(), file)==0))
+    {
+      if (!sync_dir(dir))
+	verbsth(VERB_NOTICE, (string)"Can't sync the observation cache directory: "+dir);
+      remap();
+    }
+  else
+    {
+      unlink(tmp.data());
+      verbsth(VERB_NOTICE, (string)"Can't write the observation cache: "+file);
+    }
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,37 @@
+#ifndef _OBSCACHE_H_
+#define _OBSCACHE_H_
+
+#include <pthread.h>
+#include <time.h>
+#include <stddef.h>
+
+#define OBSCACHE_FILE    "/.dwgo/observations" // Under the home directory
+#define OBSCACHE_MAGIC   "DWGOOBS1"
+
+class localtemp;
+struct TObservation;
+
+/* Last observation of every station, so they are shown at once when we
+   start, while they are fetched again. Thread safe */
+class ObsCache
+{
+ public:
+  ObsCache(const char* file);
+  virtual ~ObsCache();
+
+  void setMaxAge(int seconds);		/* Older ones are ignored. 0 disables the cache */
+  bool restore(localtemp *station);	/* False if we don't have it, or it's old */
+  void save(const localtemp *station);	/* After a successful fetch */
+
+ private:
+  pthread_mutex_t lock;
+  char *file;
+  int max_age;
+  void *map;			// The whole file, read only
+  size_t size;
+
+  void remap();
+  const TObservation *find(const char *metar, time_t now);
+};
+
+#endif
@@ -0,0 +1,275 @@
+ /********************************************************************************
+ *  File: particles.cpp							*
+ *  Author: Gaspar Fernández (helyo@totaki.com) 				*
+ *										*
+ *  Copyright (C) 2008   Gaspar Fernández					*
+ *										*
+ *  This program is free software: you can redistribute it and/or modify	*
+ *  it under the terms of the GNU General Public License as published by	*
+ *  the Free Software Foundation, either version 3 of the License, or 		*
+ *  (at your option) any later version.  	      	  	   		*
+ *										*
+ *  This program is distributed in the hope that it will be useful,		*
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of		*
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the		*
+ *  GNU General Public License for more details.				*
+ *										*
+ *  You should have received a copy of the GNU General Public License		*
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.	*
+ *									        *
+ ********************************************************************************
+ *   Description:
+ *     Rain, snow, hail, fog and dust over the rainy, snowy, hail, foggy and
+ *   dust themes. Every particle moves a fixed amount per step, whatever the
+ *   frame rate, and goes back to the other side of the tile when it leaves
+ *   it, so there is nothing to create or destroy after reset().
+ *     The fields are in separate arrays (x of all of them, then y...), in
+ *   fixed point, and step() goes through them in blocks of PARTICLE_BLOCK
+ *   with no calls nor branches, only selects, so the compiler updates a
+ *   block with a few vector instructions (the count of a block is known,
+ *   it doesn't need a scalar tail). Floats would be as easy to write, but
+ *   their comparisons may trap and gcc keeps them as branches unless
+ *   -fno-trapping-math is given. render() writes small rectangles into a
+ *   32 bit frame, blending two channels at once.
+ *
+ *   Change History:
+ *    Date       Author     Modification
+ *
+ ********************************************************************************/
+
+#include <stdlib.h>
+#include "particles.h"
+
+#define FIX(v) ((int)((v)*(1<<PARTICLE_FIX)))
+
+typedef struct
+{
+  int count;			// In a 64x64 tile
+  float vymin, vymax;		// Pixels per step
+  float vx;
+  float sway;
+  int width, height;		// Pixels
+  unsigned int alpha;		// 0-256
+  uint32_t rgb;
+} TParticleKind;
+
+static const TParticleKind kinds[] =
+  {
+    {0,  0.0,   0.0,  0.0, 0.0, 0,  0, 0,   0x000000}, // PARTICLES_NONE
+    {40, 3.0,   4.5, -0.6, 0.0, 1,  3, 150, 0xa8bcdc}, // PARTICLES_RAIN
+    {36, 0.4,   0.9,  0.0, 0.6, 1,  1, 230, 0xffffff}, // PARTICLES_SNOW
+    {20, 2.5,   3.5, -0.2, 0.0, 2,  2, 240, 0xe4ecf8}, // PARTICLES_HAIL
+    {10, -0.05, 0.05, 0.3, 0.2, 14, 3, 40,  0xd0d0d0}, // PARTICLES_FOG
+    {40, -0.1,  0.2,  1.2, 0.3, 1,  1, 110, 0xb89a74}  // PARTICLES_DUST
+  };
+
+/*************************************************************
+ *     Constructor ParticleSystem                            *
+ *************************************************************
+ *  Description:                                             *
+ *     Nothing falls until reset() says what.                *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+ParticleSystem::ParticleSystem()
+{
+  count = 0;
+  type = PARTICLES_NONE;
+  width = 0;
+  height = 0;
+  pw = 0;
+  ph = 0;
+  sway = 0;
+  seed = 1;
+}
+
+/*************************************************************
+ *     Method: random                                        *
+ *************************************************************
+ *  Description:                                             *
+ *     Our own generator (LCG), we don't touch rand() state. *
+ *                                                           *
+ * Input:                                                    *
+ *    float min, float max - Range                           *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+int ParticleSystem::random(float min, float max)
+{
+  seed = seed*1664525+1013904223;
+  return FIX(min+(max-min)*(seed>>8)/16777216.0f);
+}
+
+/*************************************************************
+ *     Method: reset                                         *
+ *************************************************************
+ *  Description:                                             *
+ *     Spreads the particles of a kind over the tile. Sizes  *
+ *  and speeds are given for 64x64, and grow with scale.     *
+ *                                                           *
+ * Input:                                                    *
+ *    int kind - PARTICLES_*                                 *
+ *    int width, int height - Tile size                      *
+ *    int scale - HiDPI size multiplier                      *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void ParticleSystem::reset(int kind, int width, int height, int scale)
+{
+  if ((kind<PARTICLES_NONE) || (kind>PARTICLES_DUST))
+    kind = PARTICLES_NONE;
+  if (scale<1)
+    scale = 1;
+
+  const TParticleKind &k = kinds[kind];
+  type = kind;
+  this->width = width;
+  this->height = height;
+  pw = k.width*scale;
+  ph = k.height*scale;
+  sway = FIX(k.sway*scale);
+  count = (k.count*scale*scale+PARTICLE_BLOCK-1)/PARTICLE_BLOCK*PARTICLE_BLOCK;
+  if (count>PARTICLES_MAX)
+    count = PARTICLES_MAX;
+
+  for (int i=0; i<count; i++)
+    {
+      x[i] = random(0, width);
+      y[i] = random(0, height);
+      vx[i] = random(k.vx*scale*0.8, k.vx*scale*1.2);
+      vy[i] = random(k.vymin*scale, k.vymax*scale);
+      phase[i] = random(0, 2);
+      dphase[i] = random(0.02, 0.06);
+    }
+}
+
+/*************************************************************
+ *     Method: step                                          *
+ *************************************************************
+ *  Description:                                             *
+ *     Moves all of them PARTICLE_STEP milliseconds. Those   *
+ *  which leave the tile come in from the other side, and    *
+ *  somewhere else across, so we don't see the same rows.    *
+ *  The sway is a triangle wave: |phase-1|-0.5 goes from     *
+ *  -0.5 to 0.5 and back while phase goes from 0 to 2.       *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void ParticleSystem::step()
+{
+  int32_t *__restrict px = x, *__restrict py = y, *__restrict p = phase;
+  const int32_t *__restrict pvx = vx, *__restrict pvy = vy, *__restrict pdp = dphase;
+  const int32_t w = FIX(width), h = FIX(height), left = -FIX(pw), top = -FIX(ph);
+  const int32_t wrapx = FIX(width+pw), wrapy = FIX(height+ph);
+  const int32_t jump = FIX(width*0.618); // Golden ratio, it doesn't repeat soon
+  const int32_t two = FIX(2), one = FIX(1), half = FIX(0.5);
+  const int32_t sw = sway;
+  int32_t ph, nx, ny, dy;
+
+  for (int b=0; b<count; b+=PARTICLE_BLOCK)
+    for (int i=b; i<b+PARTICLE_BLOCK; i++)
+      {
+	ph = p[i]+pdp[i];
+	ph -= (ph>=two)?two:0;
+	p[i] = ph;
+	nx = px[i]+pvx[i]+((sw*(abs(ph-one)-half))>>PARTICLE_FIX);
+	ny = py[i]+pvy[i];
+	dy = (ny<top)?wrapy:0;
+	dy = (ny>=h)?-wrapy:dy;
+	ny += dy;
+	nx += (dy!=0)?jump:0;
+	nx += (nx<left)?wrapx:0;
+	nx -= (nx>=w)?wrapx:0;
+	nx -= (nx>=w)?wrapx:0;	// The jump may need a second one
+	px[i] = nx;
+	py[i] = ny;
+      }
+}
+
+/*************************************************************
+ *     Method: render                                        *
+ *************************************************************
+ *  Description:                                             *
+ *     Blends every particle, a pw x ph rectangle, into a    *
+ *  frame with 8 bit channels in 32 bit pixels, whatever     *
+ *  their order (pixel must be in the same one).             *
+ *                                                           *
+ * Input:                                                    *
+ *    uint32_t *pixels - Frame, width x height               *
+ *    int stride - Pixels per row                            *
+ *    uint32_t pixel - Color of the particles                *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void ParticleSystem::render(uint32_t *pixels, int stride, uint32_t pixel)
+{
+  const unsigned int a = kinds[type].alpha, s = 256-a;
+  const uint32_t rb = (pixel & 0x00ff00ff)*a, g = ((pixel>>8) & 0x00ff00ff)*a;
+  int x1, y1, x2, y2;
+  uint32_t *row, d;
+
+  for (int k=0; k<count; k++)
+    {
+      x1 = x[k]>>PARTICLE_FIX;	// Rounded down, they may start out of the tile
+      y1 = y[k]>>PARTICLE_FIX;
+      x2 = x1+pw;
+      y2 = y1+ph;
+      if (x1<0) x1 = 0;
+      if (y1<0) y1 = 0;
+      if (x2>width) x2 = width;
+      if (y2>height) y2 = height;
+      for (int j=y1; j<y2; j++)
+	{
+	  row = pixels+j*stride;
+	  for (int i=x1; i<x2; i++)
+	    {
+	      d = row[i];
+	      row[i] = ((((d & 0x00ff00ff)*s+rb) >> 8) & 0x00ff00ff) |
+		((((d >> 8) & 0x00ff00ff)*s+g) & 0xff00ff00);
+	    }
+	}
+    }
+}
+
+/*************************************************************
+ *     Method: shrink, kind, color                           *
+ *************************************************************
+ *  Description:                                             *
+ *     When a frame takes longer than PARTICLE_BUDGET we     *
+ *  keep half of the particles (whole blocks). They are in   *
+ *  random order, so the first half looks like the whole.    *
+ *                                                           *
+ * Output:                                                   *
+ *    bool - shrink(): false if we have too few already      *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool ParticleSystem::shrink()
+{
+  if (count/2<PARTICLE_BLOCK)
+    return false;
+  count = count/2/PARTICLE_BLOCK*PARTICLE_BLOCK;
+  return true;
+}
+
+int ParticleSystem::kind()
+{
+  return type;
+}
+
+uint32_t ParticleSystem::color()
+{
+  return kinds[type].rgb;
+}
@@ -0,0 +1,50 @@
+#ifndef _PARTICLES_H_
+#define _PARTICLES_H_
+
+#include <stdint.h>
+
+#define PARTICLES_NONE    0
+#define PARTICLES_RAIN    1
+#define PARTICLES_SNOW    2
+#define PARTICLES_HAIL    3
+#define PARTICLES_FOG     4
+#define PARTICLES_DUST    5
+
+#define PARTICLES_MAX     512	// Per system, whatever the scale
+#define PARTICLE_BLOCK    8	// They are updated in groups of this, count is a multiple
+#define PARTICLE_FIX      8	// Positions and speeds in 1/256 pixels
+#define PARTICLE_STEP     40	// Milliseconds of simulation per step (25 fps)
+#define PARTICLE_MAX_STEPS 3	// Per frame, if we were late. The rest is lost
+#define PARTICLE_BUDGET   1000	// Max. microseconds per frame, or we use less of them
+
+/* Weather falling over a tile. Positions and speeds are kept by field, not
+   by particle, in fixed point, so the updates are plain loops over integer
+   arrays the compiler can vectorize. Doesn't need an X display */
+class ParticleSystem
+{
+ public:
+  ParticleSystem();
+
+  void reset(int kind, int width, int height, int scale); /* PARTICLES_*, tile size */
+  void step();			/* PARTICLE_STEP milliseconds */
+  void render(uint32_t *pixels, int stride, uint32_t pixel); /* 32 bit pixels, stride in pixels */
+  bool shrink();		/* Half of them, false if we can't */
+
+  int kind();
+  uint32_t color();		/* 0xRRGGBB */
+
+ private:
+  int32_t x[PARTICLES_MAX], y[PARTICLES_MAX];
+  int32_t vx[PARTICLES_MAX], vy[PARTICLES_MAX];
+  int32_t phase[PARTICLES_MAX], dphase[PARTICLES_MAX]; // Sideways sway, 0-512
+  int count;
+  int type;
+  int width, height;
+  int pw, ph;			// Size of a particle in pixels
+  int sway;			// Fixed point, sideways movement per step at most
+  uint32_t seed;
+
+  int random(float min, float max); /* In fixed point */
+};
+
+#endif
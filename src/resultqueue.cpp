@@ -0,0 +1,186 @@
+ /********************************************************************************
+ *  File: resultqueue.cpp							*
+ *  Author: Gaspar Fernández (helyo@totaki.com) 				*
+ *										*
+ *  Copyright (C) 2008   Gaspar Fernández					*
+ *										*
+ *  This program is free software: you can redistribute it and/or modify	*
+ *  it under the terms of the GNU General Public License as published by	*
+ *  the Free Software Foundation, either version 3 of the License, or 		*
+ *  (at your option) any later version.  	      	  	   		*
+ *										*
+ *  This program is distributed in the hope that it will be useful,		*
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of		*
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the		*
+ *  GNU General Public License for more details.				*
+ *										*
+ *  You should have received a copy of the GNU General Public License		*
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.	*
+ *									        *
+ ********************************************************************************
+ *   Description:
+ *     Lock-free queue used by the fetch threads to tell the main loop which
+ *   stations they are fetching and which ones they have finished. Many
+ *   threads can push, but only one can pop (Vyukov's intrusive MPSC queue).
+ *   Every push writes to an eventfd the main loop polls along with the X
+ *   connection.
+ *
+ *   Change History:
+ *    Date       Author     Modification
+ *
+ ********************************************************************************/
+
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include "resultqueue.h"
+#include "errors.h"
+
+/*************************************************************
+ *     Constructor ResultQueue                               *
+ *************************************************************
+ *  Description:                                             *
+ *     Creates an empty queue (just the stub node) and the   *
+ *  eventfd.                                                 *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+ResultQueue::ResultQueue()
+{
+  stub.next=NULL;
+  head=&stub;
+  tail=&stub;
+  event_fd=eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd<0)
+    error_handler(ERR_RESULTQUEUE, NULL);
+}
+
+ResultQueue::~ResultQueue()
+{
+  TResult result;
+
+  while (pop(result));		// Free pending nodes
+  close(event_fd);
+}
+
+/*************************************************************
+ *     Method: link, push                                    *
+ *************************************************************
+ *  Description:                                             *
+ *     link() appends a node. The producer swaps head, and   *
+ *  then links the previous one to it. Until then, the       *
+ *  consumer sees the queue as empty from that point.        *
+ *     push() creates a node and wakes the main loop up.     *
+ *                                                           *
+ * Input:                                                    *
+ *   unsigned int generation - Station list generation       *
+ *   unsigned int station - Index in the station list        *
+ *   int state - RESULT_FETCHING or RESULT_DONE              *
+ *   const TSnapshot &snap - What we show of the station     *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void ResultQueue::link(TResult *node)
+{
+  TResult *prev;
+
+  __atomic_store_n(&node->next, (TResult *)NULL, __ATOMIC_RELAXED);
+  prev=__atomic_exchange_n(&head, node, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+void ResultQueue::push(unsigned int generation, unsigned int station, int state, const TSnapshot &snap)
+{
+  TResult *node=new TResult;
+  uint64_t one=1;
+
+  node->generation=generation;
+  node->station=station;
+  node->state=state;
+  node->snap=snap;
+  link(node);
+
+  if (write(event_fd, &one, sizeof(one))<0)
+    verbsth(VERB_WARNING, "Can't wake up the main loop");
+}
+
+/*************************************************************
+ *     Method: pop                                           *
+ *************************************************************
+ *  Description:                                             *
+ *     Takes the oldest result. Only the main loop calls it. *
+ *  If a producer is in the middle of a push we return false *
+ *  and get it when its eventfd write wakes us up.           *
+ *                                                           *
+ * Input:                                                    *
+ *   TResult &result - Where to copy the result              *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - False if there is nothing to pop                 *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool ResultQueue::pop(TResult &result)
+{
+  TResult *first=tail;
+  TResult *next=__atomic_load_n(&first->next, __ATOMIC_ACQUIRE);
+
+  if (first==&stub)		// Skip the stub
+    {
+      if (next==NULL)
+	return false;
+      tail=next;
+      first=next;
+      next=__atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+  if (next==NULL)
+    {
+      if (first!=__atomic_load_n(&head, __ATOMIC_ACQUIRE))
+	return false;		// Being pushed right now
+      link(&stub);		// first is the last one, put the stub behind it
+      next=__atomic_load_n(&first->next, __ATOMIC_ACQUIRE);
+      if (next==NULL)
+	return false;
+    }
+
+  tail=next;
+  result=*first;
+  delete first;
+  return true;
+}
+
+/*************************************************************
+ *     Method: fd, drain                                     *
+ *************************************************************
+ *  Description:                                             *
+ *     fd() is the descriptor to poll. drain() clears it     *
+ *  before we pop the results.                               *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+int ResultQueue::fd()
+{
+  return event_fd;
+}
+
+void ResultQueue::drain()
+{
+  uint64_t tmp;
+  ssize_t n;
+
+  do
+    n=read(event_fd, &tmp, sizeof(tmp));
+  while ((n<0) && (errno==EINTR));
+  if ((n<0) && (errno!=EAGAIN))	// Nothing pushed since the last one
+    verbsth(VERB_WARNING, "Can't read the result queue event");
+}
@@ -0,0 +1,52 @@
+#ifndef _RESULTQUEUE_H_
+#define _RESULTQUEUE_H_
+
+#define RESULT_FETCHING  1	// We began to fetch the station
+#define RESULT_DONE      2	// We have finished (it may have failed)
+
+#include <time.h>
+
+/* What the main loop shows of a station. The fetch thread copies it when
+   it has written the station, the main loop never reads the station */
+typedef struct
+{
+  char metar[8];		// ICAO id
+  bool loaded;			// We have an observation
+  bool stale;			// From the observation cache, not fetched yet
+  int celsius, fahrenheit;
+  int theme;
+  time_t info_time;		// Time stored in the file
+  time_t report_time;		// UTC time of the report
+} TSnapshot;
+
+typedef struct TResult
+{
+  struct TResult *next;
+  unsigned int generation;	// Station list generation
+  unsigned int station;		// Index in the station list
+  int state;			// RESULT_*
+  TSnapshot snap;		// The station as it is now
+} TResult;
+
+/* Many threads push, only the main loop pops */
+class ResultQueue
+{
+ public:
+  ResultQueue();
+  virtual ~ResultQueue();
+
+  void push(unsigned int generation, unsigned int station, int state, const TSnapshot &snap);
+  bool pop(TResult &result);
+  int fd();			/* Readable when something has been pushed */
+  void drain();			/* Call it when fd() is readable */
+
+ private:
+  TResult stub;			// Always in the queue, so it's never empty
+  TResult *head;		// Last pushed. Producers swap it atomically
+  TResult *tail;		// Next to pop. Only used by the consumer
+  int event_fd;
+
+  void link(TResult *node);
+};
+
+#endif
@@ -0,0 +1,572 @@
+ /********************************************************************************
+ *  File: scheduler.cpp								*
+ *  Author: Gaspar Fernández (helyo@totaki.com) 				*
+ *										*
+ *  Copyright (C) 2008   Gaspar Fernández					*
+ *										*
+ *  This program is free software: you can redistribute it and/or modify	*
+ *  it under the terms of the GNU General Public License as published by	*
+ *  the Free Software Foundation, either version 3 of the License, or 		*
+ *  (at your option) any later version.  	      	  	   		*
+ *										*
+ *  This program is distributed in the hope that it will be useful,		*
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of		*
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the		*
+ *  GNU General Public License for more details.				*
+ *										*
+ *  You should have received a copy of the GNU General Public License		*
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.	*
+ *									        *
+ ********************************************************************************
+ *   Description:
+ *     Decides when every station must be fetched. It keeps a min-heap with
+ *   the time each station is due and the fetch thread sleeps on a timerfd
+ *   until the first one expires. Manual refresh, reload and exit requests
+ *   wake it up through an eventfd, so nothing runs while we are idle.
+ *     The station on screen and its neighbours go first and are kept
+ *   fresher. The rest are fetched in the background within a budget.
+ *
+ *   Change History:
+ *    Date       Author     Modification
+ *
+ ********************************************************************************/
+
+#include <algorithm>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include "scheduler.h"
+#include "errors.h"
+
+using namespace std;
+
+/* Reads the counter of a timerfd or eventfd, so it stops waking us up.
+   Nothing to read (someone was faster) isn't an error */
+static bool clear_counter(int fd)
+{
+  uint64_t tmp;
+  ssize_t n;
+
+  do
+    n=read(fd, &tmp, sizeof(tmp));
+  while ((n<0) && (errno==EINTR));
+  return (n==(ssize_t)sizeof(tmp)) || ((n<0) && (errno==EAGAIN));
+}
+
+/*************************************************************
+ *     Constructor Scheduler                                 *
+ *************************************************************
+ *  Description:                                             *
+ *     Creates the timer and the event descriptors. The list *
+ *  is empty until reset() is called.                        *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+Scheduler::Scheduler()
+{
+  pthread_mutex_init(&lock, NULL);
+  generation=0;
+  remap_gen=0;
+  events=0;
+  last_fetch=0;
+  focused=0;
+  budget=0;
+  tokens=0;
+  last_refill=0;
+  timer_fd=timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+  event_fd=eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if ((timer_fd<0) || (event_fd<0))
+    error_handler(ERR_SCHEDULER, NULL);
+}
+
+Scheduler::~Scheduler()
+{
+  close(timer_fd);
+  close(event_fd);
+  pthread_mutex_destroy(&lock);
+}
+
+/*************************************************************
+ *     Method: later, push                                   *
+ *************************************************************
+ *  Description:                                             *
+ *     later() keeps the heap ordered, earliest due first.   *
+ *     push() inserts a new due time for a station. Older    *
+ *  entries of that station become outdated and will be      *
+ *  skipped. If there are too many of them we rebuild the    *
+ *  heap. Must be called with the lock held.                 *
+ *                                                           *
+ * Input:                                                    *
+ *   unsigned int station - Index in the station list        *
+ *   time_t due - When to fetch it                           *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool Scheduler::later(const TDue &a, const TDue &b)
+{
+  return (a.due>b.due);
+}
+
+/*************************************************************
+ *     Method: priority                                      *
+ *************************************************************
+ *  Description:                                             *
+ *     How important is a station? It depends on how far it  *
+ *  is from the focused one in the cycle order.              *
+ *  Must be called with the lock held.                       *
+ *                                                           *
+ * Input:                                                    *
+ *   unsigned int station - Index in the station list        *
+ *                                                           *
+ * Output:                                                   *
+ *   int - SCHED_PRIO_* value                                *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+int Scheduler::priority(unsigned int station)
+{
+  unsigned int n=stamps.size();
+  unsigned int fwd=(station+n-focused)%n;
+  unsigned int dist=(fwd<n-fwd)?fwd:n-fwd;
+
+  if (dist==0)
+    return SCHED_PRIO_FOCUS;
+  else if (dist<=SCHED_NEIGHBOURS)
+    return SCHED_PRIO_NEIGHBOUR;
+  return SCHED_PRIO_BACKGROUND;
+}
+
+void Scheduler::push(unsigned int station, time_t due)
+{
+  TDue entry;
+
+  if (heap.size()>4*stamps.size()+4)
+    {				// Lots of outdated entries, purge them
+      vector<TDue> alive;
+      for (unsigned int k=0; k<heap.size(); k++)
+	if (heap[k].stamp==stamps[heap[k].station])
+	  alive.push_back(heap[k]);
+      heap.swap(alive);
+      make_heap(heap.begin(), heap.end(), later);
+    }
+
+  entry.due=due;
+  entry.station=station;
+  entry.stamp=++stamps[station];
+  requeue(entry);
+}
+
+/*************************************************************
+ *     Method: requeue, take_token                           *
+ *************************************************************
+ *  Description:                                             *
+ *     requeue() puts back an entry we took from the heap    *
+ *  keeping its stamp.                                       *
+ *     take_token() tells if we can make a background fetch *
+ *  now. Tokens are refilled at budget per minute.           *
+ *  Must be called with the lock held.                       *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void Scheduler::requeue(TDue entry)
+{
+  heap.push_back(entry);
+  push_heap(heap.begin(), heap.end(), later);
+}
+
+bool Scheduler::take_token(time_t now)
+{
+  if (budget<=0)
+    return true;		// Unlimited
+
+  tokens+=(now-last_refill)*budget/60.0;
+  if (tokens>budget)
+    tokens=budget;
+  last_refill=now;
+  if (tokens<1)
+    return false;
+
+  tokens--;
+  return true;
+}
+
+/*************************************************************
+ *     Method: post, arm                                     *
+ *************************************************************
+ *  Description:                                             *
+ *     post() stores an event and wakes the fetch thread up. *
+ *     arm() programs the timer to expire when the first     *
+ *  station is due, or disarms it if there is nothing to do. *
+ *  arm() must be called with the lock held.                 *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void Scheduler::post(int ev)
+{
+  uint64_t one=1;
+
+  pthread_mutex_lock(&lock);
+  events|=ev;
+  pthread_mutex_unlock(&lock);
+  if (write(event_fd, &one, sizeof(one))<0)
+    verbsth(VERB_WARNING, "Can't wake up the fetch thread");
+}
+
+void Scheduler::arm()
+{
+  struct itimerspec when;
+
+  when.it_interval.tv_sec=0;
+  when.it_interval.tv_nsec=0;
+  when.it_value.tv_sec=(heap.empty())?0:heap.front().due; // 0 disarms the timer
+  when.it_value.tv_nsec=0;
+  timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+/*************************************************************
+ *     Method: reset                                         *
+ *************************************************************
+ *  Description:                                             *
+ *     Called when the station list is (re)created. New      *
+ *  stations are due now. Stations kept from the previous    *
+ *  list keep their due times, and fetches of the previous   *
+ *  list still running are moved to the new one when they    *
+ *  finish.                                                  *
+ *                                                           *
+ * Input:                                                    *
+ *   vector<int> from - For every station, its index in the  *
+ *                      previous list, or -1 if it is new.   *
+ *                                                           *
+ * Output:                                                   *
+ *   unsigned int - Generation of the new list               *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+unsigned int Scheduler::reset(const vector<int> &from)
+{
+  unsigned int gen;
+  unsigned int stations=from.size();
+  time_t now=time(NULL);
+  vector<TDue> old_heap;
+  vector<unsigned int> old_stamps;
+  vector<time_t> old_fetched;
+  vector<bool> old_busy;
+  vector<bool> queued(stations, false);
+  int k, o;
+
+  pthread_mutex_lock(&lock);
+  old_heap.swap(heap);
+  old_stamps.swap(stamps);
+  old_fetched.swap(fetched);
+  old_busy.swap(busy);
+
+  remap.assign(old_stamps.size(), -1);
+  for (k=0; k<(int)stations; k++)
+    if ((from[k]>=0) && (from[k]<(int)old_stamps.size()) && (remap[from[k]]<0))
+      remap[from[k]]=k;
+  remap_gen=generation;
+  gen=++generation;
+
+  stamps.assign(stations, 0);
+  fetched.assign(stations, 0);
+  busy.assign(stations, false);
+  if (focused>=stations)
+    focused=0;
+
+  for (unsigned int e=0; e<old_heap.size(); e++) // Stations kept keep their due time
+    {
+      o=old_heap[e].station;
+      if ((old_heap[e].stamp==old_stamps[o]) && (remap[o]>=0))
+	{
+	  k=remap[o];
+	  fetched[k]=old_fetched[o];
+	  push(k, old_heap[e].due);
+	  queued[k]=true;
+	}
+    }
+  for (o=0; o<(int)old_busy.size(); o++) // Being fetched, schedule() will move them here
+    if ((old_busy[o]) && (remap[o]>=0) && (!queued[remap[o]]))
+      {
+	k=remap[o];
+	busy[k]=true;
+	fetched[k]=old_fetched[o];
+	push(k, now+SCHED_FOCUS_MAX_AGE); // Just in case it never comes back
+	queued[k]=true;
+      }
+  for (k=0; k<(int)stations; k++) // New ones, fetch them now
+    if (!queued[k])
+      push(k, now);
+  pthread_mutex_unlock(&lock);
+
+  post(SCHED_EV_RELOAD);
+  return gen;
+}
+
+/*************************************************************
+ *     Method: schedule                                      *
+ *************************************************************
+ *  Description:                                             *
+ *     Sets when a station must be fetched again. It is      *
+ *  called by the fetch thread after every fetch, so we      *
+ *  don't need to wake it up. Stations near the focused one  *
+ *  can't wait more than SCHED_FOCUS_MAX_AGE seconds.        *
+ *     If the list has been reloaded since the fetch began,  *
+ *  the station is moved to its new index (if it's kept).    *
+ *                                                           *
+ * Input:                                                    *
+ *   unsigned int gen - Generation returned by wait()        *
+ *   unsigned int station - Index in the station list        *
+ *   time_t due - When to fetch it                           *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void Scheduler::schedule(unsigned int gen, unsigned int station, time_t due)
+{
+  time_t now=time(NULL);
+
+  pthread_mutex_lock(&lock);
+  if ((gen!=generation) && (gen==remap_gen) && (station<remap.size()) && (remap[station]>=0))
+    {				// The list has been reloaded meanwhile
+      station=remap[station];
+      gen=generation;
+    }
+  if ((gen==generation) && (station<stamps.size()))
+    {
+      busy[station]=false;
+      fetched[station]=now;
+      if ((priority(station)!=SCHED_PRIO_BACKGROUND) && (due>now+SCHED_FOCUS_MAX_AGE))
+	due=now+SCHED_FOCUS_MAX_AGE;
+      push(station, due);
+    }
+  pthread_mutex_unlock(&lock);
+}
+
+/*************************************************************
+ *     Method: focus                                         *
+ *************************************************************
+ *  Description:                                             *
+ *     The user is looking at another station. If its data   *
+ *  (or its neighbours') is old, it is due now, and it will  *
+ *  be the next one to be fetched.                           *
+ *                                                           *
+ * Input:                                                    *
+ *   unsigned int station - Station on screen                *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void Scheduler::focus(unsigned int station)
+{
+  time_t now=time(NULL);
+  bool wake=false;
+
+  pthread_mutex_lock(&lock);
+  if (station<stamps.size())
+    {
+      focused=station;
+      for (unsigned int k=0; k<stamps.size(); k++)
+	if ((priority(k)!=SCHED_PRIO_BACKGROUND) && (!busy[k]) &&
+	    (fetched[k]+SCHED_FOCUS_MAX_AGE<=now))
+	  {
+	    push(k, now);
+	    wake=true;
+	  }
+    }
+  pthread_mutex_unlock(&lock);
+
+  if (wake)
+    post(SCHED_EV_FOCUS);
+}
+
+/*************************************************************
+ *     Method: setBudget                                     *
+ *************************************************************
+ *  Description:                                             *
+ *     Limits how many stations out of the screen we fetch   *
+ *  each minute.                                             *
+ *                                                           *
+ * Input:                                                    *
+ *   int per_minute - Max. fetches per minute (0: no limit)  *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void Scheduler::setBudget(int per_minute)
+{
+  pthread_mutex_lock(&lock);
+  budget=per_minute;
+  tokens=per_minute;		// Full at the beginning
+  last_refill=time(NULL);
+  pthread_mutex_unlock(&lock);
+}
+
+/*************************************************************
+ *     Method: refresh, shutdown                             *
+ *************************************************************
+ *  Description:                                             *
+ *     refresh() makes every station due now. It refuses to  *
+ *  do it if we fetched less than min_interval seconds ago.  *
+ *     shutdown() tells the fetch thread to finish.          *
+ *                                                           *
+ * Input:                                                    *
+ *   int min_interval - Min. time between refreshes          *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - True if the refresh has been requested           *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool Scheduler::refresh(int min_interval)
+{
+  bool recent;
+
+  pthread_mutex_lock(&lock);
+  recent=(time(NULL)-last_fetch<=min_interval);
+  pthread_mutex_unlock(&lock);
+  if (recent)
+    return false;
+
+  post(SCHED_EV_REFRESH);
+  return true;
+}
+
+void Scheduler::shutdown()
+{
+  post(SCHED_EV_SHUTDOWN);
+}
+
+/*************************************************************
+ *     Method: wait                                          *
+ *************************************************************
+ *  Description:                                             *
+ *     Blocks the fetch thread until some stations are due   *
+ *  or we must exit. Sleeps on the timer and the event       *
+ *  descriptors, so there are no wakeups while idle.         *
+ *     Due stations are given by priority. Background ones   *
+ *  out of budget are delayed until we have a token.         *
+ *     The caller can add its own descriptors (its sockets)  *
+ *  and a timeout. Then we return after every wakeup.       *
+ *                                                           *
+ * Input:                                                    *
+ *   vector<unsigned int> &due - Where to store stations due *
+ *   unsigned int &gen - Where to store the list generation  *
+ *   unsigned int max - Max. stations to return              *
+ *   vector<pollfd> *io - More descriptors to wait for       *
+ *   int timeout - Milliseconds to wait for them, -1=forever *
+ *                                                           *
+ * Output:                                                   *
+ *   int - SCHED_FETCH, SCHED_IO or SCHED_SHUTDOWN           *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+int Scheduler::wait(vector<unsigned int> &due, unsigned int &gen, unsigned int max,
+		    vector<pollfd> *io, int timeout)
+{
+  vector<pollfd> fds(2);
+  int res;
+  time_t now;
+  TDue top;
+  vector<TDue> ready[SCHED_PRIO_BACKGROUND+1];
+
+  due.clear();
+  while (1)
+    {
+      pthread_mutex_lock(&lock);
+      if (events & SCHED_EV_SHUTDOWN)
+	{
+	  pthread_mutex_unlock(&lock);
+	  return SCHED_SHUTDOWN;
+	}
+
+      now=time(NULL);
+      if (events & SCHED_EV_REFRESH) // Everything due now
+	for (unsigned int k=0; k<stamps.size(); k++)
+	  push(k, now);
+      events=0;
+
+      while ((max>0) && (!heap.empty()) && (heap.front().due<=now))
+	{
+	  top=heap.front();
+	  pop_heap(heap.begin(), heap.end(), later);
+	  heap.pop_back();
+	  if (top.stamp==stamps[top.station]) // Skip outdated entries
+	    ready[priority(top.station)].push_back(top);
+	}
+
+      for (int p=SCHED_PRIO_FOCUS; p<=SCHED_PRIO_BACKGROUND; p++)
+	{
+	  for (unsigned int k=0; k<ready[p].size(); k++)
+	    {
+	      top=ready[p][k];
+	      if ((due.size()<max) && ((p!=SCHED_PRIO_BACKGROUND) || (take_token(now))))
+		{
+		  due.push_back(top.station);
+		  stamps[top.station]++;	// Until it is scheduled again
+		  busy[top.station]=true;
+		  continue;
+		}
+	      if ((due.size()<max) && (budget>0)) // Out of budget, wait for the next token
+		top.due=now+(time_t)(60/budget)+1;
+	      requeue(top);
+	    }
+	  ready[p].clear();
+	}
+
+      if (!due.empty())
+	{
+	  gen=generation;
+	  last_fetch=now;
+	  pthread_mutex_unlock(&lock);
+	  return SCHED_FETCH;
+	}
+
+      arm();
+      pthread_mutex_unlock(&lock);
+
+      fds.resize(2);
+      fds[0].fd=(max>0)?timer_fd:-1; // No room for more, don't wake up for them
+      fds[0].events=POLLIN;
+      fds[0].revents=0;
+      fds[1].fd=event_fd;
+      fds[1].events=POLLIN;
+      fds[1].revents=0;
+      if (io!=NULL)
+	fds.insert(fds.end(), io->begin(), io->end());
+      res=poll(&fds[0], fds.size(), timeout);
+      if (res<0)
+	continue;		// Interrupted, check again
+      if ((fds[0].revents & POLLIN) && (!clear_counter(timer_fd)))
+	verbsth(VERB_WARNING, "Can't read the fetch timer");
+      if ((fds[1].revents & POLLIN) && (!clear_counter(event_fd)))
+	verbsth(VERB_WARNING, "Can't read the fetch thread events");
+      if (io!=NULL)		// Let the caller check its deadlines, then call us again
+	{
+	  for (unsigned int k=0; k<io->size(); k++)
+	    (*io)[k].revents=fds[k+2].revents;
+	  return SCHED_IO;
+	}
+    }
+}
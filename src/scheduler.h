@@ -0,0 +1,74 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <vector>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+
+#define SCHED_FETCH     1	// Some stations must be fetched now
+#define SCHED_SHUTDOWN  2	// The fetch thread must finish
+#define SCHED_IO        3	// Other descriptors are ready, or timeout
+
+#define SCHED_EV_REFRESH  1	// Manual refresh (F5)
+#define SCHED_EV_RELOAD   2	// Station list rebuilt (F6)
+#define SCHED_EV_SHUTDOWN 4	// Exit
+#define SCHED_EV_FOCUS    8	// The user is looking at another station
+
+#define SCHED_PRIO_FOCUS      0	// Station on screen
+#define SCHED_PRIO_NEIGHBOUR  1	// Next or previous one
+#define SCHED_PRIO_BACKGROUND 2	// The rest of them
+
+#define SCHED_NEIGHBOURS      1	  // Stations at each side of the focused one
+#define SCHED_FOCUS_MAX_AGE   300 // Max. age of the data we are looking at
+
+class Scheduler
+{
+ public:
+  Scheduler();
+  virtual ~Scheduler();
+
+  unsigned int reset(const std::vector<int> &from); /* New station list */
+  void schedule(unsigned int generation, unsigned int station, time_t due);
+  bool refresh(int min_interval);	/* False if we have just refreshed */
+  void focus(unsigned int station);	/* Station being displayed */
+  void setBudget(int per_minute);	/* Background fetches per minute, 0=unlimited */
+  void shutdown();
+  int wait(std::vector<unsigned int> &due, unsigned int &generation, unsigned int max,
+	   std::vector<pollfd> *io=NULL, int timeout=-1);
+
+ private:
+  typedef struct
+  {
+    time_t due;			// When to fetch it
+    unsigned int station;	// Index in the station list
+    unsigned int stamp;		// Outdated entries are skipped
+  } TDue;
+
+  std::vector<TDue> heap;	// Min-heap sorted by due time
+  std::vector<unsigned int> stamps; // Current stamp of every station
+  std::vector<time_t> fetched;	// Last time every station was fetched
+  std::vector<bool> busy;	// Being fetched right now
+  unsigned int focused;		// Station on screen
+  int budget;			// Background fetches per minute
+  double tokens;		// Background fetches we can do now
+  time_t last_refill;		// Last time we added tokens
+  pthread_mutex_t lock;
+  unsigned int generation;	// Changes every time the list is reset
+  std::vector<int> remap;	// Index in the new list of the previous one's stations
+  unsigned int remap_gen;	// Generation of the previous list
+  int events;			// SCHED_EV_* pending
+  int timer_fd;			// Fires when the first station is due
+  int event_fd;			// Wakes the fetch thread up
+  time_t last_fetch;		// Last time we returned SCHED_FETCH
+
+  static bool later(const TDue &a, const TDue &b);
+  int priority(unsigned int station);
+  void push(unsigned int station, time_t due);
+  void requeue(TDue entry);
+  bool take_token(time_t now);
+  void post(int ev);
+  void arm();
+};
+
+#endif
@@ -0,0 +1,167 @@
+ /********************************************************************************
+ *  File: transition.cpp							*
+ *  Author: Gaspar Fernández (helyo@totaki.com) 				*
+ *										*
+ *  Copyright (C) 2008   Gaspar Fernández					*
+ *										*
+ *  This program is free software: you can redistribute it and/or modify	*
+ *  it under the terms of the GNU General Public License as published by	*
+ *  the Free Software Foundation, either version 3 of the License, or 		*
+ *  (at your option) any later version.  	      	  	   		*
+ *										*
+ *  This program is distributed in the hope that it will be useful,		*
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of		*
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the		*
+ *  GNU General Public License for more details.				*
+ *										*
+ *  You should have received a copy of the GNU General Public License		*
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.	*
+ *									        *
+ ********************************************************************************
+ *   Description:
+ *     Pixel kernels for the transitions between two stations. XDraw keeps
+ *   the old and the new frame in its memory and, for each step, writes a
+ *   mix of them into the frame it uploads.
+ *     The crossfade works on the four bytes of each pixel at once: with
+ *   AVX2 (8 pixels per loop) when the CPU has it, SSE2 (4 pixels) on any
+ *   other x86-64, and plain C elsewhere. The three of them give the same
+ *   result.
+ *
+ *   Change History:
+ *    Date       Author     Modification
+ *
+ ********************************************************************************/
+
+#include <string.h>
+#include "transition.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+/*************************************************************
+ *     Function: crossfade32                                 *
+ *************************************************************
+ *  Description:                                             *
+ *     dst = (from*(256-t) + to*t) / 256, on every byte.     *
+ *                                                           *
+ * Input:                                                    *
+ *   const uint32_t *from, *to - Both frames                 *
+ *   uint32_t *dst - Result (may be one of them)             *
+ *   size_t n - Pixels                                       *
+ *   unsigned int t - Weight of to, 0-TRANSITION_STEPS       *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+static void crossfade_c(const uint32_t *from, const uint32_t *to, uint32_t *dst, size_t n, unsigned int t)
+{
+  uint32_t a, b;
+  unsigned int s = TRANSITION_STEPS-t;
+
+  for (size_t k=0; k<n; k++)
+    {
+      a = from[k];
+      b = to[k];			// Two channels at once, 16 bits each
+      dst[k] = ((((a & 0x00ff00ff)*s + (b & 0x00ff00ff)*t) >> 8) & 0x00ff00ff) |
+	((((a >> 8) & 0x00ff00ff)*s + ((b >> 8) & 0x00ff00ff)*t) & 0xff00ff00);
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static size_t crossfade_sse2(const uint32_t *from, const uint32_t *to, uint32_t *dst, size_t n, unsigned int t)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i wt = _mm_set1_epi16(t);
+  const __m128i ws = _mm_set1_epi16(TRANSITION_STEPS-t);
+  __m128i a, b, lo, hi;
+  size_t k;
+
+  for (k=0; k+4<=n; k+=4)
+    {
+      a = _mm_loadu_si128((const __m128i*)(from+k));
+      b = _mm_loadu_si128((const __m128i*)(to+k));
+      lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), ws),
+			 _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), wt));
+      hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), ws),
+			 _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), wt));
+      _mm_storeu_si128((__m128i*)(dst+k),
+		       _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+    }
+  return k;
+}
+
+__attribute__((target("avx2")))
+static size_t crossfade_avx2(const uint32_t *from, const uint32_t *to, uint32_t *dst, size_t n, unsigned int t)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i wt = _mm256_set1_epi16(t);
+  const __m256i ws = _mm256_set1_epi16(TRANSITION_STEPS-t);
+  __m256i a, b, lo, hi;
+  size_t k;
+
+  for (k=0; k+8<=n; k+=8)	// unpack and pack work by 128 bit lanes, so the order is kept
+    {
+      a = _mm256_loadu_si256((const __m256i*)(from+k));
+      b = _mm256_loadu_si256((const __m256i*)(to+k));
+      lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero), ws),
+			    _mm256_mullo_epi16(_mm256_unpacklo_epi8(b, zero), wt));
+      hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero), ws),
+			    _mm256_mullo_epi16(_mm256_unpackhi_epi8(b, zero), wt));
+      _mm256_storeu_si256((__m256i*)(dst+k),
+			  _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8)));
+    }
+  return k;
+}
+#endif
+
+void crossfade32(const uint32_t *from, const uint32_t *to, uint32_t *dst, size_t n, unsigned int t)
+{
+  size_t done = 0;
+
+  if (t>TRANSITION_STEPS)
+    t = TRANSITION_STEPS;
+#ifdef HAVE_X86_KERNELS
+  static int avx2 = -1;
+
+  if (avx2<0)
+    avx2 = __builtin_cpu_supports("avx2");
+  if (avx2)
+    done = crossfade_avx2(from, to, dst, n, t);
+  else if (__builtin_cpu_supports("sse2"))
+    done = crossfade_sse2(from, to, dst, n, t);
+#endif
+  crossfade_c(from+done, to+done, dst+done, n-done, t);
+}
+
+/*************************************************************
+ *     Function: slide32                                     *
+ *************************************************************
+ *  Description:                                             *
+ *     The old frame moves offset pixels to the left and     *
+ *  the new one fills the gap from the right. Only copies.   *
+ *                                                           *
+ * Input:                                                    *
+ *   const char *from, *to - Both frames                     *
+ *   char *dst - Result (not one of them)                    *
+ *   int width, int height, int bpl - Size of all of them    *
+ *   int offset - 0-width                                    *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void slide32(const char *from, const char *to, char *dst, int width, int height, int bpl, int offset)
+{
+  if (offset<0) offset = 0;
+  if (offset>width) offset = width;
+
+  for (int j=0; j<height; j++)
+    {
+      memcpy(dst+j*bpl, from+j*bpl+offset*4, (width-offset)*4);
+      memcpy(dst+j*bpl+(width-offset)*4, to+j*bpl, offset*4);
+    }
+}
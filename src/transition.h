@@ -0,0 +1,17 @@
+#ifndef _TRANSITION_H_
+#define _TRANSITION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRANSITION_NONE   0	// Hard cut
+#define TRANSITION_FADE   1	// Crossfade
+#define TRANSITION_SLIDE  2	// The new one comes from the right
+
+#define TRANSITION_STEPS  256	// Weight of the new frame goes from 0 to this
+
+/* 32 bit pixels, each channel in a byte. Don't need an X display */
+void crossfade32(const uint32_t *from, const uint32_t *to, uint32_t *dst, size_t n, unsigned int t);
+void slide32(const char *from, const char *to, char *dst, int width, int height, int bpl, int offset);
+
+#endif
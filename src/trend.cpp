@@ -0,0 +1,186 @@
+ /********************************************************************************
+ *  File: trend.cpp								*
+ *  Author: Gaspar Fernández (helyo@totaki.com) 				*
+ *										*
+ *  Copyright (C) 2008   Gaspar Fernández					*
+ *										*
+ *  This program is free software: you can redistribute it and/or modify	*
+ *  it under the terms of the GNU General Public License as published by	*
+ *  the Free Software Foundation, either version 3 of the License, or 		*
+ *  (at your option) any later version.  	      	  	   		*
+ *										*
+ *  This program is distributed in the hope that it will be useful,		*
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of		*
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the		*
+ *  GNU General Public License for more details.				*
+ *										*
+ *  You should have received a copy of the GNU General Public License		*
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.	*
+ *									        *
+ ********************************************************************************
+ *   Description:
+ *     Trends of the temperature, for sparklines. Reading the history every
+ *   time we draw one would decode hundreds of records for a few dozen
+ *   pixels, so every observation is also added to a few tiers of buckets,
+ *   from 15 minutes to a day, where we keep their min, max and sum. Each
+ *   tier is a ring of TREND_BUCKETS: the bucket of a time is always the
+ *   same, and it's emptied when a newer time falls in it.
+ *     A trend asks for at most a number of points. We give the buckets of
+ *   the finest tier that has the whole span in that many, or the coarsest
+ *   one when none has it. HistoryStore fills the tiers of a station from
+ *   its history the first time, then adds each observation it appends.
+ *
+ *   Change History:
+ *    Date       Author     Modification
+ *
+ ********************************************************************************/
+
+#include <string.h>
+#include "trend.h"
+
+using namespace std;
+
+static const int64_t resolutions[TREND_TIERS] = {900, 3600, 21600, 86400};
+
+/* Start of the bucket of a time, rounded down also before 1970 */
+static inline int64_t bucket_start(int64_t time, int64_t res)
+{
+  return (time>=0)?time/res*res:-((-time+res-1)/res*res);
+}
+
+/*************************************************************
+ *     Constructor TrendTiers, Method: resolution, span      *
+ *************************************************************
+ *  Description:                                             *
+ *     Empty tiers. Their resolutions, and the time the      *
+ *  coarsest one keeps, what's worth reading from history.   *
+ *                                                           *
+ * Input:                                                    *
+ *    int tier - 0 is the finest one                         *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+TrendTiers::TrendTiers()
+{
+  memset(tiers, 0, sizeof(tiers));
+  newest = 0;
+}
+
+int64_t TrendTiers::resolution(int tier)
+{
+  return resolutions[tier];
+}
+
+int64_t TrendTiers::span()
+{
+  return resolutions[TREND_TIERS-1]*TREND_BUCKETS;
+}
+
+/*************************************************************
+ *     Method: add                                           *
+ *************************************************************
+ *  Description:                                             *
+ *     Adds an observation to its bucket of every tier. If   *
+ *  the bucket has an older time it's reused, older ones     *
+ *  than the ring keeps are ignored.                         *
+ *                                                           *
+ * Input:                                                    *
+ *    int64_t time - Time of the observation                 *
+ *    int temp - Tenths of Celsius                           *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+void TrendTiers::add(int64_t time, int temp)
+{
+  int64_t start;
+  TBucket *b;
+
+  for (int t=0; t<TREND_TIERS; t++)
+    {
+      start = bucket_start(time, resolutions[t]);
+      b = &tiers[t][(uint64_t)(start/resolutions[t])%TREND_BUCKETS];
+      if ((b->count>0) && (b->start>start))
+	continue;		// Out of the ring
+      if ((b->count==0) || (b->start<start))
+	{
+	  b->start = start;
+	  b->sum = 0;
+	  b->min = temp;
+	  b->max = temp;
+	  b->count = 0;
+	}
+      if (b->count==0xffff)
+	continue;		// Full, one more wouldn't change much
+      b->sum += temp;
+      b->count++;
+      if (temp<b->min) b->min = temp;
+      if (temp>b->max) b->max = temp;
+    }
+  if (time>newest)
+    newest = time;
+}
+
+/*************************************************************
+ *     Method: points                                        *
+ *************************************************************
+ *  Description:                                             *
+ *     The buckets of a time span, from the finest tier that *
+ *  has all of it in max buckets or less, or the newest max  *
+ *  buckets of the coarsest one. Empty buckets (no report    *
+ *  then) are skipped, the sparkline joins the ones at both  *
+ *  sides.                                                   *
+ *                                                           *
+ * Input:                                                    *
+ *    int64_t from, int64_t to - Span, to isn't included     *
+ *    size_t max - Max. points we want                       *
+ *    vector<TTrendPoint> &out - Where they go               *
+ *                                                           *
+ * Output:                                                   *
+ *    size_t - How many points                               *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+size_t TrendTiers::points(int64_t from, int64_t to, size_t max, vector<TTrendPoint> &out)
+{
+  int64_t res, first, oldest;
+  TTrendPoint p;
+  TBucket *b;
+  int t;
+
+  out.clear();
+  if ((to<=from) || (newest==0))
+    return 0;
+  if (max==0)
+    max = TREND_POINTS;
+
+  for (t=0; t<TREND_TIERS-1; t++)
+    {
+      res = resolutions[t];
+      oldest = bucket_start(newest, res)-(TREND_BUCKETS-1)*res; // Oldest bucket we still have
+      if (((uint64_t)((to-1)/res-from/res+1)<=max) && (bucket_start(from, res)>=oldest))
+	break;
+    }
+
+  res = resolutions[t];
+  first = bucket_start(from, res);
+  if ((uint64_t)((to-1)/res-from/res+1)>max)
+    first = bucket_start(to-1, res)-(int64_t)(max-1)*res; // The newest ones
+  for (int64_t start=first; (start<to) && (out.size()<max); start+=res)
+    {
+      b = &tiers[t][(uint64_t)(start/res)%TREND_BUCKETS];
+      if ((b->count==0) || (b->start!=start))
+	continue;
+      p.time = start;
+      p.min = b->min;
+      p.max = b->max;
+      p.mean = b->sum/b->count;
+      out.push_back(p);
+    }
+  return out.size();
+}
@@ -0,0 +1,46 @@
+#ifndef _TREND_H_
+#define _TREND_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define TREND_TIERS      4	// Resolutions: 15 minutes, 1 hour, 6 hours, 1 day
+#define TREND_BUCKETS    96	// Per tier: 1, 4, 24 and 96 days
+#define TREND_POINTS     48	// Max. points of a trend, when it isn't said
+
+/* Temperatures of a bucket of a tier */
+typedef struct
+{
+  int64_t time;			// Start of the bucket
+  int16_t min, max, mean;	// Tenths of Celsius
+} TTrendPoint;
+
+/* Min, max and mean of the temperatures of a station at several
+   resolutions, added as they come (in time order). A trend of any span is
+   read from the finest tier that has it in a few points. Not thread safe,
+   HistoryStore locks it. Doesn't need an X display */
+class TrendTiers
+{
+ public:
+  TrendTiers();
+
+  static int64_t resolution(int tier);	/* Seconds of a bucket */
+  static int64_t span();		/* Seconds the coarsest tier keeps */
+  void add(int64_t time, int temp);	/* Tenths of Celsius */
+  size_t points(int64_t from, int64_t to, size_t max, std::vector<TTrendPoint> &out); /* [from, to), empty buckets skipped */
+
+ private:
+  typedef struct
+  {
+    int64_t start;		// Time, 0 if it's empty
+    int32_t sum;
+    int16_t min, max;
+    uint16_t count;
+  } TBucket;
+
+  TBucket tiers[TREND_TIERS][TREND_BUCKETS]; // Rings, by start time
+  int64_t newest;		// Time of the last one we added
+};
+
+#endif
@@ -0,0 +1,403 @@
+ /********************************************************************************
+ *  File: xpmload.cpp								*
+ *  Author: Gaspar Fernández (helyo@totaki.com) 				*
+ *										*
+ *  Copyright (C) 2008   Gaspar Fernández					*
+ *										*
+ *  This program is free software: you can redistribute it and/or modify	*
+ *  it under the terms of the GNU General Public License as published by	*
+ *  the Free Software Foundation, either version 3 of the License, or 		*
+ *  (at your option) any later version.  	      	  	   		*
+ *										*
+ *  This program is distributed in the hope that it will be useful,		*
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of		*
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the		*
+ *  GNU General Public License for more details.				*
+ *										*
+ *  You should have received a copy of the GNU General Public License		*
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.	*
+ *									        *
+ ********************************************************************************
+ *   Description:
+ *     Small XPM loader for our themes. The file is mmap'ed and decoded in a
+ *   single pass: colours go to a table indexed directly by the characters
+ *   of each pixel (one or two characters, as our XPMs use), so decoding a
+ *   row is just a table lookup per pixel. It gives 0xAARRGGBB pixels and
+ *   doesn't need an X display.
+ *     We understand #RGB colours (1 to 4 hex digits per channel), None and
+ *   a few names. Anything else is drawn black.
+ *
+ *   Change History:
+ *    Date       Author     Modification
+ *
+ ********************************************************************************/
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "xpmload.h"
+#include "errors.h"
+
+using namespace std;
+
+typedef struct
+{
+  const char *name;
+  unsigned int rgb;
+} TNamedColor;
+
+static const TNamedColor named_colors[] =
+  {
+    {"black",   0x000000}, {"white",   0xffffff}, {"red",     0xff0000},
+    {"green",   0x00ff00}, {"blue",    0x0000ff}, {"yellow",  0xffff00},
+    {"cyan",    0x00ffff}, {"magenta", 0xff00ff}, {"gray",    0xbebebe},
+    {"grey",    0xbebebe}, {NULL, 0}
+  };
+
+/*************************************************************
+ *     Function: next_string                                 *
+ *************************************************************
+ *  Description:                                             *
+ *     Finds the next C string in the file, skipping         *
+ *  comments and anything else between strings.              *
+ *                                                           *
+ * Input:                                                    *
+ *   const char *&p - Where to start. Moved after the string *
+ *   const char *end - End of the data                       *
+ *   const char *&str, size_t &len - The string found        *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - False at the end of the data                     *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+static bool next_string(const char *&p, const char *end, const char *&str, size_t &len)
+{
+  while (p<end)
+    {
+      if ((*p=='/') && (p+1<end) && (p[1]=='*'))
+	{
+	  for (p+=2; (p+1<end) && ((*p!='*') || (p[1]!='/')); p++);
+	  p+=2;
+	}
+      else if (*p=='"')
+	{
+	  str=++p;
+	  while ((p<end) && (*p!='"'))
+	    p++;
+	  if (p>=end)
+	    return false;
+	  len=p-str;
+	  p++;
+	  return true;
+	}
+      else
+	p++;
+    }
+  return false;
+}
+
+/*************************************************************
+ *     Function: parse_color                                 *
+ *************************************************************
+ *  Description:                                             *
+ *     Translates an XPM colour to 0xAARRGGBB                *
+ *                                                           *
+ * Input:                                                    *
+ *   string value - #RRGGBB, None, a name...                 *
+ *                                                           *
+ * Output:                                                   *
+ *   unsigned int - Pixel                                    *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+static unsigned int parse_color(const string &value)
+{
+  unsigned int rgb=0, channel;
+  int digits;
+
+  if (strcasecmp(value.data(), "None")==0)
+    return XPM_TRANSPARENT;
+
+  if ((value[0]=='#') && (value.length()>1) && ((value.length()-1)%3==0))
+    {
+      digits=(value.length()-1)/3;
+      for (int c=0; c<3; c++)
+	{
+	  channel=strtoul(value.substr(1+c*digits, digits).data(), NULL, 16);
+	  if (digits>2)		// Keep the 8 higher bits
+	    channel>>=(digits-2)*4;
+	  else if (digits==1)
+	    channel*=0x11;
+	  rgb=(rgb<<8)|channel;
+	}
+      return XPM_OPAQUE|rgb;
+    }
+
+  for (int k=0; named_colors[k].name!=NULL; k++)
+    if (strcasecmp(value.data(), named_colors[k].name)==0)
+      return XPM_OPAQUE|named_colors[k].rgb;
+
+  verbsth(VERB_WARNING, "Unknown XPM color: "+value);
+  return XPM_OPAQUE;
+}
+
+/*************************************************************
+ *     Function: xpm_parse                                   *
+ *************************************************************
+ *  Description:                                             *
+ *     Decodes XPM data.                                     *
+ *                                                           *
+ * Input:                                                    *
+ *   const char *data, size_t len - The XPM file             *
+ *   TXpmImage &img - Where to store the image               *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - False if the data is not right                   *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool xpm_parse(const char *data, size_t len, TXpmImage &img)
+{
+  const char *p=data, *end=data+len;
+  const char *str, *tok;
+  size_t slen;
+  int ncolors, cpp, key;
+  vector<unsigned int> table;	// Direct index, 1 or 2 chars per pixel
+  map<string, unsigned int> wide; // More chars per pixel
+  string value;
+  char header[64];
+  unsigned int color, *row;
+
+  img.pixels=NULL;
+  img.transparent=false;
+
+  if (!next_string(p, end, str, slen) || (slen>=sizeof(header)))
+    return false;
+  memcpy(header, str, slen);
+  header[slen]='\0';
+  if ((sscanf(header, "%d %d %d %d", &img.width, &img.height, &ncolors, &cpp)!=4) ||
+      (img.width<=0) || (img.height<=0) || (ncolors<=0) || (cpp<=0))
+    return false;
+  if (cpp<=2)
+    table.resize(1<<(8*cpp), XPM_OPAQUE);
+
+  for (int c=0; c<ncolors; c++)
+    {
+      if (!next_string(p, end, str, slen) || (slen<(size_t)cpp))
+	return false;
+      // Keys: c (color), g (grey), m (mono), s (symbolic). We prefer c
+      value="";
+      int level=0, best=0;	// c=3, g=2, m=1
+      tok=str+cpp;
+      while (tok<str+slen)
+	{
+	  while ((tok<str+slen) && ((*tok==' ') || (*tok=='\t')))
+	    tok++;
+	  const char *start=tok;
+	  while ((tok<str+slen) && (*tok!=' ') && (*tok!='\t'))
+	    tok++;
+	  string word(start, tok-start);
+	  if (word.empty())
+	    break;
+	  if ((word=="c") || (word=="g") || (word=="g4") || (word=="m") || (word=="s"))
+	    {
+	      level=(word=="c")?3:(word[0]=='g')?2:(word=="m")?1:0;
+	      if (level>best)
+		value="";
+	    }
+	  else if (level>=best)
+	    {
+	      if (level>best)
+		best=level;
+	      value+=(value.empty()?"":" ")+word;
+	    }
+	}
+      color=parse_color(value);
+
+      if (cpp==1)
+	key=(unsigned char)str[0];
+      else if (cpp==2)
+	key=((unsigned char)str[0]<<8)|(unsigned char)str[1];
+      else
+	{
+	  wide[string(str, cpp)]=color;
+	  continue;
+	}
+      table[key]=color;
+    }
+
+  img.pixels=(unsigned int*)malloc(img.width*img.height*sizeof(unsigned int));
+  for (int y=0; y<img.height; y++)
+    {
+      if (!next_string(p, end, str, slen) || (slen<(size_t)(img.width*cpp)))
+	{
+	  xpm_free(img);
+	  return false;
+	}
+      row=img.pixels+y*img.width;
+      if (cpp==1)
+	for (int x=0; x<img.width; x++)
+	  row[x]=table[(unsigned char)str[x]];
+      else if (cpp==2)
+	for (int x=0; x<img.width; x++)
+	  row[x]=table[((unsigned char)str[2*x]<<8)|(unsigned char)str[2*x+1]];
+      else
+	for (int x=0; x<img.width; x++)
+	  row[x]=wide[string(str+x*cpp, cpp)];
+      for (int x=0; x<img.width; x++)
+	img.transparent=img.transparent || (row[x]==XPM_TRANSPARENT);
+    }
+  return true;
+}
+
+/*************************************************************
+ *     Function: xpm_scale                                   *
+ *************************************************************
+ *  Description:                                             *
+ *     Makes the image factor times bigger, with bilinear    *
+ *  interpolation. Colors are weighted by alpha, so the      *
+ *  transparent pixels (black) don't darken the edges, and   *
+ *  the result is opaque where at least half of it covers.   *
+ *  Fixed point, 8 bits for the weights.                     *
+ *                                                           *
+ * Input:                                                    *
+ *   TXpmImage &img - Image to scale                         *
+ *   int factor - 1, 2, 3...                                 *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - False if factor is wrong                         *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool xpm_scale(TXpmImage &img, int factor)
+{
+  int width=img.width*factor, height=img.height*factor;
+  unsigned int *pixels, p[4];
+  unsigned int w[4], a, r, g, b;
+  int sx, sy, fx, fy, x0, y0, x1, y1;
+
+  if (factor<1)
+    return false;
+  if (factor==1)
+    return true;
+
+  pixels=(unsigned int*)malloc(width*height*sizeof(unsigned int));
+  img.transparent=false;
+  for (int y=0; y<height; y++)
+    {
+      sy=((2*y+1)*256)/(2*factor)-128; // Center of the pixel, in source pixels*256
+      if (sy<0) sy=0;
+      y0=sy>>8;
+      fy=sy&0xff;
+      y1=(y0+1<img.height)?y0+1:y0;
+      for (int x=0; x<width; x++)
+	{
+	  sx=((2*x+1)*256)/(2*factor)-128;
+	  if (sx<0) sx=0;
+	  x0=sx>>8;
+	  fx=sx&0xff;
+	  x1=(x0+1<img.width)?x0+1:x0;
+
+	  p[0]=img.pixels[y0*img.width+x0];
+	  p[1]=img.pixels[y0*img.width+x1];
+	  p[2]=img.pixels[y1*img.width+x0];
+	  p[3]=img.pixels[y1*img.width+x1];
+	  w[0]=(256-fx)*(256-fy);
+	  w[1]=fx*(256-fy);
+	  w[2]=(256-fx)*fy;
+	  w[3]=fx*fy;
+
+	  a=r=g=b=0;
+	  for (int k=0; k<4; k++)
+	    if (p[k]!=XPM_TRANSPARENT)
+	      {
+		a+=w[k];
+		r+=((p[k]>>16)&0xff)*(w[k]>>8);
+		g+=((p[k]>>8)&0xff)*(w[k]>>8);
+		b+=(p[k]&0xff)*(w[k]>>8);
+	      }
+	  if (a<32768)		// Less than half of 256*256
+	    {
+	      pixels[y*width+x]=XPM_TRANSPARENT;
+	      img.transparent=true;
+	    }
+	  else
+	    {
+	      a>>=8;
+	      pixels[y*width+x]=XPM_OPAQUE|((r/a)<<16)|((g/a)<<8)|(b/a);
+	    }
+	}
+    }
+
+  free(img.pixels);
+  img.pixels=pixels;
+  img.width=width;
+  img.height=height;
+  return true;
+}
+
+/*************************************************************
+ *     Function: xpm_load, xpm_free                          *
+ *************************************************************
+ *  Description:                                             *
+ *     Maps a file and decodes it. xpm_free() frees the      *
+ *  pixels.                                                  *
+ *                                                           *
+ * Input:                                                    *
+ *   const char *file - XPM file                             *
+ *   TXpmImage &img - Where to store the image               *
+ *                                                           *
+ * Output:                                                   *
+ *   bool - False if we can't read it                        *
+ *                                                           *
+ * Change History:                                           *
+ *  Date      Author      Modification                       *
+ *                                                           *
+ *************************************************************/
+bool xpm_load(const char *file, TXpmImage &img)
+{
+  struct stat st;
+  void *data;
+  bool res;
+  int fd=open(file, O_RDONLY);
+
+  img.pixels=NULL;
+  if (fd<0)
+    return false;
+  if ((fstat(fd, &st)<0) || (st.st_size==0))
+    {
+      close(fd);
+      return false;
+    }
+  data=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data==MAP_FAILED)
+    return false;
+
+  res=xpm_parse((const char*)data, st.st_size, img);
+  munmap(data, st.st_size);
+  return res;
+}
+
+void xpm_free(TXpmImage &img)
+{
+  free(img.pixels);
+  img.pixels=NULL;
+}
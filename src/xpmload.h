@@ -0,0 +1,22 @@
+#ifndef _XPMLOAD_H_
+#define _XPMLOAD_H_
+
+#include <stddef.h>
+
+#define XPM_OPAQUE       0xff000000 // Alpha of every visible pixel
+#define XPM_TRANSPARENT  0x00000000 // Color "None"
+
+typedef struct
+{
+  int width, height;
+  unsigned int *pixels;		// 0xAARRGGBB, width*height. Alpha is 0 or 0xff
+  bool transparent;		// Some pixel is "None", we need a mask
+} TXpmImage;
+
+/* Don't need an X display */
+bool xpm_load(const char *file, TXpmImage &img);
+bool xpm_parse(const char *data, size_t len, TXpmImage &img);
+void xpm_free(TXpmImage &img);
+bool xpm_scale(TXpmImage &img, int factor);	/* Bilinear, once when loading */
+
+#endif